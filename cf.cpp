@@ -1,6 +1,10 @@
 // Copyright (C) 2009 Chris Double. All Rights Reserved.
 // See the license at the end of this file
 #include <cassert>
+#include <climits>
+#include <ctime>
+#include <cerrno>
+#include <cstdlib>
 #include <cmath>
 #include <iostream>
 #include <sstream>
@@ -14,8 +18,16 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
 #include "cf.h"
 
+// Arithmetic on packed vectors uses SSE2 or AVX2 on 64 bit x86
+// processors, chosen at runtime, when compiled with gcc or clang.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__LP64__)
+#define XY_X86_SIMD
+#include <immintrin.h>
+#endif
+
 // If defined, compiles as a test applicatation that tests
 // that things are working.
 #if defined(TEST)
@@ -48,174 +60,980 @@ string escape(string s) {
   XYObject* class::name(XYInteger* lhs) { return dd_##name(lhs, this); } \
   XYObject* class::name(XYSequence* lhs) { return dd_##name(lhs, this); }
 
-#define DD_IMPL2(name, op) \
+// Native arithmetic on machine word integers. Each returns true if
+// the result overflowed, in which case the caller should redo the
+// operation with arbitrary precision.
+#if defined(__GNUC__)
+static inline bool add_overflow(long a, long b, long* r) { return __builtin_add_overflow(a, b, r); }
+static inline bool subtract_overflow(long a, long b, long* r) { return __builtin_sub_overflow(a, b, r); }
+static inline bool multiply_overflow(long a, long b, long* r) { return __builtin_mul_overflow(a, b, r); }
+#else
+static inline bool add_overflow(long a, long b, long* r) {
+  if ((b > 0 && a > LONG_MAX - b) || (b < 0 && a < LONG_MIN - b))
+    return true;
+  *r = a + b;
+  return false;
+}
+
+static inline bool subtract_overflow(long a, long b, long* r) {
+  if ((b < 0 && a > LONG_MAX + b) || (b > 0 && a < LONG_MIN + b))
+    return true;
+  *r = a - b;
+  return false;
+}
+
+static inline bool multiply_overflow(long a, long b, long* r) {
+  if (a != 0 && b != 0) {
+    if ((a == -1 && b == LONG_MIN) || (b == -1 && a == LONG_MIN))
+      return true;
+    if (a != -1 && b != -1 && (a * b) / b != a)
+      return true;
+  }
+  *r = a * b;
+  return false;
+}
+#endif
+
+// Raise the base to the power by squaring. Returns true if the
+// result overflowed.
+static inline bool power_overflow(long base, unsigned int exponent, long* r) {
+  long result = 1;
+  bool overflow = false;
+  while (exponent != 0 && !overflow) {
+    if (exponent & 1)
+      overflow = multiply_overflow(result, base, &result);
+    exponent >>= 1;
+    if (exponent != 0 && !overflow)
+      overflow = multiply_overflow(base, base, &base);
+  }
+  *r = result;
+  return overflow;
+}
+
+// The exponent used when raising to an integer power. The same as
+// XYInteger::as_uint, the magnitude of the value.
+static inline unsigned int exponent_of(long v) {
+  return v < 0 ? -static_cast<unsigned long>(v) : v;
+}
+
+// Elementwise arithmetic on packed vectors
+enum PackedOperator {
+  PACKED_ADD,
+  PACKED_SUBTRACT,
+  PACKED_MULTIPLY,
+  PACKED_DIVIDE,
+  PACKED_POWER
+};
+
+// The kernels below compute 'r = a op b' for elements 'begin' to 'n'.
+// Each operand is an array with a step of one, or a single value
+// with a step of zero. The integer kernels return true if an element
+// overflowed, leaving the rest of 'r' undefined.
+static bool long_kernel(PackedOperator op,
+                        long const* a, size_t as,
+                        long const* b, size_t bs,
+                        long* r, size_t begin, size_t n) {
+  for (size_t i = begin; i < n; ++i) {
+    long x = a[i * as];
+    long y = b[i * bs];
+    bool overflow;
+    switch (op) {
+    case PACKED_ADD: overflow = add_overflow(x, y, r + i); break;
+    case PACKED_SUBTRACT: overflow = subtract_overflow(x, y, r + i); break;
+    case PACKED_MULTIPLY: overflow = multiply_overflow(x, y, r + i); break;
+    default: overflow = power_overflow(x, exponent_of(y), r + i); break;
+    }
+    if (overflow)
+      return true;
+  }
+  return false;
+}
+
+static void double_kernel(PackedOperator op,
+                          double const* a, size_t as,
+                          double const* b, size_t bs,
+                          double* r, size_t begin, size_t n) {
+  for (size_t i = begin; i < n; ++i) {
+    double x = a[i * as];
+    double y = b[i * bs];
+    switch (op) {
+    case PACKED_ADD: r[i] = x + y; break;
+    case PACKED_SUBTRACT: r[i] = x - y; break;
+    case PACKED_MULTIPLY: r[i] = x * y; break;
+    case PACKED_DIVIDE: r[i] = x / y; break;
+    default: r[i] = pow(x, y); break;
+    }
+  }
+}
+
+#if defined(XY_X86_SIMD)
+// The SIMD kernels handle addition and subtraction of integers and
+// all but powers of floats. They start at the first element and
+// return the number of elements done, leaving the rest for the
+// plain kernels. Integer overflow is detected from the sign bits:
+// a sum overflows if its sign differs from the sign of both
+// operands, a difference if the operand signs differ and the
+// result's sign differs from the first operand.
+static bool has_avx2() {
+  static bool const result = __builtin_cpu_supports("avx2");
+  return result;
+}
+
+static size_t long_kernel_sse2(PackedOperator op,
+                               long const* a, size_t as,
+                               long const* b, size_t bs,
+                               long* r, size_t n, bool* overflow) {
+  __m128i const sa = _mm_set1_epi64x(a[0]);
+  __m128i const sb = _mm_set1_epi64x(b[0]);
+  __m128i flags = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = as ? _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i)) : sa;
+    __m128i y = bs ? _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i)) : sb;
+    __m128i z;
+    if (op == PACKED_ADD) {
+      z = _mm_add_epi64(x, y);
+      flags = _mm_or_si128(flags, _mm_and_si128(_mm_xor_si128(x, z), _mm_xor_si128(y, z)));
+    }
+    else {
+      z = _mm_sub_epi64(x, y);
+      flags = _mm_or_si128(flags, _mm_and_si128(_mm_xor_si128(x, y), _mm_xor_si128(x, z)));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), z);
+  }
+  *overflow = _mm_movemask_pd(_mm_castsi128_pd(flags)) != 0;
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t long_kernel_avx2(PackedOperator op,
+                               long const* a, size_t as,
+                               long const* b, size_t bs,
+                               long* r, size_t n, bool* overflow) {
+  __m256i const sa = _mm256_set1_epi64x(a[0]);
+  __m256i const sb = _mm256_set1_epi64x(b[0]);
+  __m256i flags = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = as ? _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i)) : sa;
+    __m256i y = bs ? _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + i)) : sb;
+    __m256i z;
+    if (op == PACKED_ADD) {
+      z = _mm256_add_epi64(x, y);
+      flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_xor_si256(x, z), _mm256_xor_si256(y, z)));
+    }
+    else {
+      z = _mm256_sub_epi64(x, y);
+      flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_xor_si256(x, y), _mm256_xor_si256(x, z)));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), z);
+  }
+  *overflow = _mm256_movemask_pd(_mm256_castsi256_pd(flags)) != 0;
+  return i;
+}
+
+static size_t double_kernel_sse2(PackedOperator op,
+                                 double const* a, size_t as,
+                                 double const* b, size_t bs,
+                                 double* r, size_t n) {
+  __m128d const sa = _mm_set1_pd(a[0]);
+  __m128d const sb = _mm_set1_pd(b[0]);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = as ? _mm_loadu_pd(a + i) : sa;
+    __m128d y = bs ? _mm_loadu_pd(b + i) : sb;
+    __m128d z;
+    switch (op) {
+    case PACKED_ADD: z = _mm_add_pd(x, y); break;
+    case PACKED_SUBTRACT: z = _mm_sub_pd(x, y); break;
+    case PACKED_MULTIPLY: z = _mm_mul_pd(x, y); break;
+    default: z = _mm_div_pd(x, y); break;
+    }
+    _mm_storeu_pd(r + i, z);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t double_kernel_avx2(PackedOperator op,
+                                 double const* a, size_t as,
+                                 double const* b, size_t bs,
+                                 double* r, size_t n) {
+  __m256d const sa = _mm256_set1_pd(a[0]);
+  __m256d const sb = _mm256_set1_pd(b[0]);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = as ? _mm256_loadu_pd(a + i) : sa;
+    __m256d y = bs ? _mm256_loadu_pd(b + i) : sb;
+    __m256d z;
+    switch (op) {
+    case PACKED_ADD: z = _mm256_add_pd(x, y); break;
+    case PACKED_SUBTRACT: z = _mm256_sub_pd(x, y); break;
+    case PACKED_MULTIPLY: z = _mm256_mul_pd(x, y); break;
+    default: z = _mm256_div_pd(x, y); break;
+    }
+    _mm256_storeu_pd(r + i, z);
+  }
+  return i;
+}
+#endif
+
+// Compute 'r = a op b' for 'n' elements using the fastest kernels
+// available. Returns true if an integer element overflowed.
+static bool long_math(PackedOperator op,
+                      long const* a, size_t as,
+                      long const* b, size_t bs,
+                      long* r, size_t n) {
+  size_t done = 0;
+#if defined(XY_X86_SIMD)
+  if (op == PACKED_ADD || op == PACKED_SUBTRACT) {
+    bool overflow = false;
+    done = has_avx2() ? long_kernel_avx2(op, a, as, b, bs, r, n, &overflow)
+                      : long_kernel_sse2(op, a, as, b, bs, r, n, &overflow);
+    if (overflow)
+      return true;
+  }
+#endif
+  return long_kernel(op, a, as, b, bs, r, done, n);
+}
+
+static void double_math(PackedOperator op,
+                        double const* a, size_t as,
+                        double const* b, size_t bs,
+                        double* r, size_t n) {
+  size_t done = 0;
+#if defined(XY_X86_SIMD)
+  if (op != PACKED_POWER)
+    done = has_avx2() ? double_kernel_avx2(op, a, as, b, bs, r, n)
+                      : double_kernel_sse2(op, a, as, b, bs, r, n);
+#endif
+  double_kernel(op, a, as, b, bs, r, done, n);
+}
+
+// An operand of packed vector arithmetic. Either the array of a
+// packed vector or a single native number with a step of zero.
+struct PackedOperand {
+  bool mFloat;
+  long const* mLongs;
+  double const* mDoubles;
+  size_t mStep;
+  size_t mSize;
+
+  // Storage for a single number
+  long mLong;
+  double mDouble;
+
+  // Integers converted for float arithmetic
+  vector<double> mConverted;
+};
+
+// Ranges take part in packed arithmetic as a packed vector of their
+// elements, and pipelines as their results
+static XYObject* packed_form(XYObject* o) {
+  XYPipeline* pipeline = dynamic_cast<XYPipeline*>(o);
+  if (pipeline)
+    o = pipeline->force();
+
+  XYRange* range = dynamic_cast<XYRange*>(o);
+  if (!range)
+    return o;
+
+  return range->elements() ? range->mElements : range->expand();
+}
+
+// Fill in the operand from the object. Returns false if the object
+// is not a packed vector or a native number.
+static bool packed_operand(XYObject* o, PackedOperand& operand) {
+  o = packed_form(o);
+  operand.mLongs = 0;
+  operand.mDoubles = 0;
+  operand.mStep = 1;
+
+  XYIntVector* ints = dynamic_cast<XYIntVector*>(o);
+  if (ints && !ints->mBoxed) {
+    operand.mFloat = false;
+    operand.mSize = ints->mValues.size();
+    if (operand.mSize > 0)
+      operand.mLongs = &ints->mValues[0];
+    return true;
+  }
+
+  XYFloatVector* floats = dynamic_cast<XYFloatVector*>(o);
+  if (floats && !floats->mBoxed) {
+    operand.mFloat = true;
+    operand.mSize = floats->mValues.size();
+    if (operand.mSize > 0)
+      operand.mDoubles = &floats->mValues[0];
+    return true;
+  }
+
+  operand.mStep = 0;
+  operand.mSize = 1;
+
+  XYInteger* integer = dynamic_cast<XYInteger*>(o);
+  if (integer && !integer->mBig) {
+    operand.mFloat = false;
+    operand.mLong = integer->mSmall;
+    operand.mLongs = &operand.mLong;
+    return true;
+  }
+
+  XYFloat* f = dynamic_cast<XYFloat*>(o);
+  if (f && !f->mBig) {
+    operand.mFloat = true;
+    operand.mDouble = f->mDouble;
+    operand.mDoubles = &operand.mDouble;
+    return true;
+  }
+
+  return false;
+}
+
+// Returns the elements of the operand as floats, converting
+// integers. Integer exponents are converted to the exponent the
+// boxed power would use.
+static double const* packed_doubles(PackedOperand& operand, bool exponent) {
+  if (operand.mFloat)
+    return operand.mDoubles;
+
+  operand.mConverted.resize(operand.mSize);
+  for (size_t i = 0; i < operand.mSize; ++i) {
+    long v = operand.mLongs[i];
+    operand.mConverted[i] = exponent ? static_cast<double>(exponent_of(v)) : static_cast<double>(v);
+  }
+  return &operand.mConverted[0];
+}
+
+// Apply the operator elementwise when one operand is a packed vector
+// and the other is a packed vector of the same size or a native
+// number. The result is a packed vector. Returns null for any other
+// operands, or if an integer result overflows, in which case the
+// caller falls back to boxed arithmetic.
+static XYObject* packed_math(XYObject* lhs, XYObject* rhs, PackedOperator op) {
+  PackedOperand l;
+  PackedOperand r;
+  if (!packed_operand(lhs, l) || !packed_operand(rhs, r))
+    return 0;
+
+  if ((l.mStep == 0 && r.mStep == 0) || (l.mStep && r.mStep && l.mSize != r.mSize))
+    return 0;
+
+  size_t n = l.mStep ? l.mSize : r.mSize;
+  if (n == 0)
+    return 0;
+
+  if (!l.mFloat && !r.mFloat && op != PACKED_DIVIDE) {
+    XYIntVector* result(new XYIntVector(n));
+    if (long_math(op, l.mLongs, l.mStep, r.mLongs, r.mStep, &result->mValues[0], n))
+      return 0;
+    return result;
+  }
+
+  XYFloatVector* result(new XYFloatVector(n));
+  double_math(op,
+              packed_doubles(l, false), l.mStep,
+              packed_doubles(r, op == PACKED_POWER), r.mStep,
+              &result->mValues[0], n);
+  return result;
+}
+
+// Reductions over packed arrays
+enum PackedReduction {
+  REDUCE_SUM,
+  REDUCE_PRODUCT,
+  REDUCE_MIN,
+  REDUCE_MAX,
+  REDUCE_DOT     // Sum of the products of the elements of two arrays
+};
+
+// Combine an element into the running result. The integer version
+// returns true if the result overflowed.
+static inline double reduce_double(PackedReduction op, double r, double x) {
+  switch (op) {
+  case REDUCE_PRODUCT: return r * x;
+  case REDUCE_MIN: return x < r ? x : r;
+  case REDUCE_MAX: return x > r ? x : r;
+  default: return r + x;
+  }
+}
+
+static inline bool reduce_long(PackedReduction op, long* r, long x) {
+  switch (op) {
+  case REDUCE_PRODUCT: return multiply_overflow(*r, x, r);
+  case REDUCE_MIN: *r = x < *r ? x : *r; return false;
+  case REDUCE_MAX: *r = x > *r ? x : *r; return false;
+  default: return add_overflow(*r, x, r);
+  }
+}
+
+// The kernels below combine elements 'begin' to 'n' of 'a', or of
+// the products of 'a' and 'b' for a dot product, into 'r'.
+static bool long_reduce_kernel(PackedReduction op,
+                               long const* a, long const* b,
+                               long* r, size_t begin, size_t n) {
+  for (size_t i = begin; i < n; ++i) {
+    long x = a[i];
+    if (op == REDUCE_DOT && multiply_overflow(a[i], b[i], &x))
+      return true;
+    if (reduce_long(op, r, x))
+      return true;
+  }
+  return false;
+}
+
+static void double_reduce_kernel(PackedReduction op,
+                                 double const* a, double const* b,
+                                 double* r, size_t begin, size_t n) {
+  for (size_t i = begin; i < n; ++i)
+    *r = reduce_double(op, *r, op == REDUCE_DOT ? a[i] * b[i] : a[i]);
+}
+
+#if defined(XY_X86_SIMD)
+// The SIMD reductions keep a running result in each lane, starting
+// from the first elements, and combine the lanes into 'r' at the
+// end. They return the number of elements done. Floats are added and
+// multiplied in a different order to a left fold so sums and
+// products can differ from it in the last bits. Integer sums are
+// checked for overflow as in the elementwise kernels. There are no
+// 64 bit integer min and max comparisons in SSE2 so those only use
+// AVX2.
+static size_t long_reduce_sse2(PackedReduction op, long const* a,
+                               long* r, size_t n, bool* overflow) {
+  assert(op == REDUCE_SUM);
+  if (n < 2)
+    return 0;
+
+  __m128i acc = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a));
+  __m128i flags = _mm_setzero_si128();
+  size_t i = 2;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i));
+    __m128i z = _mm_add_epi64(acc, x);
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_xor_si128(acc, z), _mm_xor_si128(x, z)));
+    acc = z;
+  }
+
+  long lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+  *overflow = _mm_movemask_pd(_mm_castsi128_pd(flags)) != 0 ||
+    reduce_long(op, r, lanes[0]) || reduce_long(op, r, lanes[1]);
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t long_reduce_avx2(PackedReduction op, long const* a,
+                               long* r, size_t n, bool* overflow) {
+  assert(op == REDUCE_SUM || op == REDUCE_MIN || op == REDUCE_MAX);
+  if (n < 4)
+    return 0;
+
+  __m256i acc = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a));
+  __m256i flags = _mm256_setzero_si256();
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i));
+    if (op == REDUCE_MIN)
+      acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(acc, x));
+    else if (op == REDUCE_MAX)
+      acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(x, acc));
+    else {
+      __m256i z = _mm256_add_epi64(acc, x);
+      flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_xor_si256(acc, z), _mm256_xor_si256(x, z)));
+      acc = z;
+    }
+  }
+
+  long lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  *overflow = _mm256_movemask_pd(_mm256_castsi256_pd(flags)) != 0;
+  for (int k = 0; k < 4 && !*overflow; ++k)
+    *overflow = reduce_long(op, r, lanes[k]);
+  return i;
+}
+
+static size_t double_reduce_sse2(PackedReduction op,
+                                 double const* a, double const* b,
+                                 double* r, size_t n) {
+  if (n < 2)
+    return 0;
+
+  __m128d acc = _mm_loadu_pd(a);
+  if (op == REDUCE_DOT)
+    acc = _mm_mul_pd(acc, _mm_loadu_pd(b));
+  size_t i = 2;
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    switch (op) {
+    case REDUCE_PRODUCT: acc = _mm_mul_pd(acc, x); break;
+    case REDUCE_MIN: acc = _mm_min_pd(acc, x); break;
+    case REDUCE_MAX: acc = _mm_max_pd(acc, x); break;
+    case REDUCE_DOT: acc = _mm_add_pd(acc, _mm_mul_pd(x, _mm_loadu_pd(b + i))); break;
+    default: acc = _mm_add_pd(acc, x); break;
+    }
+  }
+
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  for (int k = 0; k < 2; ++k)
+    *r = reduce_double(op, *r, lanes[k]);
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t double_reduce_avx2(PackedReduction op,
+                                 double const* a, double const* b,
+                                 double* r, size_t n) {
+  if (n < 4)
+    return 0;
+
+  __m256d acc = _mm256_loadu_pd(a);
+  if (op == REDUCE_DOT)
+    acc = _mm256_mul_pd(acc, _mm256_loadu_pd(b));
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    switch (op) {
+    case REDUCE_PRODUCT: acc = _mm256_mul_pd(acc, x); break;
+    case REDUCE_MIN: acc = _mm256_min_pd(acc, x); break;
+    case REDUCE_MAX: acc = _mm256_max_pd(acc, x); break;
+    case REDUCE_DOT: acc = _mm256_add_pd(acc, _mm256_mul_pd(x, _mm256_loadu_pd(b + i))); break;
+    default: acc = _mm256_add_pd(acc, x); break;
+    }
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  for (int k = 0; k < 4; ++k)
+    *r = reduce_double(op, *r, lanes[k]);
+  return i;
+}
+#endif
+
+// Combine 'n' elements into 'r', which holds the starting value,
+// using the fastest kernels available. For min and max the starting
+// value must be an element. Returns true if an integer result
+// overflowed.
+static bool long_reduce(PackedReduction op,
+                        long const* a, long const* b,
+                        long* r, size_t n) {
+  size_t done = 0;
+#if defined(XY_X86_SIMD)
+  bool overflow = false;
+  if (op == REDUCE_SUM)
+    done = has_avx2() ? long_reduce_avx2(op, a, r, n, &overflow)
+                      : long_reduce_sse2(op, a, r, n, &overflow);
+  else if ((op == REDUCE_MIN || op == REDUCE_MAX) && has_avx2())
+    done = long_reduce_avx2(op, a, r, n, &overflow);
+  if (overflow)
+    return true;
+#endif
+  return long_reduce_kernel(op, a, b, r, done, n);
+}
+
+static void double_reduce(PackedReduction op,
+                          double const* a, double const* b,
+                          double* r, size_t n) {
+  size_t done = 0;
+#if defined(XY_X86_SIMD)
+  done = has_avx2() ? double_reduce_avx2(op, a, b, r, n)
+                    : double_reduce_sse2(op, a, b, r, n);
+#endif
+  double_reduce_kernel(op, a, b, r, done, n);
+}
+
+// Returns the sequence if it is a packed vector of integers or of
+// floats that has not been boxed, otherwise null.
+static XYIntVector* unboxed_longs(XYSequence* sequence) {
+  XYIntVector* vector = dynamic_cast<XYIntVector*>(packed_form(sequence));
+  return vector && !vector->mBoxed ? vector : 0;
+}
+
+static XYFloatVector* unboxed_doubles(XYSequence* sequence) {
+  XYFloatVector* vector = dynamic_cast<XYFloatVector*>(packed_form(sequence));
+  return vector && !vector->mBoxed ? vector : 0;
+}
+
+// Reduce a sequence, or the products of the elements of two
+// sequences of the same size for a dot product. Packed vectors of
+// one type use the kernels. Anything else, and integers that
+// overflow, are reduced with boxed arithmetic a span at a time. Min
+// and max need a non-empty sequence.
+static XYObject* reduce_sequence(PackedReduction op, XYSequence* a, XYSequence* b) {
+  size_t n = a->size();
+  bool extreme = op == REDUCE_MIN || op == REDUCE_MAX;
+  assert(!extreme || n > 0);
+  assert(op != REDUCE_DOT || b->size() == n);
+
+  XYIntVector* la = unboxed_longs(a);
+  XYIntVector* lb = b ? unboxed_longs(b) : 0;
+  if (n > 0 && la && (op != REDUCE_DOT || lb)) {
+    long r = extreme ? la->mValues[0] : (op == REDUCE_PRODUCT ? 1 : 0);
+    if (!long_reduce(op, &la->mValues[0], lb ? &lb->mValues[0] : 0, &r, n))
+      return XYInteger::make(r);
+  }
+
+  XYFloatVector* da = unboxed_doubles(a);
+  XYFloatVector* db = b ? unboxed_doubles(b) : 0;
+  if (n > 0 && da && (op != REDUCE_DOT || db)) {
+    double r = extreme ? da->mValues[0] : (op == REDUCE_PRODUCT ? 1.0 : 0.0);
+    double_reduce(op, &da->mValues[0], db ? &db->mValues[0] : 0, &r, n);
+    return new XYFloat(r);
+  }
+
+  XYObject* result = extreme ? 0 : XYInteger::make(op == REDUCE_PRODUCT ? 1 : 0);
+  XYSpan span(a);
+  if (op == REDUCE_DOT) {
+    XYSpan other(b);
+    for (XYObject* x = span.read(), *y = other.read(); x && y; x = span.read(), y = other.read())
+      result = result->add(x->multiply(y));
+    return result;
+  }
+
+  while (span.next()) {
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it) {
+      if (op == REDUCE_SUM)
+        result = result->add(*it);
+      else if (op == REDUCE_PRODUCT)
+        result = result->multiply(*it);
+      else if (!result || (op == REDUCE_MIN ? (*it)->compare(result) < 0 : (*it)->compare(result) > 0))
+        result = *it;
+    }
+  }
+  return result;
+}
+
+// Returns the running sums of the elements of a sequence
+static XYSequence* scan_sequence(XYSequence* sequence) {
+  size_t n = sequence->size();
+  if (n == 0)
+    return new XYList();
+
+  XYIntVector* longs = unboxed_longs(sequence);
+  if (longs) {
+    XYIntVector* result(new XYIntVector(n));
+    long r = 0;
+    size_t i = 0;
+    for (; i < n && !add_overflow(r, longs->mValues[i], &r); ++i)
+      result->mValues[i] = r;
+    if (i == n)
+      return result;
+  }
+
+  XYFloatVector* doubles = unboxed_doubles(sequence);
+  if (doubles) {
+    XYFloatVector* result(new XYFloatVector(n));
+    double r = 0.0;
+    for (size_t i = 0; i < n; ++i)
+      result->mValues[i] = r += doubles->mValues[i];
+    return result;
+  }
+
+  XYList* result(new XYList());
+  result->mList.reserve(n);
+  XYSpan span(sequence);
+  XYObject* r = 0;
+  for (XYObject* x = span.read(); x; x = span.read()) {
+    r = r ? r->add(x) : x;
+    result->mList.push_back(r);
+  }
+  return result;
+}
+
+#define DD_IMPL2(name, op, packed) \
 static XYObject* dd_##name(XYFloat* lhs, XYFloat* rhs) { \
-  return new XYFloat(lhs->mValue op rhs->mValue);	 \
+  if (!lhs->mBig && !rhs->mBig) \
+    return new XYFloat(lhs->mDouble op rhs->mDouble); \
+  return new XYFloat(mpf_class(lhs->value() op rhs->value())); \
 } \
 \
 static XYObject* dd_##name(XYFloat* lhs, XYInteger* rhs) { \
-  return new XYFloat(lhs->mValue op rhs->as_float()->mValue); \
+  if (!lhs->mBig && !rhs->mBig) \
+    return new XYFloat(lhs->mDouble op static_cast<double>(rhs->mSmall)); \
+  return dd_##name(lhs, rhs->as_float()); \
 } \
 \
 static XYObject* dd_##name(XYFloat* lhs, XYSequence* rhs) { \
+  XYObject* result = packed_math(lhs, rhs, packed); \
+  if (result) \
+    return result; \
   XYList* list(new XYList()); \
-  size_t len = rhs->size();\
-  for(int i=0; i < len; ++i)\
-    list->mList.push_back(lhs->name(rhs->at(i)));	\
+  list->mList.reserve(rhs->size()); \
+  XYSpan span(rhs); \
+  while (span.next()) \
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it) \
+      list->mList.push_back(lhs->name(*it)); \
   return list; \
 }\
 \
 static XYObject* dd_##name(XYInteger* lhs, XYFloat* rhs) { \
-  return new XYFloat(lhs->as_float()->mValue op rhs->mValue); \
+  if (!lhs->mBig && !rhs->mBig) \
+    return new XYFloat(static_cast<double>(lhs->mSmall) op rhs->mDouble); \
+  return dd_##name(lhs->as_float(), rhs); \
 } \
 \
 static XYObject* dd_##name(XYInteger* lhs, XYInteger* rhs) { \
-  return new XYInteger(lhs->mValue op rhs->mValue); \
+  long result; \
+  if (!lhs->mBig && !rhs->mBig && !name##_overflow(lhs->mSmall, rhs->mSmall, &result)) \
+    return XYInteger::make(result); \
+  return new XYInteger(mpz_class(lhs->value() op rhs->value())); \
 } \
 \
 static XYObject* dd_##name(XYInteger* lhs, XYSequence* rhs) { \
+  XYObject* result = packed_math(lhs, rhs, packed); \
+  if (result) \
+    return result; \
   XYList* list(new XYList()); \
-  size_t len = rhs->size();\
-  for(int i=0; i < len; ++i)\
-    list->mList.push_back(lhs->name(rhs->at(i)));	\
+  list->mList.reserve(rhs->size()); \
+  XYSpan span(rhs); \
+  while (span.next()) \
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it) \
+      list->mList.push_back(lhs->name(*it)); \
   return list; \
 } \
 \
 static XYObject* dd_##name(XYSequence* lhs, XYObject* rhs) { \
+  XYObject* result = packed_math(lhs, rhs, packed); \
+  if (result) \
+    return result; \
   XYList* list(new XYList()); \
-  size_t len = lhs->size();\
-  for(int i=0; i < len; ++i)\
-    list->mList.push_back(lhs->at(i)->name(rhs));	\
+  list->mList.reserve(lhs->size()); \
+  XYSpan span(lhs); \
+  while (span.next()) \
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it) \
+      list->mList.push_back((*it)->name(rhs)); \
   return list; \
 } \
 \
 static XYObject* dd_##name(XYSequence* lhs, XYSequence* rhs) { \
+  XYObject* result = packed_math(lhs, rhs, packed); \
+  if (result) \
+    return result; \
   assert(lhs->size() == rhs->size()); \
   XYList* list(new XYList()); \
-  size_t lhs_len = lhs->size();\
-  size_t rhs_len = rhs->size();\
-  for(int li = 0, ri = 0; li < lhs_len && ri < rhs_len; ++li, ++ri)\
-    list->mList.push_back(lhs->at(li)->name(rhs->at(ri)));    \
+  list->mList.reserve(lhs->size()); \
+  XYSpan lhs_span(lhs); \
+  XYSpan rhs_span(rhs); \
+  for (XYObject* l = lhs_span.read(), *r = rhs_span.read(); l && r; \
+       l = lhs_span.read(), r = rhs_span.read()) \
+    list->mList.push_back(l->name(r)); \
   return list; \
 }
 
-DD_IMPL2(add, +)
-DD_IMPL2(subtract, -)
-DD_IMPL2(multiply, *)
+DD_IMPL2(add, +, PACKED_ADD)
+DD_IMPL2(subtract, -, PACKED_SUBTRACT)
+DD_IMPL2(multiply, *, PACKED_MULTIPLY)
 
 static XYObject* dd_divide(XYFloat* lhs, XYFloat* rhs) {
-  return new XYFloat(lhs->mValue / rhs->mValue);
+  if (!lhs->mBig && !rhs->mBig)
+    return new XYFloat(lhs->mDouble / rhs->mDouble);
+  return new XYFloat(mpf_class(lhs->value() / rhs->value()));
 }
 
 static XYObject* dd_divide(XYFloat* lhs, XYInteger* rhs) {
-  return new XYFloat(lhs->mValue / rhs->as_float()->mValue);
+  return dd_divide(lhs, rhs->as_float());
 }
 
 static XYObject* dd_divide(XYFloat* lhs, XYSequence* rhs) { 
+  XYObject* result = packed_math(lhs, rhs, PACKED_DIVIDE);
+  if (result)
+    return result;
   XYList* list(new XYList());
-  size_t len = rhs->size();
-  for (int i=0; i < len; ++i)
-    list->mList.push_back(lhs->divide(rhs->at(i)));
+  list->mList.reserve(rhs->size());
+  XYSpan span(rhs);
+  while (span.next())
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+      list->mList.push_back(lhs->divide(*it));
   return list;
 }
 
 static XYObject* dd_divide(XYInteger* lhs, XYFloat* rhs) {
-  return new XYFloat(lhs->as_float()->mValue / rhs->mValue);
+  return dd_divide(lhs->as_float(), rhs);
 }
 
 static XYObject* dd_divide(XYInteger* lhs, XYInteger* rhs) {
-  return new XYFloat(lhs->as_float()->mValue / rhs->as_float()->mValue);
+  return dd_divide(lhs->as_float(), rhs->as_float());
 }
 
 static XYObject* dd_divide(XYInteger* lhs, XYSequence* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_DIVIDE);
+  if (result)
+    return result;
   XYList* list(new XYList());
-  size_t len = rhs->size();
-  for (int i=0; i < len; ++i)
-    list->mList.push_back(lhs->divide(rhs->at(i)));
+  list->mList.reserve(rhs->size());
+  XYSpan span(rhs);
+  while (span.next())
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+      list->mList.push_back(lhs->divide(*it));
   return list;
 }
 
 static XYObject* dd_divide(XYSequence* lhs, XYObject* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_DIVIDE);
+  if (result)
+    return result;
   XYList* list(new XYList());
-  size_t len = lhs->size();
-  for (int i=0; i < len; ++i)
-    list->mList.push_back(lhs->at(i)->divide(rhs));
+  list->mList.reserve(lhs->size());
+  XYSpan span(lhs);
+  while (span.next())
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+      list->mList.push_back((*it)->divide(rhs));
   return list;
 }
 
 
 static XYObject* dd_divide(XYSequence* lhs, XYSequence* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_DIVIDE);
+  if (result)
+    return result;
   assert(lhs->size() == rhs->size());
   XYList* list(new XYList());
-  size_t lhs_len = lhs->size();
-  size_t rhs_len = rhs->size();
-  for(int li=0, ri=0; li < lhs_len && ri < rhs_len; ++li, ++ri)
-    list->mList.push_back(lhs->at(li)->divide(rhs->at(ri)));
+  list->mList.reserve(lhs->size());
+  XYSpan lhs_span(lhs);
+  XYSpan rhs_span(rhs);
+  for (XYObject* l = lhs_span.read(), *r = rhs_span.read(); l && r;
+       l = lhs_span.read(), r = rhs_span.read())
+    list->mList.push_back(l->divide(r));
   return list; 
 }
 
 static XYObject* dd_power(XYFloat* lhs, XYFloat* rhs) {
-  return new XYFloat(pow(static_cast<double>(lhs->mValue.get_d()), 
-			 static_cast<double>(rhs->mValue.get_d())));
+  return new XYFloat(pow(lhs->as_double(), rhs->as_double()));
 }
 
 static XYObject* dd_power(XYFloat* lhs, XYInteger* rhs) {
-  XYFloat* result(new XYFloat(lhs->mValue));
-  mpf_pow_ui(result->mValue.get_mpf_t(), lhs->mValue.get_mpf_t(), rhs->as_uint());
-  return result;
+  if (!lhs->mBig)
+    return new XYFloat(pow(lhs->mDouble, static_cast<double>(rhs->as_uint())));
+
+  mpf_class result;
+  mpf_pow_ui(result.get_mpf_t(), lhs->mBig->get_mpf_t(), rhs->as_uint());
+  return new XYFloat(result);
 }
 
 static XYObject* dd_power(XYFloat* lhs, XYSequence* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_POWER);
+  if (result)
+    return result;
   XYList* list(new XYList());
-  size_t len = rhs->size();
-  for (int i=0; i < len; ++i)
-    list->mList.push_back(lhs->power(rhs->at(i)));
+  list->mList.reserve(rhs->size());
+  XYSpan span(rhs);
+  while (span.next())
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+      list->mList.push_back(lhs->power(*it));
   return list;
 }
 
 static XYObject* dd_power(XYInteger* lhs, XYFloat* rhs) {
-  return new XYFloat(pow(static_cast<double>(lhs->mValue.get_d()), 
-			 static_cast<double>(rhs->mValue.get_d())));
+  return new XYFloat(pow(lhs->value().get_d(), rhs->as_double()));
 }
 
 static XYObject* dd_power(XYInteger* lhs, XYInteger* rhs) {
-  XYInteger* result(new XYInteger(lhs->mValue));
-  mpz_pow_ui(result->mValue.get_mpz_t(), lhs->mValue.get_mpz_t(), rhs->as_uint());
-  return result;
+  unsigned int exponent = rhs->as_uint();
+  long small;
+  if (!lhs->mBig && !power_overflow(lhs->mSmall, exponent, &small))
+    return XYInteger::make(small);
+
+  mpz_class result;
+  mpz_pow_ui(result.get_mpz_t(), lhs->value().get_mpz_t(), exponent);
+  return new XYInteger(result);
 }
 
 static XYObject* dd_power(XYInteger* lhs, XYSequence* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_POWER);
+  if (result)
+    return result;
   XYList* list(new XYList());
-  size_t len = rhs->size();
-  for (int i=0; i < len; ++i)
-    list->mList.push_back(lhs->power(rhs->at(i)));
+  list->mList.reserve(rhs->size());
+  XYSpan span(rhs);
+  while (span.next())
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+      list->mList.push_back(lhs->power(*it));
   return list;
 }
 
 static XYObject* dd_power(XYSequence* lhs, XYObject* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_POWER);
+  if (result)
+    return result;
   XYList* list(new XYList());
-  size_t len = lhs->size();
-  for (int i=0; i < len; ++i)
-    list->mList.push_back(lhs->at(i)->power(rhs));
+  list->mList.reserve(lhs->size());
+  XYSpan span(lhs);
+  while (span.next())
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+      list->mList.push_back((*it)->power(rhs));
   return list;
 }
 
 
 static XYObject* dd_power(XYSequence* lhs, XYSequence* rhs) {
+  XYObject* result = packed_math(lhs, rhs, PACKED_POWER);
+  if (result)
+    return result;
   assert(lhs->size() == rhs->size());
   XYList* list(new XYList());
-  size_t lhs_len = lhs->size();
-  size_t rhs_len = rhs->size();
-  for (int li=0, ri=0; li < lhs_len && ri < rhs_len; ++li, ++ri)
-    list->mList.push_back(lhs->at(li)->power(rhs->at(ri)));
+  list->mList.reserve(lhs->size());
+  XYSpan lhs_span(lhs);
+  XYSpan rhs_span(rhs);
+  for (XYObject* l = lhs_span.read(), *r = rhs_span.read(); l && r;
+       l = lhs_span.read(), r = rhs_span.read())
+    list->mList.push_back(l->power(r));
   return list;
 }
 
+// XYShape
+XYShape* XYShape::empty() {
+  static XYShape* shape = new XYShape();
+  return shape;
+}
+
+// Orders parent slot indexes by the name of the slot
+struct XYParentOrder {
+  XYShape const* mShape;
+
+  XYParentOrder(XYShape const* shape) : mShape(shape) { }
+
+  bool operator()(size_t lhs, size_t rhs) const {
+    return symbol_name(mShape->mIds[lhs]) < symbol_name(mShape->mIds[rhs]);
+  }
+};
+
+XYShape* XYShape::add(unsigned int id, bool parent) {
+  assert(find(id) < 0);
+
+  pair<unsigned int, bool> key(id, parent);
+  Transitions::iterator it = mTransitions.find(key);
+  if (it != mTransitions.end())
+    return (*it).second;
+
+  XYShape* shape = new XYShape(*this);
+  shape->mTransitions.clear();
+  size_t index = mIds.size();
+  shape->mIndexes[id] = index;
+  shape->mIds.push_back(id);
+  shape->mIsParent.push_back(parent);
+  if (parent) {
+    shape->mParents.push_back(index);
+    sort(shape->mParents.begin(), shape->mParents.end(), XYParentOrder(shape));
+  }
+
+  mTransitions[key] = shape;
+  return shape;
+}
+
+XYShape* XYShape::remove(size_t index) {
+  assert(index < mIds.size());
+
+  XYShape* shape = empty();
+  for (size_t i = 0; i < mIds.size(); ++i) {
+    if (i != index)
+      shape = shape->add(mIds[i], mIsParent[i]);
+  }
+  return shape;
+}
+
 // XYSlot
-XYSlot::XYSlot(XYObject* method, XYObject* value, bool parent) :
+XYSlot::XYSlot(XYObject* method, XYObject* value) :
   mMethod(method),
-  mValue(value),
-  mParent(parent) 
+  mValue(value)
 {
 }
 
@@ -227,59 +1045,193 @@ void XYSlot::markChildren() {
 }
 
 // XYObject
-XYObject::XYObject() { }
+XYObject::XYObject() : mShape(XYShape::empty()), mLookupEpoch(0) { }
 
 void XYObject::markChildren() {
   for (Slots::iterator it = mSlots.begin(); 
        it != mSlots.end(); 
        ++it) {
-    (*it).second->mark();
+    (*it).markChildren();
+  }
+}
+
+// Global cache of lookup results, indexed by the shape of the
+// receiver and the slot name. A slot found in the receiver itself
+// depends only on the shape. Otherwise the result also depends on
+// the parents of the receiver, so these are recorded and must match.
+// Anything further up the prototype chain can only change by adding
+// or removing slots or setting parent slots, which changes the lookup
+// version. Objects referenced by the cache are marked so their
+// addresses can't be reused while cached.
+class XYMethodCache : public GCObject
+{
+ public:
+  enum {
+    SIZE = 1024,
+    MAX_PARENTS = 2
+  };
+
+  enum Kind {
+    NOT_FOUND,
+    OWN,
+    INHERITED
+  };
+
+  struct Entry {
+    XYShape* mShape;
+    unsigned int mId;
+    unsigned int mVersion;
+    Kind mKind;
+    XYObject* mParents[MAX_PARENTS];
+    XYObject* mHolder;
+    size_t mIndex;
+  };
+
+  Entry mEntries[SIZE];
+
+ public:
+  XYMethodCache() {
+    for (size_t i = 0; i < SIZE; ++i) {
+      mEntries[i].mShape = 0;
+      mEntries[i].mHolder = 0;
+      for (size_t j = 0; j < MAX_PARENTS; ++j)
+	mEntries[i].mParents[j] = 0;
+    }
+  }
+
+  Entry& entry(XYShape* shape, unsigned int id) {
+    size_t hash = (reinterpret_cast<size_t>(shape) >> 4) ^ (id * 2654435761u);
+    return mEntries[hash & (SIZE - 1)];
+  }
+
+  // True if the entry's parents are those of the object
+  static bool parents_match(Entry const& e, XYObject const* object) {
+    vector<size_t> const& parents = object->mShape->mParents;
+    for (size_t i = 0; i < parents.size(); ++i) {
+      if (e.mParents[i] != object->mSlots[parents[i]].mValue)
+	return false;
+    }
+    return true;
+  }
+
+  virtual void markChildren() {
+    for (size_t i = 0; i < SIZE; ++i) {
+      Entry& e = mEntries[i];
+      if (!e.mShape)
+	continue;
+      for (size_t j = 0; j < MAX_PARENTS; ++j) {
+	if (e.mParents[j])
+	  e.mParents[j]->mark();
+      }
+      if (e.mHolder)
+	e.mHolder->mark();
+    }
+  }
+};
+
+static XYMethodCache& method_cache() {
+  static XYMethodCache* cache = 0;
+  if (!cache) {
+    cache = new XYMethodCache();
+    GarbageCollector::GC.addRoot(cache);
   }
+  return *cache;
 }
 
-XYSlot* XYObject::lookup(std::string const& name, 
-			 std::set<XYObject*>& circular,
-			 XYObject** context) {
+XYSlot* XYObject::lookup(std::string const& name, XYObject** context) {
   assert(name.size() > 0);
+  return lookup(intern_symbol(name), context);
+}
+
+XYSlot* XYObject::lookup(unsigned int id, XYObject** context) {
+  XYMethodCache::Entry& e = method_cache().entry(mShape, id);
+  unsigned int version = lookup_version();
+  if (e.mShape == mShape && e.mId == id && e.mVersion == version) {
+    if (e.mKind == XYMethodCache::OWN) {
+      if (context)
+	*context = this;
+      return &mSlots[e.mIndex];
+    }
+
+    if (XYMethodCache::parents_match(e, this)) {
+      if (e.mKind == XYMethodCache::NOT_FOUND)
+	return 0;
+      if (context)
+	*context = e.mHolder;
+      return &e.mHolder->mSlots[e.mIndex];
+    }
+  }
+
+  static unsigned long epoch = 0;
+  XYObject* holder = 0;
+  XYSlot* slot = find(id, ++epoch, &holder);
+
+  vector<size_t> const& parents = mShape->mParents;
+  if (parents.size() <= XYMethodCache::MAX_PARENTS) {
+    e.mShape = mShape;
+    e.mId = id;
+    e.mVersion = version;
+    for (size_t i = 0; i < XYMethodCache::MAX_PARENTS; ++i)
+      e.mParents[i] = i < parents.size() ? mSlots[parents[i]].mValue : 0;
+    e.mHolder = 0;
+    if (!slot)
+      e.mKind = XYMethodCache::NOT_FOUND;
+    else if (holder == this) {
+      e.mKind = XYMethodCache::OWN;
+      e.mIndex = slot - &mSlots[0];
+    }
+    else {
+      e.mKind = XYMethodCache::INHERITED;
+      e.mHolder = holder;
+      e.mIndex = slot - &holder->mSlots[0];
+    }
+  }
 
-  if (circular.find(this) != circular.end())
+  if (context && slot)
+    *context = holder;
+  return slot;
+}
+
+XYSlot* XYObject::find(unsigned int id, unsigned long epoch, XYObject** context) {
+  if (mLookupEpoch == epoch)
     return 0;
 
-  circular.insert(this);
+  mLookupEpoch = epoch;
 
-  Slots::iterator it = mSlots.find(name);
-  if (it == mSlots.end()) {
+  int index = mShape->find(id);
+  if (index < 0) {
     // Could not find name in the slots of this
     // object. Look for the name in the slots of
     // the parents.
-    for (Slots::iterator it = mSlots.begin();
-	 it != mSlots.end();
+    for (vector<size_t>::const_iterator it = mShape->mParents.begin();
+	 it != mShape->mParents.end();
 	 ++it) {
-      XYSlot* slot = (*it).second;
-      assert(slot);
-      if (slot->mParent) {
-	assert(slot->mValue);
-	XYSlot* found = slot->mValue->lookup(name, circular, context);
-	if (found)
-	  return found;
-      }
+      XYSlot& slot = mSlots[*it];
+      assert(slot.mValue);
+      XYSlot* found = slot.mValue->find(id, epoch, context);
+      if (found)
+	return found;
     }
     // Not found in any parent object, so slot does not exist
     return 0;
   }
 
   // Found the slot in this object. Store the object that the slot
-  // was found in, if requested, as the context.
-  if (context)
-    *context = this;
-
-  return (*it).second;
+  // was found in as the context.
+  *context = this;
+  return &mSlots[index];
 }
 
 XYSlot* XYObject::getSlot(string const& name) {
   assert(name.size() > 0);
-  assert(mSlots.find(name) != mSlots.end());
-  return mSlots[name];
+  int index = mShape->find(intern_symbol(name));
+  assert(index >= 0);
+  return &mSlots[index];
+}
+
+bool XYObject::isParent(XYSlot const* slot) const {
+  assert(slot >= &mSlots[0] && slot < &mSlots[0] + mSlots.size());
+  return mShape->mIsParent[slot - &mSlots[0]];
 }
 
 void XYObject::addSlot(std::string const& name, 
@@ -288,16 +1240,20 @@ void XYObject::addSlot(std::string const& name,
 		       bool parent) {
   assert(name.size() > 0);
   assert(method);
-  assert(mSlots.find(name) == mSlots.end());
 
-  mSlots[name] = new XYSlot(method, value, parent);
+  mShape = mShape->add(intern_symbol(name), parent);
+  mSlots.push_back(XYSlot(method, value));
+  invalidate_lookups();
 }
   
 void XYObject::removeSlot(std::string const& name) {
   assert(name.size() > 0);
-  assert(mSlots.find(name) != mSlots.end());
+  int index = mShape->find(intern_symbol(name));
+  assert(index >= 0);
   
-  mSlots.erase(name);
+  mShape = mShape->remove(index);
+  mSlots.erase(mSlots.begin() + index);
+  invalidate_lookups();
 }
 
 void XYObject::addSlot(std::string const& n, XYObject* value, bool readOnly) {
@@ -355,11 +1311,8 @@ void XYObject::addMethod(std::string const& name, XYObject* method) {
 
 XYObject* XYObject::copy() const {
   XYObject* o = new XYObject();
-  for (Slots::const_iterator it = mSlots.begin();
-       it != mSlots.end();
-       ++it) {
-    o->mSlots[(*it).first] = new XYSlot(*((*it).second));
-  }
+  o->mShape = mShape;
+  o->mSlots = mSlots;
   return o;
 }
 
@@ -374,19 +1327,25 @@ void XYObject::print(ostringstream& stream, CircularSet& seen, bool parse) const
   else {
     seen.insert(this);
     stream << "(| ";
-    for (Slots::const_iterator it = mSlots.begin();
-	 it != mSlots.end();
+
+    // Print the slots ordered by name
+    map<string, size_t> names;
+    for (size_t i = 0; i < mSlots.size(); ++i)
+      names[symbol_name(mShape->mIds[i])] = i;
+
+    for (map<string, size_t>::const_iterator it = names.begin();
+	 it != names.end();
 	 ++it) {
       string name = (*it).first;
-      XYSlot* slot = (*it).second;
+      XYSlot const& slot = mSlots[(*it).second];
       stream << name;
-      if (slot->mParent)
+      if (mShape->mIsParent[(*it).second])
 	stream << '*';
       stream << "=";
-      if (slot->mValue) 
-	slot->mValue->print(stream, seen, parse);
+      if (slot.mValue) 
+	slot.mValue->print(stream, seen, parse);
       else
-	stream << "{" << slot->mMethod << "}";
+	stream << "{" << slot.mMethod << "}";
       stream << " ";
     }
     stream << "|)";
@@ -499,38 +1458,91 @@ DD_IMPL(XYFloat, multiply)
 DD_IMPL(XYFloat, divide)
 DD_IMPL(XYFloat, power)
 
-XYFloat::XYFloat(long v) : XYNumber(FLOAT), mValue(v) { }
-XYFloat::XYFloat(double v) : XYNumber(FLOAT), mValue(v) { }
-XYFloat::XYFloat(string v) : XYNumber(FLOAT), mValue(v) { }
-XYFloat::XYFloat(mpf_class const& v) : XYNumber(FLOAT), mValue(v) { }
+XYFloat::XYFloat(long v) : XYNumber(FLOAT), mDouble(v), mBig(0) { }
+XYFloat::XYFloat(double v) : XYNumber(FLOAT), mDouble(v), mBig(0) { }
+
+XYFloat::XYFloat(string v) : XYNumber(FLOAT), mDouble(0.0), mBig(0) {
+  if (!v.empty() && v[v.size() - 1] == 'm')
+    mBig = new mpf_class(v.substr(0, v.size() - 1));
+  else
+    mDouble = strtod(v.c_str(), 0);
+}
+
+XYFloat::XYFloat(mpf_class const& v) :
+  XYNumber(FLOAT),
+  mDouble(0.0),
+  mBig(new mpf_class(v)) {
+}
+
+XYFloat::XYFloat(XYFloat const& rhs) :
+  XYNumber(FLOAT),
+  mDouble(rhs.mDouble),
+  mBig(rhs.mBig ? new mpf_class(*rhs.mBig) : 0) {
+}
+
+XYFloat::~XYFloat() {
+  delete mBig;
+}
+
+mpf_class XYFloat::value() const {
+  return mBig ? *mBig : mpf_class(mDouble);
+}
+
+double XYFloat::as_double() const {
+  return mBig ? mBig->get_d() : mDouble;
+}
 
 void XYFloat::print(ostringstream& stream, CircularSet&, bool) const {
-  stream << lexical_cast<string>(mValue);
+  if (mBig)
+    stream << lexical_cast<string>(*mBig);
+  else
+    stream << mDouble;
 }
 
 int XYFloat::compare(XYObject* rhs) {
   XYFloat* o = dynamic_cast<XYFloat*>(rhs);
   if (!o) {
     XYInteger* i = dynamic_cast<XYInteger*>(rhs);
-    if (i)
-      return cmp(mValue, i->mValue);
+    if (i && !mBig && !i->mBig) {
+      double d = static_cast<double>(i->mSmall);
+      return mDouble < d ? -1 : (mDouble > d ? 1 : 0);
+    }
+    else if (i)
+      return cmp(value(), i->value());
     else
       return toString(true).compare(rhs->toString(true));
   }
 
-  return cmp(mValue, o->mValue);
+  if (!mBig && !o->mBig)
+    return mDouble < o->mDouble ? -1 : (mDouble > o->mDouble ? 1 : 0);
+
+  return cmp(value(), o->value());
 }
 
 bool XYFloat::is_zero() const {
-  return mValue == 0;
+  return mBig ? *mBig == 0 : mDouble == 0.0;
 }
 
 unsigned int XYFloat::as_uint() const {
-  return mValue.get_ui();
+  if (mBig)
+    return mBig->get_ui();
+
+  // Same as gmp's get_ui, the truncated magnitude of the value
+  return static_cast<unsigned int>(fabs(mDouble));
 }
 
 XYInteger* XYFloat::as_integer() {
-  return new XYInteger(mValue);
+  if (mBig)
+    return new XYInteger(mpz_class(*mBig));
+
+  // Infinities and NaN have no integer value
+  if (!isfinite(mDouble))
+    return XYInteger::make(0);
+
+  if (mDouble >= LONG_MIN && mDouble < LONG_MAX)
+    return XYInteger::make(static_cast<long>(mDouble));
+
+  return new XYInteger(mpz_class(mDouble));
 }
 
 XYFloat* XYFloat::as_float() {
@@ -538,7 +1550,7 @@ XYFloat* XYFloat::as_float() {
 }
 
 XYNumber* XYFloat::floor() {
-  XYFloat* result(new XYFloat(::floor(mValue)));
+  XYFloat* result(mBig ? new XYFloat(mpf_class(::floor(*mBig))) : new XYFloat(::floor(mDouble)));
   return result;
 }
 
@@ -548,12 +1560,75 @@ DD_IMPL(XYInteger, subtract)
 DD_IMPL(XYInteger, multiply)
 DD_IMPL(XYInteger, divide)
 DD_IMPL(XYInteger, power)
-XYInteger::XYInteger(long v) : XYNumber(INTEGER), mValue(v) { }
-XYInteger::XYInteger(string v) : XYNumber(INTEGER), mValue(v) { }
-XYInteger::XYInteger(mpz_class const& v) : XYNumber(INTEGER), mValue(v) { }
+XYInteger::XYInteger(long v) : XYNumber(INTEGER), mSmall(v), mBig(0), mShared(false) { }
+
+XYInteger::XYInteger(string v) : XYNumber(INTEGER), mSmall(0), mBig(0), mShared(false) {
+  // Most literals fit in a machine word and can be converted
+  // without going through gmp.
+  errno = 0;
+  char* end = 0;
+  long n = strtol(v.c_str(), &end, 10);
+  if (errno == 0 && *end == '\0')
+    mSmall = n;
+  else {
+    mpz_class big(v);
+    if (big.fits_slong_p())
+      mSmall = big.get_si();
+    else
+      mBig = new mpz_class(big);
+  }
+}
+
+XYInteger::XYInteger(mpz_class const& v) : XYNumber(INTEGER), mSmall(0), mBig(0), mShared(false) {
+  if (v.fits_slong_p())
+    mSmall = v.get_si();
+  else
+    mBig = new mpz_class(v);
+}
+
+XYInteger::XYInteger(XYInteger const& rhs) :
+  XYNumber(rhs),
+  mSmall(rhs.mSmall),
+  mBig(rhs.mBig ? new mpz_class(*rhs.mBig) : 0),
+  mShared(false) {
+}
+
+XYInteger::~XYInteger() {
+  delete mBig;
+}
+
+XYInteger* XYInteger::make(long v) {
+  // Integers are never modified once created so objects for
+  // common small values can be shared. They are allocated on
+  // first use and are permanent garbage collector roots.
+  static long const first = -128;
+  static long const last = 1024;
+  static XYInteger** cache = 0;
+
+  if (v < first || v >= last)
+    return new XYInteger(v);
+
+  if (!cache) {
+    cache = new XYInteger*[last - first];
+    for (long i = first; i < last; ++i) {
+      cache[i - first] = new XYInteger(i);
+      cache[i - first]->mShared = true;
+      GarbageCollector::GC.addRoot(cache[i - first]);
+    }
+  }
+
+  return cache[v - first];
+}
+
+mpz_class XYInteger::value() const {
+  return mBig ? *mBig : mpz_class(mSmall);
+}
 
 void XYInteger::print(ostringstream& stream, CircularSet&, bool) const {
-  stream << lexical_cast<string>(mValue);
+  if (mBig)
+    stream << lexical_cast<string>(*mBig);
+  else
+    stream << mSmall;
 }
 
 int XYInteger::compare(XYObject* rhs) {
@@ -561,20 +1636,27 @@ int XYInteger::compare(XYObject* rhs) {
   if (!o) {
     XYFloat* f = dynamic_cast<XYFloat*>(rhs);
     if (f)
-      return cmp(mValue, f->mValue);
+      return -f->compare(this);
     else
       return toString(true).compare(rhs->toString(true));
   }
 
-  return cmp(mValue, o->mValue);
+  if (!mBig && !o->mBig)
+    return mSmall < o->mSmall ? -1 : (mSmall > o->mSmall ? 1 : 0);
+
+  return cmp(value(), o->value());
 }
 
 bool XYInteger::is_zero() const {
-  return mValue == 0;
+  return !mBig && mSmall == 0;
 }
 
 unsigned int XYInteger::as_uint() const {
-  return mValue.get_ui();
+  if (mBig)
+    return mBig->get_ui();
+
+  // Same as gmp's get_ui, the magnitude of the value
+  return mSmall < 0 ? -static_cast<unsigned long>(mSmall) : mSmall;
 }
 
 XYInteger* XYInteger::as_integer() {
@@ -582,36 +1664,168 @@ XYInteger* XYInteger::as_integer() {
 }
 
 XYFloat* XYInteger::as_float() {
-  return new XYFloat(mValue);
+  if (mBig)
+    return new XYFloat(mpf_class(*mBig));
+
+  return new XYFloat(mSmall);
 }
 
 XYNumber* XYInteger::floor() {
   return dynamic_cast<XYNumber*>(this);
 }
 
-// XYSymbol
-XYSymbol::XYSymbol(string v) : mValue(v) { }
+// XYSymbolTable
+// Process wide table of interned symbol names. Ids are allocated
+// sequentially so they can be used as indexes into XYEnv tables.
+class XYSymbolTable {
+  public:
+    typedef boost::unordered_map<string, unsigned int> Ids;
+    Ids mIds;
+    vector<string> mNames;
+
+  public:
+    unsigned int intern(string const& name) {
+      Ids::iterator it = mIds.find(name);
+      if (it != mIds.end())
+	return (*it).second;
+
+      unsigned int id = mNames.size();
+      mNames.push_back(name);
+      mIds[name] = id;
+      return id;
+    }
+};
 
-void XYSymbol::print(ostringstream& stream, CircularSet&, bool) const {
-  stream << mValue;
+static XYSymbolTable& symbol_table() {
+  static XYSymbolTable table;
+  return table;
 }
 
-void XYSymbol::eval1(XY* xy) {
-  XYEnv::iterator it = xy->mP.find(mValue);
-  if (it != xy->mP.end()) {
-    // Primitive symbol, execute immediately
-    (*it).second->eval1(xy);
-    return;
-  }
+unsigned int intern_symbol(string const& name) {
+  return symbol_table().intern(name);
+}
+
+string const& symbol_name(unsigned int id) {
+  assert(id < symbol_table().mNames.size());
+  return symbol_table().mNames[id];
+}
+
+// XYEnv
+XYObject* XYEnv::lookup(string const& name) const {
+  return lookup(intern_symbol(name));
+}
+
+XYObject*& XYEnv::operator[](string const& name) {
+  unsigned int id = intern_symbol(name);
+  if (id >= mTable.size())
+    mTable.resize(id + 1, 0);
+  return mTable[id];
+}
+
+size_t XYEnv::size() const {
+  return mTable.size() - count(mTable.begin(), mTable.end(), static_cast<XYObject*>(0));
+}
+
+void XYEnv::clear() {
+  mTable.clear();
+}
+
+void XYEnv::markChildren() {
+  for (Table::iterator it = mTable.begin(); it != mTable.end(); ++it) {
+    if (*it)
+      (*it)->mark();
+  }
+}
+
+// Lookup caching
+static unsigned int current_lookup_version = 1;
+
+unsigned int lookup_version() {
+  return current_lookup_version;
+}
+
+void invalidate_lookups() {
+  ++current_lookup_version;
+}
+
+// Sequence changes
+static unsigned int current_sequence_version = 1;
+
+unsigned int sequence_version() {
+  return current_sequence_version;
+}
+
+void sequence_changed() {
+  ++current_sequence_version;
+}
+
+// Queue captures
+static unsigned int current_capture_version = 1;
+
+unsigned int capture_version() {
+  return current_capture_version;
+}
+
+void queue_captured() {
+  ++current_capture_version;
+}
+
+XYLookupCache::XYLookupCache() :
+  mVersion(0),
+  mObject(0),
+  mSlot(0),
+  mContext(0) {
+}
+
+XYSlot* XYLookupCache::lookup(XYObject* object, unsigned int id, XYObject** context) {
+  if (mVersion != current_lookup_version || mObject != object) {
+    mContext = 0;
+    mSlot = object->lookup(id, &mContext);
+    mObject = object;
+    mVersion = current_lookup_version;
+  }
+
+  if (context)
+    *context = mContext;
+  return mSlot;
+}
+
+void XYLookupCache::markChildren() {
+  if (mObject)
+    mObject->mark();
+  if (mContext)
+    mContext->mark();
+}
+
+// XYSymbol
+XYSymbol::XYSymbol(string v) : mValue(v), mId(intern_symbol(v)) { }
+
+void XYSymbol::markChildren() {
+  XYObject::markChildren();
+  mPrimitivesCache.markChildren();
+  mSlotCache.markChildren();
+}
+
+void XYSymbol::print(ostringstream& stream, CircularSet&, bool) const {
+  stream << mValue;
+}
+
+void XYSymbol::eval1(XY* xy) {
+  XYObject* primitive = xy->mP.lookup(mId);
+  if (primitive) {
+    // Primitive symbol, execute immediately
+    primitive->eval1(xy);
+    return;
+  }
 
   // Look up primitives object. If it's a slot in there,
   // execute immediately.
-  it = xy->mEnv.find("primitives");
-  if (it != xy->mEnv.end()) {
-    XYObject* p = (*it).second;
-    set<XYObject*> circular;
-    XYSlot* slot = p->lookup(mValue, circular, 0);
+  static unsigned int const primitives = intern_symbol("primitives");
+  XYObject* p = xy->mEnv.lookup(primitives);
+  if (p) {
+    XYSlot* slot = mPrimitivesCache.lookup(p, mId, 0);
     if (slot) {
+      xy->materialize();
       xy->mY.push_front(new XYSymbol("."));
       xy->mY.push_front(slot->mMethod);
       xy->mY.push_front(p);
@@ -627,18 +1841,54 @@ int XYSymbol::compare(XYObject* rhs) {
   if (!o)
     return toString(true).compare(rhs->toString(true));
 
+  if (mId == o->mId)
+    return 0;
+
   return mValue.compare(o->mValue);
 }
 
+// XYStringBuffer
+XYStringBuffer::XYStringBuffer(string const& v) : mValue(v) { }
+
 // XYString
-XYString::XYString(string v) : mValue(v) { }
+XYString::XYString(string v) :
+  mBuffer(new XYStringBuffer(v)),
+  mOffset(0),
+  mLength(v.size()),
+  mOwned(true) { }
+
+XYString::XYString(XYStringBuffer* buffer, size_t offset, size_t length) :
+  mBuffer(buffer),
+  mOffset(offset),
+  mLength(length),
+  mOwned(false) { }
+
+string const& XYString::value() {
+  if (mOffset != 0 || mLength != mBuffer->mValue.size()) {
+    mBuffer = new XYStringBuffer(mBuffer->mValue.substr(mOffset, mLength));
+    mOffset = 0;
+    mOwned = true;
+  }
+  return mBuffer->mValue;
+}
+
+XYString* XYString::substr(size_t offset, size_t length) {
+  assert(offset <= mLength);
+  mOwned = false;
+  return new XYString(mBuffer, mOffset + offset, min(length, mLength - offset));
+}
+
+void XYString::markChildren() {
+  XYObject::markChildren();
+  mBuffer->mark();
+}
 
 void XYString::print(ostringstream& stream, CircularSet&, bool parse) const {
   if (parse) {
-    stream << '\"' << escape(mValue) << '\"';
+    stream << '\"' << escape(mBuffer->mValue.substr(mOffset, mLength)) << '\"';
   }
   else {
-    stream << mValue;
+    stream.write(mBuffer->mValue.data() + mOffset, mLength);
   }
 }
 
@@ -647,95 +1897,159 @@ int XYString::compare(XYObject* rhs) {
   if (!o)
     return toString(true).compare(rhs->toString(true));
 
-  return mValue.compare(o->mValue);
+  return mBuffer->mValue.compare(mOffset, mLength, o->mBuffer->mValue, o->mOffset, o->mLength);
 }
 
 size_t XYString::size()
 {
-  return mValue.size();
+  return mLength;
 }
 
 void XYString::pushBackInto(List& list) {
-  for(string::iterator it = mValue.begin(); it != mValue.end(); ++it)
-    list.push_back(new XYInteger(*it));
+  string::const_iterator begin = mBuffer->mValue.begin() + mOffset;
+  for(string::const_iterator it = begin; it != begin + mLength; ++it)
+    list.push_back(XYInteger::make(*it));
 }
 
 XYObject* XYString::at(size_t n)
 {
-  return new XYInteger(mValue[n]);
+  return XYInteger::make(mBuffer->mValue[mOffset + n]);
 }
 
 void XYString::set_at(size_t n, XYObject* v)
 {
-  assert(n < mValue.size());
+  assert(n < mLength);
   XYInteger* c(dynamic_cast<XYInteger*>(v));
   //  xy_assert(c, XYError::TYPE);
   assert(c);
 
-  mValue[n] = c->as_uint(); 
+  if (!mOwned) {
+    mBuffer = new XYStringBuffer(mBuffer->mValue.substr(mOffset, mLength));
+    mOffset = 0;
+    mOwned = true;
+  }
+  mBuffer->mValue[n] = c->as_uint(); 
+  sequence_changed();
 }
 
 XYObject* XYString::head()
 {
-  assert(mValue.size() > 0);
-  return new XYInteger(mValue[0]);
+  assert(mLength > 0);
+  return at(0);
 }
 
 XYSequence* XYString::tail()
 {
-  if (mValue.size() <= 1) 
+  if (mLength <= 1) 
     return new XYString("");
 
-  return new XYString(mValue.substr(1));
+  return substr(1);
 }
 
 XYSequence* XYString::join(XYSequence* rhs)
 {
   XYString const* rhs_string = dynamic_cast<XYString const*>(rhs);
   if (rhs_string) {
-    return new XYString(mValue + rhs_string->mValue);
-  }
-
-  XYSequence* self(dynamic_cast<XYSequence*>(this));
+    string const& chars = rhs_string->mBuffer->mValue;
+    if (mOffset + mLength != mBuffer->mValue.size()) {
+      string value(mBuffer->mValue, mOffset, mLength);
+      return new XYString(value.append(chars, rhs_string->mOffset, rhs_string->mLength));
+    }
 
-  if (dynamic_cast<XYJoin const*>(rhs)) {
-    // Pointer is shared, we have to copy the data
-    XYJoin* join_rhs(dynamic_cast<XYJoin*>(rhs));
-    XYJoin* result(new XYJoin());
-    result->mSequences.push_back(self);
-    result->mSequences.insert(result->mSequences.end(), 
-			      join_rhs->mSequences.begin(), join_rhs->mSequences.end());
-    return result;
+    // Nothing views the end of the buffer so the rhs can be added
+    // to it in place.
+    mBuffer->mValue.append(chars, rhs_string->mOffset, rhs_string->mLength);
+    mOwned = false;
+    return new XYString(mBuffer, mOffset, mLength + rhs_string->mLength);
   }
 
-  return new XYJoin(self, rhs);
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYString::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  // Characters are converted to integers in the buffer
+  size_t count = min(mLength - n, XYSequence::SPAN_BUFFER_SIZE);
+  char const* chars = mBuffer->mValue.data() + mOffset + n;
+  for (size_t i = 0; i < count; ++i)
+    buffer[i] = XYInteger::make(chars[i]);
+  begin = buffer;
+  return count;
 }
 
 // XYShuffle
-XYShuffle::XYShuffle(string v) { 
+XYShuffle::XYShuffle(string v) : mKind(GENERAL) {
   vector<string> result;
   split(result, v, is_any_of("-"));
   assert(result.size() == 2);
   mBefore = result[0];
   mAfter  = result[1];
+
+  for(string::iterator it = mAfter.begin(); it != mAfter.end(); ++it) {
+    size_t index = mBefore.find(*it);
+    assert(index != string::npos);
+    mIndices.push_back(index);
+  }
+
+  if (mBefore.compare(0, mAfter.size(), mAfter) == 0)
+    mKind = DROP;
+  else if (mBefore.size() == 1 && mAfter.size() == 2)
+    mKind = DUP;
+  else if (mBefore.size() == 2 && mAfter.size() == 2 && mIndices[0] == 1 && mIndices[1] == 0)
+    mKind = SWAP;
 }
 
 void XYShuffle::print(ostringstream& stream, CircularSet&, bool) const {
   stream << mBefore << "-" << mAfter;
 }
 
-void XYShuffle::eval1(XY* xy) {
-  xy_assert(xy->mX.size() >= mBefore.size(), XYError::STACK_UNDERFLOW);
-  map<char, XYObject*> env;
-  for(string::reverse_iterator it = mBefore.rbegin(); it != mBefore.rend(); ++it) {
-    env[*it] = xy->mX.back();
-    xy->mX.pop_back();
+// Apply the shuffle to the top of 'stack', which must hold at least
+// as many elements as the shuffle's lhs. Shared with pipelines, which
+// shuffle native numbers.
+template <class T>
+static void shuffle_stack(XYShuffle const* shuffle, vector<T>& stack) {
+  size_t size = stack.size();
+  size_t count = shuffle->mBefore.size();
+  assert(size >= count);
+  size_t base = size - count;
+
+  switch (shuffle->mKind) {
+    case XYShuffle::DROP:
+      stack.resize(base + shuffle->mAfter.size());
+      return;
+
+    case XYShuffle::DUP:
+      stack.push_back(stack.back());
+      return;
+
+    case XYShuffle::SWAP:
+      swap(stack[base], stack[base + 1]);
+      return;
+
+    case XYShuffle::GENERAL:
+      break;
   }
 
-  for(string::iterator it = mAfter.begin(); it != mAfter.end(); ++it) {
-    assert(env.find(*it) != env.end());
-    xy->mX.push_back(env[*it]);
+  // Copy the elements being shuffled aside, using a fixed buffer
+  // for the usual small patterns.
+  T buffer[16];
+  vector<T> large;
+  T* saved = buffer;
+  if (count > sizeof(buffer) / sizeof(buffer[0])) {
+    large.resize(count);
+    saved = &large[0];
   }
+  std::copy(stack.begin() + base, stack.end(), saved);
+
+  stack.resize(base + shuffle->mIndices.size());
+  typename vector<T>::iterator out = stack.begin() + base;
+  for(vector<size_t>::const_iterator it = shuffle->mIndices.begin(); it != shuffle->mIndices.end(); ++it)
+    *out++ = saved[*it];
+}
+
+void XYShuffle::eval1(XY* xy) {
+  xy_assert(xy->mX.size() >= mBefore.size(), XYError::STACK_UNDERFLOW);
+  shuffle_stack(this, xy->mX);
 }
 
 int XYShuffle::compare(XYObject* rhs) {
@@ -747,6 +2061,8 @@ int XYShuffle::compare(XYObject* rhs) {
 }
 
 // XYSequence
+size_t const XYSequence::SPAN_BUFFER_SIZE;
+
 DD_IMPL(XYSequence, add)
 DD_IMPL(XYSequence, subtract)
 DD_IMPL(XYSequence, multiply)
@@ -758,37 +2074,77 @@ int XYSequence::compare(XYObject* rhs) {
   if (!o)
     return toString(true).compare(rhs->toString(true));
 
-  size_t lhs_len = size();
-  size_t rhs_len = o->size();
-  int li = 0;
-  int ri = 0;
-
-  for(li=0, ri=0;li < lhs_len && ri < rhs_len; ++li, ++ri) {
-    int c = at(li)->compare(o->at(ri));
+  XYSpan lhs(this);
+  XYSpan other(o);
+  XYObject* l = lhs.read();
+  XYObject* r = other.read();
+  for(; l && r; l = lhs.read(), r = other.read()) {
+    int c = l->compare(r);
     if (c != 0)
       return c;
   }
 
-  if(li != lhs_len)
+  if(l)
     return -1;
 
-  if(ri != rhs_len)
+  if(r)
     return 1;
 
   return 0;
 }
 
+XYCode* XYSequence::compile(XY* xy)
+{
+  return new XYCode(xy, this);
+}
+
+XYSequence* XYSequence::slice(size_t begin, size_t end)
+{
+  return new XYSlice(this, begin, end);
+}
+
+// XYSpan
+XYSpan::XYSpan(XYSequence* sequence) :
+  mBegin(0),
+  mEnd(0),
+  mSequence(sequence),
+  mNext(0),
+  mLast(sequence->size()) { }
+
+XYSpan::XYSpan(XYSequence* sequence, size_t begin, size_t end) :
+  mBegin(0),
+  mEnd(0),
+  mSequence(sequence),
+  mNext(begin),
+  mLast(end) { }
+
+bool XYSpan::next() {
+  if (mNext >= mLast)
+    return false;
+
+  size_t count = mSequence->span(mNext, mBegin, mBuffer);
+  assert(count > 0);
+  count = min(count, mLast - mNext);
+  mEnd = mBegin + count;
+  mNext += count;
+  return true;
+}
+
 // XYList
-XYList::XYList() { }
+XYList::XYList() : mCode(0), mPattern(0) { }
 
 template <class InputIterator>
-XYList::XYList(InputIterator first, InputIterator last) {
+XYList::XYList(InputIterator first, InputIterator last) : mCode(0), mPattern(0) {
   mList.assign(first, last);
 }
 
 void XYList::markChildren() {
   for (iterator it = mList.begin(); it != mList.end(); ++it)
     (*it)->mark();
+  if (mCode)
+    mCode->mark();
+  if (mPattern)
+    mPattern->mark();
 }
 
 void XYList::print(ostringstream& stream, CircularSet& seen, bool parse) const {
@@ -826,6 +2182,9 @@ void XYList::set_at(size_t n, XYObject* v)
 {
   assert(n < mList.size());
   mList[n] = v; 
+  mCode = 0;
+  mPattern = 0;
+  sequence_changed();
 }
 
 XYObject* XYList::head()
@@ -844,14 +2203,32 @@ XYSequence* XYList::tail()
 
 XYSequence* XYList::join(XYSequence* rhs)
 {
-  if (dynamic_cast<XYJoin*>(rhs)) {
-    // Modify the existing join
-    XYJoin* join_rhs = dynamic_cast<XYJoin*>(rhs);
-    join_rhs->mSequences.push_front(this);
-    return join_rhs;
-  }
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYList::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  assert(n < mList.size());
+  begin = &mList[n];
+  return mList.size() - n;
+}
+
+XYCode* XYList::compile(XY* xy)
+{
+  // Items can be appended to a list in place by ',' so
+  // recompile if the size no longer matches.
+  if (!mCode || mCode->mInstructions.size() != mList.size())
+    mCode = new XYCode(xy, this);
+
+  return mCode;
+}
+
+XYPattern* XYList::compilePattern(XY* xy)
+{
+  if (!mPattern || mPattern->mSize != mList.size() || mPattern->stale())
+    mPattern = new XYPattern(xy, this);
 
-  return new XYJoin(this, rhs);
+  return mPattern;
 }
 
 // XYSlice
@@ -884,181 +2261,1930 @@ void XYSlice::print(ostringstream& stream, CircularSet& seen, bool parse) const
   else {
     seen.insert(this);
     stream << "[ ";
-    for (int i=mBegin; i < mEnd; ++i) {
-      mOriginal->at(i)->print(stream, seen, parse);
-      stream << " ";
+    XYSpan span(mOriginal, mBegin, mEnd);
+    while (span.next()) {
+      for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it) {
+        (*it)->print(stream, seen, parse);
+        stream << " ";
+      }
     }
 
     stream << "]";
   }
 }
 
-size_t XYSlice::size()
-{
-  return mEnd - mBegin;
+size_t XYSlice::size()
+{
+  return mEnd - mBegin;
+}
+
+void XYSlice::pushBackInto(List& list) {
+  XYSpan span(mOriginal, mBegin, mEnd);
+  while (span.next())
+    list.insert(list.end(), span.mBegin, span.mEnd);
+}
+
+XYObject* XYSlice::at(size_t n)
+{
+  assert(mBegin + n < mEnd);
+  return mOriginal->at(mBegin + n);
+}
+
+void XYSlice::set_at(size_t n, XYObject* v)
+{
+  assert(mBegin + n < mEnd);
+  mOriginal->set_at(mBegin + n, v); 
+}
+
+XYObject* XYSlice::head()
+{
+  assert(mBegin != mEnd);
+  return mOriginal->at(mBegin);
+}
+
+XYSequence* XYSlice::tail()
+{
+  if (size() <= 1)
+    return new XYList();
+
+  return new XYSlice(mOriginal, mBegin+1, mEnd);
+}
+
+XYSequence* XYSlice::join(XYSequence* rhs)
+{
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYSlice::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  assert(mBegin + n < mEnd);
+  size_t count = mOriginal->span(mBegin + n, begin, buffer);
+  return min(count, static_cast<size_t>(mEnd - mBegin) - n);
+}
+
+// XYJoin
+size_t const XYJoin::MAX_SEQUENCES;
+
+XYJoin::XYJoin(XYSequence* first, XYSequence* second)
+{ 
+  append(first);
+  append(second);
+}
+
+XYSequence* XYJoin::make(XYSequence* first, XYSequence* second)
+{
+  XYJoin* join(new XYJoin(first, second));
+  if (join->mSequences.size() <= MAX_SEQUENCES)
+    return join;
+
+  XYList* list(new XYList());
+  list->mList.reserve(join->size());
+  join->pushBackInto(list->mList);
+  return list;
+}
+
+void XYJoin::append(XYSequence* sequence)
+{
+  XYJoin* join(dynamic_cast<XYJoin*>(sequence));
+  if (join) {
+    for (iterator it = join->mSequences.begin(); it != join->mSequences.end(); ++it)
+      append(*it);
+    return;
+  }
+
+  size_t n = sequence->size();
+  if (n == 0)
+    return;
+
+  mEnds.push_back(size() + n);
+  mSequences.push_back(sequence);
+}
+
+size_t XYJoin::find(size_t n) const
+{
+  return upper_bound(mEnds.begin(), mEnds.end(), n) - mEnds.begin();
+}
+
+void XYJoin::markChildren() {
+  for (iterator it = mSequences.begin(); it != mSequences.end(); ++it)
+    (*it)->mark();
+}
+
+void XYJoin::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  if (seen.find(this) != seen.end()) {
+    stream << "(circular)";
+  }
+  else {
+    seen.insert(this);
+    stream << "[ ";
+    for(const_iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
+      XYSpan span(*it);
+      while (span.next()) {
+        for (XYObject* const* e = span.mBegin; e != span.mEnd; ++e) {
+          (*e)->print(stream, seen, parse);
+          stream << " ";
+        }
+      }
+    }
+    stream << "]";
+  }
+}
+
+size_t XYJoin::size()
+{
+  return mEnds.empty() ? 0 : mEnds.back();
+}
+
+XYObject* XYJoin::at(size_t n)
+{
+  assert(n < size());
+  size_t i = find(n);
+  return mSequences[i]->at(i == 0 ? n : n - mEnds[i - 1]);
+}
+
+void XYJoin::set_at(size_t n, XYObject* v)
+{
+  assert(n < size());
+  size_t i = find(n);
+  mSequences[i]->set_at(i == 0 ? n : n - mEnds[i - 1], v);
+}
+
+void XYJoin::pushBackInto(List& list)
+{  
+  for(iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
+    (*it)->pushBackInto(list);
+  }
+}
+
+XYObject* XYJoin::head()
+{
+  return at(0);
+}
+
+XYSequence* XYJoin::tail()
+{
+  if (size() <= 1)
+    return new XYList();
+
+  return new XYSlice(dynamic_cast<XYSequence*>(this), 1, size());
+}
+
+XYSequence* XYJoin::join(XYSequence* rhs)
+{
+  return make(this, rhs);
+}
+
+size_t XYJoin::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  assert(n < size());
+  size_t i = find(n);
+  return mSequences[i]->span(i == 0 ? n : n - mEnds[i - 1], begin, buffer);
+}
+
+// XYVector
+struct XYVector::Node {
+  size_t mReferences;
+
+  // Interior nodes hold children, leaves hold the elements
+  union {
+    Node* mChildren[BRANCHES];
+    XYObject* mValues[BRANCHES];
+  };
+};
+
+size_t const XYVector::BRANCHES;
+unsigned int const XYVector::BITS;
+
+static XYVector::Node* new_node() {
+  XYVector::Node* node = new XYVector::Node();
+  node->mReferences = 1;
+  return node;
+}
+
+// Drop a reference to a node at the given level of the tree,
+// freeing it and its children when it is no longer used.
+static void release_node(XYVector::Node* node, unsigned int shift) {
+  if (!node || --node->mReferences != 0)
+    return;
+
+  if (shift > 0) {
+    for (size_t i = 0; i < XYVector::BRANCHES; ++i)
+      release_node(node->mChildren[i], shift - XYVector::BITS);
+  }
+  delete node;
+}
+
+// Returns a node that can be modified in place of 'node'. A node
+// with a single reference belongs only to the caller. A shared
+// node is copied and the caller's reference moves to the copy.
+static XYVector::Node* own_node(XYVector::Node* node, unsigned int shift) {
+  if (!node)
+    return new_node();
+
+  if (node->mReferences == 1)
+    return node;
+
+  XYVector::Node* copy = new XYVector::Node(*node);
+  copy->mReferences = 1;
+  if (shift > 0) {
+    for (size_t i = 0; i < XYVector::BRANCHES; ++i) {
+      if (copy->mChildren[i])
+	++copy->mChildren[i]->mReferences;
+    }
+  }
+  --node->mReferences;
+  return copy;
+}
+
+// Calls the visitor for each element with tree index in the range
+// [begin, end). 'start' is the tree index of the node's first element.
+template <class Visitor>
+static void visit_nodes(XYVector::Node* node,
+			unsigned int shift,
+			size_t start,
+			size_t begin,
+			size_t end,
+			Visitor& visitor) {
+  if (shift == 0) {
+    for (size_t i = begin - start; i < end - start && i < XYVector::BRANCHES; ++i)
+      visitor(node->mValues[i]);
+    return;
+  }
+
+  size_t span = size_t(1) << shift;
+  for (size_t i = (begin - start) >> shift; i < XYVector::BRANCHES; ++i) {
+    size_t child = start + i * span;
+    if (child >= end)
+      break;
+    visit_nodes(node->mChildren[i],
+		shift - XYVector::BITS,
+		child,
+		std::max(begin, child),
+		std::min(end, child + span),
+		visitor);
+  }
+}
+
+namespace {
+  struct MarkVisitor {
+    void operator()(XYObject* o) { o->mark(); }
+  };
+
+  struct PushBackVisitor {
+    XYSequence::List& mList;
+    PushBackVisitor(XYSequence::List& list) : mList(list) { }
+    void operator()(XYObject* o) { mList.push_back(o); }
+  };
+
+  struct PrintVisitor {
+    ostringstream& mStream;
+    XYObject::CircularSet& mSeen;
+    bool mParse;
+    PrintVisitor(ostringstream& stream, XYObject::CircularSet& seen, bool parse) :
+      mStream(stream), mSeen(seen), mParse(parse) { }
+    void operator()(XYObject* o) {
+      o->print(mStream, mSeen, mParse);
+      mStream << " ";
+    }
+  };
+}
+
+XYVector::XYVector() :
+  mRoot(0),
+  mShift(0),
+  mOrigin(0),
+  mSize(0),
+  mCode(0) { }
+
+XYVector::XYVector(XYVector const& rhs) :
+  XYSequence(rhs),
+  mRoot(rhs.mRoot),
+  mShift(rhs.mShift),
+  mOrigin(rhs.mOrigin),
+  mSize(rhs.mSize),
+  mCode(0) {
+  if (mRoot)
+    ++mRoot->mReferences;
+}
+
+XYVector::~XYVector() {
+  release_node(mRoot, mShift);
+}
+
+XYVector* XYVector::make(XYSequence* sequence) {
+  XYVector* vector = dynamic_cast<XYVector*>(sequence);
+  if (vector)
+    return vector;
+
+  // A slice of a vector shares its tree
+  XYSlice* slice = dynamic_cast<XYSlice*>(sequence);
+  vector = slice ? dynamic_cast<XYVector*>(slice->mOriginal) : 0;
+  if (vector) {
+    XYVector* result = new XYVector(*vector);
+    result->mOrigin += slice->mBegin;
+    result->mSize = slice->mEnd - slice->mBegin;
+    return result;
+  }
+
+  List list;
+  sequence->pushBackInto(list);
+
+  XYVector* result = new XYVector();
+  for (iterator it = list.begin(); it != list.end(); ++it)
+    result->append(*it);
+  return result;
+}
+
+void XYVector::markChildren() {
+  XYObject::markChildren();
+  if (mSize > 0) {
+    MarkVisitor visitor;
+    visit_nodes(mRoot, mShift, 0, mOrigin, mOrigin + mSize, visitor);
+  }
+  if (mCode)
+    mCode->mark();
+}
+
+void XYVector::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  if (seen.find(this) != seen.end()) {
+    stream << "(circular)";
+  }
+  else {
+    seen.insert(this);
+    stream << "[ ";
+    if (mSize > 0) {
+      PrintVisitor visitor(stream, seen, parse);
+      visit_nodes(mRoot, mShift, 0, mOrigin, mOrigin + mSize, visitor);
+    }
+    stream << "]";
+  }
+}
+
+size_t XYVector::size()
+{
+  return mSize;
+}
+
+void XYVector::pushBackInto(List& list) {
+  if (mSize > 0) {
+    PushBackVisitor visitor(list);
+    visit_nodes(mRoot, mShift, 0, mOrigin, mOrigin + mSize, visitor);
+  }
+}
+
+XYObject* XYVector::at(size_t n)
+{
+  assert(n < mSize);
+  size_t index = mOrigin + n;
+  Node* node = mRoot;
+  for (unsigned int shift = mShift; shift > 0; shift -= BITS)
+    node = node->mChildren[(index >> shift) & (BRANCHES - 1)];
+
+  return node->mValues[index & (BRANCHES - 1)];
+}
+
+void XYVector::set_at(size_t n, XYObject* v)
+{
+  assert(n < mSize);
+  store(mOrigin + n, v);
+  mCode = 0;
+  sequence_changed();
+}
+
+XYObject* XYVector::head()
+{
+  return at(0);
+}
+
+XYSequence* XYVector::tail()
+{
+  if (mSize <= 1)
+    return new XYList();
+
+  // Like the tail of a list, the tail is a slice that sees changes
+  // to the vector and can change it.
+  return new XYSlice(this, 1, mSize);
+}
+
+XYSequence* XYVector::join(XYSequence* rhs)
+{
+  size_t n = rhs->size();
+  if (n <= BRANCHES) {
+    // Add the elements of a small sequence to a copy of this one
+    List list;
+    rhs->pushBackInto(list);
+    XYVector* result = new XYVector(*this);
+    for (iterator it = list.begin(); it != list.end(); ++it)
+      result->append(*it);
+    return result;
+  }
+
+  if (mSize <= BRANCHES) {
+    // We are small. Add our elements to the start of the other.
+    XYVector* result = new XYVector(*make(rhs));
+    for (size_t i = mSize; i > 0; --i)
+      result->prepend(at(i - 1));
+    return result;
+  }
+
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYVector::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  // The rest of the leaf holding the element
+  assert(n < mSize);
+  size_t index = mOrigin + n;
+  Node* node = mRoot;
+  for (unsigned int shift = mShift; shift > 0; shift -= BITS)
+    node = node->mChildren[(index >> shift) & (BRANCHES - 1)];
+
+  size_t offset = index & (BRANCHES - 1);
+  begin = &node->mValues[offset];
+  return min(BRANCHES - offset, mSize - n);
+}
+
+XYVector* XYVector::push_back(XYObject* o) const
+{
+  XYVector* result = new XYVector(*this);
+  result->append(o);
+  return result;
+}
+
+XYVector* XYVector::push_front(XYObject* o) const
+{
+  XYVector* result = new XYVector(*this);
+  result->prepend(o);
+  return result;
+}
+
+XYCode* XYVector::compile(XY* xy)
+{
+  if (!mCode)
+    mCode = new XYCode(xy, this);
+
+  return mCode;
+}
+
+size_t XYVector::capacity() const
+{
+  return BRANCHES << mShift;
+}
+
+void XYVector::grow(size_t child)
+{
+  Node* root = new_node();
+  root->mChildren[child] = mRoot;
+  mOrigin += child * capacity();
+  mShift += BITS;
+  mRoot = root;
+}
+
+void XYVector::store(size_t n, XYObject* o)
+{
+  mRoot = own_node(mRoot, mShift);
+  Node* node = mRoot;
+  for (unsigned int shift = mShift; shift > 0; shift -= BITS) {
+    Node*& child = node->mChildren[(n >> shift) & (BRANCHES - 1)];
+    child = own_node(child, shift - BITS);
+    node = child;
+  }
+  node->mValues[n & (BRANCHES - 1)] = o;
+}
+
+void XYVector::append(XYObject* o)
+{
+  while (mOrigin + mSize >= capacity())
+    grow(0);
+
+  store(mOrigin + mSize, o);
+  ++mSize;
+}
+
+void XYVector::prepend(XYObject* o)
+{
+  if (mSize == 0) {
+    append(o);
+    return;
+  }
+
+  // Leave room both before and after the existing elements
+  if (mOrigin == 0)
+    grow(BRANCHES / 2);
+
+  store(--mOrigin, o);
+  ++mSize;
+}
+
+// XYPackedVector
+size_t const XYPackedVector::LITERAL_SIZE;
+
+XYPackedVector::XYPackedVector() : mBoxed(0), mCode(0) { }
+
+XYSequence* XYPackedVector::pack(XYList* list)
+{
+  size_t n = list->mList.size();
+  if (n < LITERAL_SIZE)
+    return list;
+
+  XYPackedVector* result;
+  if (dynamic_cast<XYInteger*>(list->mList[0]))
+    result = new XYIntVector(n);
+  else if (dynamic_cast<XYFloat*>(list->mList[0]))
+    result = new XYFloatVector(n);
+  else
+    return list;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (!result->store(i, list->mList[i]))
+      return list;
+  }
+
+  return result;
+}
+
+void XYPackedVector::markChildren() {
+  XYObject::markChildren();
+  if (mBoxed)
+    mBoxed->mark();
+  if (mCode)
+    mCode->mark();
+}
+
+void XYPackedVector::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  if (mBoxed) {
+    mBoxed->print(stream, seen, parse);
+    return;
+  }
+
+  stream << "[ ";
+  for (size_t i = 0; i < count(); ++i) {
+    box(i)->print(stream, seen, parse);
+    stream << " ";
+  }
+  stream << "]";
+}
+
+size_t XYPackedVector::size()
+{
+  return mBoxed ? mBoxed->size() : count();
+}
+
+void XYPackedVector::pushBackInto(List& list)
+{
+  if (mBoxed) {
+    mBoxed->pushBackInto(list);
+    return;
+  }
+
+  size_t n = count();
+  list.reserve(list.size() + n);
+  for (size_t i = 0; i < n; ++i)
+    list.push_back(box(i));
+}
+
+XYObject* XYPackedVector::at(size_t n)
+{
+  if (mBoxed)
+    return mBoxed->at(n);
+
+  assert(n < count());
+  return box(n);
+}
+
+void XYPackedVector::set_at(size_t n, XYObject* v)
+{
+  mCode = 0;
+  if (!mBoxed) {
+    assert(n < count());
+    if (store(n, v)) {
+      sequence_changed();
+      return;
+    }
+
+    XYList* boxed(new XYList());
+    pushBackInto(boxed->mList);
+    clear();
+    mBoxed = boxed;
+  }
+
+  mBoxed->set_at(n, v);
+}
+
+XYObject* XYPackedVector::head()
+{
+  assert(size() > 0);
+  return at(0);
+}
+
+XYSequence* XYPackedVector::tail()
+{
+  size_t n = size();
+  if (n <= 1)
+    return new XYList();
+
+  return new XYSlice(this, 1, n);
+}
+
+XYSequence* XYPackedVector::join(XYSequence* rhs)
+{
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYPackedVector::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  if (mBoxed)
+    return mBoxed->span(n, begin, buffer);
+
+  // Elements are boxed into the buffer
+  assert(n < count());
+  size_t result = min(count() - n, XYSequence::SPAN_BUFFER_SIZE);
+  for (size_t i = 0; i < result; ++i)
+    buffer[i] = box(n + i);
+  begin = buffer;
+  return result;
+}
+
+XYCode* XYPackedVector::compile(XY* xy)
+{
+  if (mBoxed)
+    return mBoxed->compile(xy);
+
+  if (!mCode)
+    mCode = new XYCode(xy, this);
+
+  return mCode;
+}
+
+// XYIntVector
+XYIntVector::XYIntVector(size_t size) : mValues(size) { }
+
+size_t XYIntVector::count() const
+{
+  return mValues.size();
+}
+
+XYObject* XYIntVector::box(size_t n) const
+{
+  return XYInteger::make(mValues[n]);
+}
+
+bool XYIntVector::store(size_t n, XYObject* v)
+{
+  XYInteger* integer = dynamic_cast<XYInteger*>(v);
+  if (!integer || integer->mBig)
+    return false;
+
+  mValues[n] = integer->mSmall;
+  return true;
+}
+
+void XYIntVector::clear()
+{
+  vector<long>().swap(mValues);
+}
+
+// XYFloatVector
+XYFloatVector::XYFloatVector(size_t size) : mValues(size) { }
+
+size_t XYFloatVector::count() const
+{
+  return mValues.size();
+}
+
+XYObject* XYFloatVector::box(size_t n) const
+{
+  return new XYFloat(mValues[n]);
+}
+
+bool XYFloatVector::store(size_t n, XYObject* v)
+{
+  XYFloat* f = dynamic_cast<XYFloat*>(v);
+  if (!f || f->mBig)
+    return false;
+
+  mValues[n] = f->mDouble;
+  return true;
+}
+
+void XYFloatVector::clear()
+{
+  vector<double>().swap(mValues);
+}
+
+// XYRange
+XYRange::XYRange(long start, long step, size_t size) :
+  mStart(start),
+  mStep(step),
+  mSize(size),
+  mElements(0),
+  mParent(0),
+  mOffset(0),
+  mCode(0) { }
+
+XYIntVector* XYRange::expand() const
+{
+  XYIntVector* result(new XYIntVector(mSize));
+  long value = mStart;
+  for (size_t i = 0; i < mSize; ++i, value += mStep)
+    result->mValues[i] = value;
+  return result;
+}
+
+XYSequence* XYRange::elements()
+{
+  if (!mElements && mParent && mParent->mElements)
+    mElements = mParent->mElements->slice(mOffset, mOffset + mSize);
+
+  return mElements;
+}
+
+XYRange* XYRange::subrange(size_t begin, size_t end)
+{
+  assert(begin <= end && end <= mSize);
+  XYRange* result(new XYRange(mStart + static_cast<long>(begin) * mStep, mStep, end - begin));
+  result->mParent = mParent ? mParent : this;
+  result->mOffset = mOffset + begin;
+  return result;
+}
+
+void XYRange::markChildren() {
+  XYObject::markChildren();
+  if (mElements)
+    mElements->mark();
+  if (mParent)
+    mParent->mark();
+  if (mCode)
+    mCode->mark();
+}
+
+void XYRange::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  XYSequence* elements = const_cast<XYRange*>(this)->elements();
+  if (elements) {
+    elements->print(stream, seen, parse);
+    return;
+  }
+
+  stream << "[ ";
+  long value = mStart;
+  for (size_t i = 0; i < mSize; ++i, value += mStep)
+    stream << value << " ";
+  stream << "]";
+}
+
+size_t XYRange::size()
+{
+  return elements() ? mElements->size() : mSize;
+}
+
+void XYRange::pushBackInto(List& list)
+{
+  if (elements()) {
+    mElements->pushBackInto(list);
+    return;
+  }
+
+  list.reserve(list.size() + mSize);
+  long value = mStart;
+  for (size_t i = 0; i < mSize; ++i, value += mStep)
+    list.push_back(XYInteger::make(value));
+}
+
+XYObject* XYRange::at(size_t n)
+{
+  if (elements())
+    return mElements->at(n);
+
+  assert(n < mSize);
+  return XYInteger::make(mStart + static_cast<long>(n) * mStep);
+}
+
+void XYRange::set_at(size_t n, XYObject* v)
+{
+  mCode = 0;
+  if (mParent) {
+    // Store it in the parent, which we are then a slice of
+    mParent->set_at(mOffset + n, v);
+    return;
+  }
+
+  if (!mElements)
+    mElements = expand();
+
+  mElements->set_at(n, v);
+}
+
+XYObject* XYRange::head()
+{
+  assert(size() > 0);
+  return at(0);
+}
+
+XYSequence* XYRange::tail()
+{
+  if (elements())
+    return mElements->tail();
+
+  if (mSize <= 1)
+    return new XYList();
+
+  return subrange(1, mSize);
+}
+
+XYSequence* XYRange::join(XYSequence* rhs)
+{
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYRange::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  if (elements())
+    return mElements->span(n, begin, buffer);
+
+  // Elements are computed into the buffer
+  assert(n < mSize);
+  size_t count = min(mSize - n, XYSequence::SPAN_BUFFER_SIZE);
+  long value = mStart + static_cast<long>(n) * mStep;
+  for (size_t i = 0; i < count; ++i, value += mStep)
+    buffer[i] = XYInteger::make(value);
+  begin = buffer;
+  return count;
+}
+
+XYCode* XYRange::compile(XY* xy)
+{
+  if (elements())
+    return mElements->compile(xy);
+
+  if (!mCode)
+    mCode = new XYCode(xy, this);
+
+  return mCode;
+}
+
+XYSequence* XYRange::slice(size_t begin, size_t end)
+{
+  if (elements())
+    return mElements->slice(begin, end);
+
+  return subrange(begin, end);
+}
+
+// XYPipeline
+static void primitive_addition(XY* xy);
+static void primitive_subtraction(XY* xy);
+static void primitive_multiplication(XY* xy);
+static void primitive_division(XY* xy);
+static void primitive_power(XY* xy);
+static void primitive_equals(XY* xy);
+static void primitive_lessThan(XY* xy);
+static void primitive_lessThanEqual(XY* xy);
+static void primitive_greaterThan(XY* xy);
+static void primitive_greaterThanEqual(XY* xy);
+static void primitive_not(XY* xy);
+static bool is_true(XYObject* o);
+
+XYPipeline::XYPipeline(XYSequence* source) :
+  mSource(source),
+  mElements(0) { }
+
+bool XYPipeline::compileStage(XY* xy, XYSequence* quotation, Stage& stage) {
+  static struct {
+    void (*mFunc)(XY*);
+    Operation::Kind mKind;
+  } const operators[] = {
+    { primitive_addition, Operation::ADD },
+    { primitive_subtraction, Operation::SUBTRACT },
+    { primitive_multiplication, Operation::MULTIPLY },
+    { primitive_division, Operation::DIVIDE },
+    { primitive_power, Operation::POWER },
+    { primitive_equals, Operation::EQUAL },
+    { primitive_lessThan, Operation::LESS },
+    { primitive_lessThanEqual, Operation::LESS_EQUAL },
+    { primitive_greaterThan, Operation::GREATER },
+    { primitive_greaterThanEqual, Operation::GREATER_EQUAL },
+    { primitive_not, Operation::NOT }
+  };
+  size_t const operator_count = sizeof(operators) / sizeof(operators[0]);
+
+  List objects;
+  quotation->pushBackInto(objects);
+  stage.mOperations.clear();
+
+  // Track the stack depth, starting with the element, so that only
+  // quotations that consume at most the element and leave exactly one
+  // result are compiled.
+  size_t depth = 1;
+  for (iterator it = objects.begin(); it != objects.end(); ++it) {
+    Operation operation;
+    operation.mObject = *it;
+
+    XYShuffle* shuffle = dynamic_cast<XYShuffle*>(*it);
+    XYSymbol* symbol = dynamic_cast<XYSymbol*>(*it);
+    if (dynamic_cast<XYNumber*>(*it) || dynamic_cast<XYString*>(*it)) {
+      operation.mKind = Operation::PUSH;
+      ++depth;
+    }
+    else if (shuffle) {
+      if (depth < shuffle->mBefore.size())
+        return false;
+      operation.mKind = Operation::SHUFFLE;
+      depth = depth - shuffle->mBefore.size() + shuffle->mAfter.size();
+    }
+    else if (symbol) {
+      XYPrimitive* primitive = dynamic_cast<XYPrimitive*>(xy->mP.lookup(symbol->mId));
+      if (!primitive)
+        return false;
+
+      size_t i = 0;
+      while (i < operator_count && operators[i].mFunc != primitive->mFunc)
+        ++i;
+      if (i == operator_count)
+        return false;
+
+      operation.mKind = operators[i].mKind;
+      size_t arity = operation.mKind == Operation::NOT ? 1 : 2;
+      if (depth < arity)
+        return false;
+      depth = depth - arity + 1;
+    }
+    else
+      return false;
+
+    stage.mOperations.push_back(operation);
+  }
+
+  return depth == 1;
+}
+
+// Returns a source for a lazy pipeline that later changes to 'source'
+// can't affect: a copy of a range or of an unboxed packed vector of
+// numbers. Returns null for other sequences, whose elements can
+// change.
+static XYSequence* frozen_source(XYSequence* source) {
+  XYPipeline* pipeline = dynamic_cast<XYPipeline*>(source);
+  if (pipeline)
+    source = pipeline->force();
+
+  XYRange* range = dynamic_cast<XYRange*>(source);
+  if (range && !range->elements())
+    return new XYRange(range->mStart, range->mStep, range->mSize);
+  if (range)
+    source = range->mElements;
+
+  XYIntVector* longs = dynamic_cast<XYIntVector*>(source);
+  if (longs && !longs->mBoxed) {
+    XYIntVector* copy = new XYIntVector();
+    copy->mValues = longs->mValues;
+    return copy;
+  }
+
+  XYFloatVector* doubles = dynamic_cast<XYFloatVector*>(source);
+  if (doubles && !doubles->mBoxed) {
+    XYFloatVector* copy = new XYFloatVector();
+    copy->mValues = doubles->mValues;
+    return copy;
+  }
+
+  return 0;
+}
+
+XYPipeline* XYPipeline::extend(XYSequence* source, Stage const& stage) {
+  XYPipeline* pipeline = dynamic_cast<XYPipeline*>(source);
+  if (pipeline && !pipeline->mElements) {
+    // The stages of an unforced pipeline are over a frozen source
+    XYPipeline* result = new XYPipeline(pipeline->mSource);
+    result->mStages = pipeline->mStages;
+    result->mStages.push_back(stage);
+    return result;
+  }
+
+  XYSequence* frozen = frozen_source(source);
+  XYPipeline* result = new XYPipeline(frozen ? frozen : source);
+  result->mStages.push_back(stage);
+
+  // Anything else is run now, so the result is the same as a map or
+  // filter by the interpreter.
+  if (!frozen)
+    result->force();
+  return result;
+}
+
+// Run the stages over the values read from 'source' in a single pass,
+// appending the values that get through to 'result'. 'evaluate' runs
+// the operations of map and filter stages. Returns false if it gives
+// up on a value.
+template <class Value, class Source, class Evaluator>
+static bool run_stages(XYPipeline::Stages const& stages,
+                       Source& source,
+                       Evaluator& evaluate,
+                       vector<Value>& result) {
+  // The elements still to be taken or dropped by each stage. A take
+  // of nothing ends the pass before it starts.
+  vector<size_t> counts(stages.size());
+  bool done = false;
+  for (size_t i = 0; i < stages.size(); ++i) {
+    counts[i] = stages[i].mCount;
+    if (stages[i].mKind == XYPipeline::Stage::TAKE && counts[i] == 0)
+      done = true;
+  }
+
+  Value value;
+  while (!done && source.read(value)) {
+    bool keep = true;
+    for (size_t i = 0; keep && i < stages.size(); ++i) {
+      XYPipeline::Stage const& stage = stages[i];
+      switch (stage.mKind) {
+        case XYPipeline::Stage::MAP:
+          if (!evaluate(stage.mOperations, value))
+            return false;
+          break;
+
+        case XYPipeline::Stage::FILTER: {
+          Value test = value;
+          if (!evaluate(stage.mOperations, test))
+            return false;
+          keep = evaluate.is_true(test);
+          break;
+        }
+
+        case XYPipeline::Stage::TAKE:
+          // No element gets past a take once its count is used up
+          if (--counts[i] == 0)
+            done = true;
+          break;
+
+        case XYPipeline::Stage::DROP:
+          if (counts[i] > 0) {
+            --counts[i];
+            keep = false;
+          }
+          break;
+      }
+    }
+
+    if (keep)
+      result.push_back(value);
+  }
+
+  return true;
+}
+
+// Reads the elements of any sequence for a boxed pipeline pass
+struct BoxedSource {
+  XYSpan mSpan;
+
+  BoxedSource(XYSequence* sequence) : mSpan(sequence) { }
+
+  bool read(XYObject*& value) {
+    value = mSpan.read();
+    return value != 0;
+  }
+};
+
+// Runs map and filter stages on objects with the same primitives
+// the interpreter would use.
+struct BoxedEvaluator {
+  XYStack mStack;
+
+  bool is_true(XYObject* value) {
+    return ::is_true(value);
+  }
+
+  bool operator()(vector<XYPipeline::Operation> const& operations, XYObject*& value);
+};
+
+bool BoxedEvaluator::operator()(vector<XYPipeline::Operation> const& operations, XYObject*& value) {
+  mStack.clear();
+  mStack.push_back(value);
+  for (vector<XYPipeline::Operation>::const_iterator it = operations.begin();
+       it != operations.end();
+       ++it) {
+    XYPipeline::Operation const& operation = *it;
+    if (operation.mKind == XYPipeline::Operation::PUSH) {
+      mStack.push_back(operation.mObject);
+      continue;
+    }
+
+    if (operation.mKind == XYPipeline::Operation::SHUFFLE) {
+      shuffle_stack(static_cast<XYShuffle*>(operation.mObject), mStack);
+      continue;
+    }
+
+    if (operation.mKind == XYPipeline::Operation::NOT) {
+      mStack.back() = XYInteger::make(::is_true(mStack.back()) ? 0 : 1);
+      continue;
+    }
+
+    XYObject* rhs = mStack.back();
+    mStack.pop_back();
+    XYObject* lhs = mStack.back();
+    XYObject*& result = mStack.back();
+
+    switch (operation.mKind) {
+      case XYPipeline::Operation::ADD:
+        result = lhs->add(rhs);
+        break;
+
+      case XYPipeline::Operation::SUBTRACT:
+        result = lhs->subtract(rhs);
+        break;
+
+      case XYPipeline::Operation::MULTIPLY:
+        result = lhs->multiply(rhs);
+        break;
+
+      case XYPipeline::Operation::DIVIDE:
+        result = lhs->divide(rhs);
+        break;
+
+      case XYPipeline::Operation::POWER:
+        result = lhs->power(rhs);
+        break;
+
+      case XYPipeline::Operation::EQUAL:
+        result = XYInteger::make(lhs->compare(rhs) == 0 ? 1 : 0);
+        break;
+
+      case XYPipeline::Operation::LESS:
+        result = XYInteger::make(lhs->compare(rhs) < 0 ? 1 : 0);
+        break;
+
+      case XYPipeline::Operation::LESS_EQUAL:
+        result = XYInteger::make(lhs->compare(rhs) <= 0 ? 1 : 0);
+        break;
+
+      case XYPipeline::Operation::GREATER:
+        result = XYInteger::make(lhs->compare(rhs) > 0 ? 1 : 0);
+        break;
+
+      case XYPipeline::Operation::GREATER_EQUAL:
+        result = XYInteger::make(lhs->compare(rhs) >= 0 ? 1 : 0);
+        break;
+
+      default:
+        assert(1 == 0);
+    }
+  }
+
+  assert(mStack.size() == 1);
+  value = mStack.back();
+  return true;
+}
+
+// A native integer or float on the stack of a native pipeline pass
+struct NativeNumber {
+  bool mFloat;
+  long mLong;
+  double mDouble;
+
+  double as_double() const {
+    return mFloat ? mDouble : static_cast<double>(mLong);
+  }
+};
+
+// Fill in 'n' from the object. Returns false if the object is not a
+// native integer or float.
+static bool native_number(XYObject* o, NativeNumber& n) {
+  XYInteger* i = dynamic_cast<XYInteger*>(o);
+  if (i && !i->mBig) {
+    n.mFloat = false;
+    n.mLong = i->mSmall;
+    return true;
+  }
+
+  XYFloat* f = dynamic_cast<XYFloat*>(o);
+  if (f && !f->mBig) {
+    n.mFloat = true;
+    n.mDouble = f->mDouble;
+    return true;
+  }
+
+  return false;
+}
+
+// Reads the elements of a range or an unboxed packed vector as native
+// numbers, without expanding ranges.
+struct NativeSource {
+  XYRange* mRange;
+  XYIntVector* mLongs;
+  XYFloatVector* mDoubles;
+  size_t mIndex;
+  size_t mSize;
+
+  NativeSource() : mRange(0), mLongs(0), mDoubles(0), mIndex(0), mSize(0) { }
+
+  // Returns false if the sequence can't be read natively
+  bool open(XYSequence* sequence);
+
+  bool read(NativeNumber& value);
+};
+
+bool NativeSource::open(XYSequence* sequence) {
+  XYRange* range = dynamic_cast<XYRange*>(sequence);
+  if (range && range->elements())
+    return open(range->mElements);
+
+  XYPipeline* pipeline = dynamic_cast<XYPipeline*>(sequence);
+  if (pipeline)
+    return open(pipeline->force());
+
+  XYIntVector* longs = dynamic_cast<XYIntVector*>(sequence);
+  XYFloatVector* doubles = dynamic_cast<XYFloatVector*>(sequence);
+  if (range)
+    mRange = range;
+  else if (longs && !longs->mBoxed)
+    mLongs = longs;
+  else if (doubles && !doubles->mBoxed)
+    mDoubles = doubles;
+  else
+    return false;
+
+  mSize = sequence->size();
+  return true;
+}
+
+bool NativeSource::read(NativeNumber& value) {
+  if (mIndex == mSize)
+    return false;
+
+  value.mFloat = mDoubles != 0;
+  if (mRange)
+    value.mLong = mRange->mStart + static_cast<long>(mIndex) * mRange->mStep;
+  else if (mLongs)
+    value.mLong = mLongs->mValues[mIndex];
+  else
+    value.mDouble = mDoubles->mValues[mIndex];
+
+  ++mIndex;
+  return true;
+}
+
+// Compares like XYInteger::compare and XYFloat::compare
+static int native_compare(NativeNumber const& lhs, NativeNumber const& rhs) {
+  if (!lhs.mFloat && !rhs.mFloat)
+    return lhs.mLong < rhs.mLong ? -1 : (lhs.mLong > rhs.mLong ? 1 : 0);
+
+  double l = lhs.as_double();
+  double r = rhs.as_double();
+  return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+// Runs map and filter stages on native numbers with the arithmetic
+// of the number classes. Gives up when an integer overflows, as the
+// boxed result would be a big integer.
+struct NativeEvaluator {
+  vector<NativeNumber> mStack;
+
+  // Returns true if the operations can be run natively
+  static bool accepts(vector<XYPipeline::Operation> const& operations);
+
+  bool is_true(NativeNumber const& value) {
+    return value.mFloat ? value.mDouble != 0.0 : value.mLong != 0;
+  }
+
+  bool operator()(vector<XYPipeline::Operation> const& operations, NativeNumber& value);
+};
+
+bool NativeEvaluator::accepts(vector<XYPipeline::Operation> const& operations) {
+  NativeNumber n;
+  for (vector<XYPipeline::Operation>::const_iterator it = operations.begin();
+       it != operations.end();
+       ++it) {
+    if ((*it).mKind == XYPipeline::Operation::POWER)
+      return false;
+    if ((*it).mKind == XYPipeline::Operation::PUSH && !native_number((*it).mObject, n))
+      return false;
+  }
+  return true;
+}
+
+bool NativeEvaluator::operator()(vector<XYPipeline::Operation> const& operations, NativeNumber& value) {
+  mStack.clear();
+  mStack.push_back(value);
+  for (vector<XYPipeline::Operation>::const_iterator it = operations.begin();
+       it != operations.end();
+       ++it) {
+    XYPipeline::Operation const& operation = *it;
+    if (operation.mKind == XYPipeline::Operation::PUSH) {
+      NativeNumber n;
+      native_number(operation.mObject, n);
+      mStack.push_back(n);
+      continue;
+    }
+
+    if (operation.mKind == XYPipeline::Operation::SHUFFLE) {
+      shuffle_stack(static_cast<XYShuffle*>(operation.mObject), mStack);
+      continue;
+    }
+
+    NativeNumber& top = mStack.back();
+    if (operation.mKind == XYPipeline::Operation::NOT) {
+      top.mLong = is_true(top) ? 0 : 1;
+      top.mFloat = false;
+      continue;
+    }
+
+    NativeNumber rhs = mStack.back();
+    mStack.pop_back();
+    NativeNumber& result = mStack.back();
+    NativeNumber lhs = result;
+
+    bool integer = !lhs.mFloat && !rhs.mFloat;
+    bool overflow = false;
+    switch (operation.mKind) {
+      case XYPipeline::Operation::ADD:
+        if (integer)
+          overflow = add_overflow(lhs.mLong, rhs.mLong, &result.mLong);
+        else
+          result.mDouble = lhs.as_double() + rhs.as_double();
+        break;
+
+      case XYPipeline::Operation::SUBTRACT:
+        if (integer)
+          overflow = subtract_overflow(lhs.mLong, rhs.mLong, &result.mLong);
+        else
+          result.mDouble = lhs.as_double() - rhs.as_double();
+        break;
+
+      case XYPipeline::Operation::MULTIPLY:
+        if (integer)
+          overflow = multiply_overflow(lhs.mLong, rhs.mLong, &result.mLong);
+        else
+          result.mDouble = lhs.as_double() * rhs.as_double();
+        break;
+
+      case XYPipeline::Operation::DIVIDE:
+        // Integers divide as floats
+        result.mDouble = lhs.as_double() / rhs.as_double();
+        integer = false;
+        break;
+
+      case XYPipeline::Operation::EQUAL:
+        result.mLong = native_compare(lhs, rhs) == 0 ? 1 : 0;
+        integer = true;
+        break;
+
+      case XYPipeline::Operation::LESS:
+        result.mLong = native_compare(lhs, rhs) < 0 ? 1 : 0;
+        integer = true;
+        break;
+
+      case XYPipeline::Operation::LESS_EQUAL:
+        result.mLong = native_compare(lhs, rhs) <= 0 ? 1 : 0;
+        integer = true;
+        break;
+
+      case XYPipeline::Operation::GREATER:
+        result.mLong = native_compare(lhs, rhs) > 0 ? 1 : 0;
+        integer = true;
+        break;
+
+      case XYPipeline::Operation::GREATER_EQUAL:
+        result.mLong = native_compare(lhs, rhs) >= 0 ? 1 : 0;
+        integer = true;
+        break;
+
+      default:
+        assert(1 == 0);
+    }
+
+    if (overflow)
+      return false;
+    result.mFloat = !integer;
+  }
+
+  assert(mStack.size() == 1);
+  value = mStack.back();
+  return true;
+}
+
+// Run the pipeline on native numbers if the source and the stages
+// allow it. Returns null if the pipeline needs boxed objects or an
+// integer overflows.
+static XYSequence* force_native(XYSequence* source, XYPipeline::Stages const& stages) {
+  NativeSource input;
+  if (!input.open(source))
+    return 0;
+
+  for (XYPipeline::Stages::const_iterator it = stages.begin(); it != stages.end(); ++it)
+    if (!NativeEvaluator::accepts((*it).mOperations))
+      return 0;
+
+  NativeEvaluator evaluate;
+  vector<NativeNumber> values;
+  if (!run_stages(stages, input, evaluate, values))
+    return 0;
+
+  // Results of one type are packed, as a list literal of them would be
+  size_t n = values.size();
+  size_t floats = 0;
+  for (size_t i = 0; i < n; ++i)
+    floats += values[i].mFloat ? 1 : 0;
+
+  if (n >= XYPackedVector::LITERAL_SIZE && floats == 0) {
+    XYIntVector* result = new XYIntVector(n);
+    for (size_t i = 0; i < n; ++i)
+      result->mValues[i] = values[i].mLong;
+    return result;
+  }
+
+  if (n >= XYPackedVector::LITERAL_SIZE && floats == n) {
+    XYFloatVector* result = new XYFloatVector(n);
+    for (size_t i = 0; i < n; ++i)
+      result->mValues[i] = values[i].mDouble;
+    return result;
+  }
+
+  XYList* result = new XYList();
+  result->mList.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    if (values[i].mFloat)
+      result->mList.push_back(new XYFloat(values[i].mDouble));
+    else
+      result->mList.push_back(XYInteger::make(values[i].mLong));
+  }
+  return result;
+}
+
+XYSequence* XYPipeline::force() {
+  if (mElements)
+    return mElements;
+
+  mElements = force_native(mSource, mStages);
+  if (mElements)
+    return mElements;
+
+  BoxedSource input(mSource);
+  BoxedEvaluator evaluate;
+  XYList* result = new XYList();
+  run_stages(mStages, input, evaluate, result->mList);
+  mElements = XYPackedVector::pack(result);
+  return mElements;
+}
+
+void XYPipeline::markChildren() {
+  XYObject::markChildren();
+  mSource->mark();
+  for (Stages::iterator it = mStages.begin(); it != mStages.end(); ++it)
+    for (vector<Operation>::iterator op = (*it).mOperations.begin(); op != (*it).mOperations.end(); ++op)
+      (*op).mObject->mark();
+  if (mElements)
+    mElements->mark();
+}
+
+void XYPipeline::print(ostringstream& stream, CircularSet& seen, bool parse) const {
+  const_cast<XYPipeline*>(this)->force()->print(stream, seen, parse);
+}
+
+size_t XYPipeline::size()
+{
+  return force()->size();
+}
+
+void XYPipeline::pushBackInto(List& list)
+{
+  force()->pushBackInto(list);
+}
+
+XYObject* XYPipeline::at(size_t n)
+{
+  return force()->at(n);
+}
+
+void XYPipeline::set_at(size_t n, XYObject* v)
+{
+  force()->set_at(n, v);
+}
+
+XYObject* XYPipeline::head()
+{
+  return force()->head();
+}
+
+XYSequence* XYPipeline::tail()
+{
+  return force()->tail();
+}
+
+XYSequence* XYPipeline::join(XYSequence* rhs)
+{
+  return XYJoin::make(this, rhs);
+}
+
+size_t XYPipeline::span(size_t n, XYObject* const*& begin, XYObject** buffer)
+{
+  return force()->span(n, begin, buffer);
+}
+
+XYCode* XYPipeline::compile(XY* xy)
+{
+  return force()->compile(xy);
+}
+
+XYSequence* XYPipeline::slice(size_t begin, size_t end)
+{
+  return force()->slice(begin, end);
+}
+
+// XYPrimitive
+XYPrimitive::XYPrimitive(string n, void (*func)(XY*)) : mName(n), mFunc(func) { }
+
+void XYPrimitive::print(ostringstream& stream, CircularSet&, bool) const {
+  stream << mName;
+}
+
+void XYPrimitive::eval1(XY* xy) {
+  mFunc(xy);
+}
+
+int XYPrimitive::compare(XYObject* rhs) {
+  XYPrimitive* o = dynamic_cast<XYPrimitive*>(rhs);
+  if (!o)
+    return toString(true).compare(rhs->toString(true));
+
+  return mName.compare(o->mName);
+}
+
+// XYCode
+static void primitive_quote(XY* xy);
+
+XYCode::XYCode(XY* xy, XYSequence* sequence) {
+  XYSequence::List objects;
+  sequence->pushBackInto(objects);
+  size_t n = objects.size();
+
+  mInstructions.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    Instruction& ins = mInstructions[i];
+    ins.mOp = OP_EVAL;
+    ins.mObject = objects[i];
+    ins.mPrimitive = 0;
+
+    XYSymbol* symbol = dynamic_cast<XYSymbol*>(ins.mObject);
+    if (symbol) {
+      XYPrimitive* primitive = dynamic_cast<XYPrimitive*>(xy->mP.lookup(symbol->mId));
+      if (!primitive)
+        ins.mOp = OP_SYMBOL;
+      else {
+        // A quote at the end of the code needs the next item
+        // on the queue so is left for the primitive to handle.
+        ins.mOp = primitive->mFunc == primitive_quote && i + 1 < n ? OP_QUOTE : OP_PRIMITIVE;
+        ins.mPrimitive = primitive;
+      }
+    }
+    else if (dynamic_cast<XYNumber*>(ins.mObject) ||
+             dynamic_cast<XYSequence*>(ins.mObject))
+      ins.mOp = OP_PUSH;
+  }
+}
+
+void XYCode::markChildren() {
+  for (Instructions::iterator it = mInstructions.begin(); it != mInstructions.end(); ++it) {
+    (*it).mObject->mark();
+    if ((*it).mPrimitive)
+      (*it).mPrimitive->mark();
+  }
+}
+
+// XYPattern
+XYPattern::XYPattern(XY* xy, XYSequence* pattern) :
+  mSize(pattern->size()),
+  mCode(0),
+  mVersion(sequence_version()) {
+  assert(mSize > 0);
+  compile(pattern->at(0), mMatcher);
+
+  if (mSize > 1) {
+    XYList* body = new XYList();
+    mBody.resize(mSize - 1);
+    for (size_t i = 1; i < mSize; ++i) {
+      compile(pattern->at(i), mBody[i - 1]);
+      body->mList.push_back(mBody[i - 1].mObject);
+    }
+    mCode = new XYCode(xy, body);
+  }
+}
+
+void XYPattern::compile(XYObject* pattern, Matcher& matcher) {
+  XYSequence* list = dynamic_cast<XYSequence*>(pattern);
+  XYSymbol* symbol = dynamic_cast<XYSymbol*>(pattern);
+  if (list) {
+    record(list);
+    matcher.mKind = Matcher::LIST;
+    matcher.mChildren.resize(list->size());
+    for (size_t i = 0; i < list->size(); ++i)
+      compile(list->at(i), matcher.mChildren[i]);
+  }
+  else if (symbol) {
+    string uppercase = symbol->mValue;
+    to_upper(uppercase);
+    matcher.mKind = uppercase == symbol->mValue ? Matcher::REST : Matcher::BIND;
+    vector<unsigned int>::iterator it = find(mIds.begin(), mIds.end(), symbol->mId);
+    matcher.mSlot = it - mIds.begin();
+    if (it == mIds.end())
+      mIds.push_back(symbol->mId);
+  }
+  else
+    matcher.mKind = Matcher::IGNORE;
+}
+
+void XYPattern::compile(XYObject* object, Template& t) {
+  XYSequence* list = dynamic_cast<XYSequence*>(object);
+  XYSymbol* symbol = dynamic_cast<XYSymbol*>(object);
+  t.mObject = object;
+  t.mSlot = -1;
+  t.mSequence = list != 0;
+  if (list) {
+    record(list);
+    t.mChildren.resize(list->size());
+    for (size_t i = 0; i < list->size(); ++i)
+      compile(list->at(i), t.mChildren[i]);
+  }
+  else if (symbol) {
+    vector<unsigned int>::iterator it = find(mIds.begin(), mIds.end(), symbol->mId);
+    if (it != mIds.end())
+      t.mSlot = it - mIds.begin();
+  }
+}
+
+void XYPattern::record(XYSequence* sequence) {
+  Values elements;
+  sequence->pushBackInto(elements);
+  mNested.push_back(make_pair(sequence, elements));
+}
+
+// Returns true if 'a' and 'b' are the same element of a sequence.
+// Packed vectors box their elements each time they are read, so
+// numbers of the same type are compared by value.
+static bool same_element(XYObject* a, XYObject* b) {
+  if (a == b)
+    return true;
+
+  XYInteger* ia = dynamic_cast<XYInteger*>(a);
+  XYInteger* ib = dynamic_cast<XYInteger*>(b);
+  if (ia && ib)
+    return ia->compare(ib) == 0;
+
+  XYFloat* fa = dynamic_cast<XYFloat*>(a);
+  XYFloat* fb = dynamic_cast<XYFloat*>(b);
+  return fa && fb && fa->compare(fb) == 0;
+}
+
+bool XYPattern::stale() {
+  if (mVersion == sequence_version())
+    return false;
+
+  for (Nested::const_iterator it = mNested.begin(); it != mNested.end(); ++it) {
+    XYSequence* sequence = (*it).first;
+    Values const& elements = (*it).second;
+    if (sequence->size() != elements.size())
+      return true;
+    for (size_t i = 0; i < elements.size(); ++i)
+      if (!same_element(sequence->at(i), elements[i]))
+        return true;
+  }
+
+  mVersion = sequence_version();
+  return false;
+}
+
+void XYPattern::match(XY* xy, Values& values) const {
+  values.assign(mIds.size(), 0);
+
+  if (mMatcher.mKind != Matcher::LIST) {
+    xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+    XYObject* o = xy->mX.back();
+    xy->mX.pop_back();
+    match(mMatcher, o, new XYList(), 0, values);
+    return;
+  }
+
+  // Match the elements of the pattern against the top of the stack.
+  // A sequence of the stack items is only needed when a variable
+  // binds the rest of them.
+  size_t n = mMatcher.mChildren.size();
+  xy_assert(xy->mX.size() >= n, XYError::STACK_UNDERFLOW);
+  size_t base = xy->mX.size() - n;
+  XYList* stack = 0;
+  for (size_t i = 0; i < n; ++i) {
+    Matcher const& child = mMatcher.mChildren[i];
+    if (child.mKind == Matcher::REST && !stack)
+      stack = new XYList(xy->mX.begin() + base, xy->mX.end());
+    match(child, xy->mX[base + i], stack, i, values);
+  }
+  xy->mX.resize(base);
+}
+
+void XYPattern::match(Matcher const& matcher,
+		      XYObject* object,
+		      XYSequence* sequence,
+		      size_t i,
+		      Values& values) const {
+  switch (matcher.mKind) {
+    case Matcher::IGNORE:
+      break;
+
+    case Matcher::BIND:
+      values[matcher.mSlot] = object;
+      break;
+
+    case Matcher::REST:
+      values[matcher.mSlot] = sequence->slice(i, sequence->size());
+      break;
+
+    case Matcher::LIST:
+      {
+	// If the pattern is a list, but the object is not, 
+	// pretend the object is a one element list. This enables:
+	// 42 [ [[a A]] a A ] -> 42 []
+	XYSequence* list = dynamic_cast<XYSequence*>(object);
+	if (!list) {
+	  XYList* wrapped = new XYList();
+	  wrapped->mList.push_back(object);
+	  list = wrapped;
+	}
+
+	size_t n = list->size();
+	size_t pi = 0;
+	for (; pi < matcher.mChildren.size() && pi < n; ++pi)
+	  match(matcher.mChildren[pi], list->at(pi), list, pi, values);
+
+	// If there are more pattern items than there are list items,
+	// set the pattern value to null.
+	for (; pi < matcher.mChildren.size(); ++pi) {
+	  Matcher const& child = matcher.mChildren[pi];
+	  if (child.mKind == Matcher::BIND || child.mKind == Matcher::REST)
+	    values[child.mSlot] = new XYList();
+	}
+      }
+      break;
+  }
+}
+
+XYObject* XYPattern::instantiate(Template const& t, Values const& values) const {
+  if (t.mSequence) {
+    XYList* list = new XYList();
+    list->mList.reserve(t.mChildren.size());
+    for (vector<Template>::const_iterator it = t.mChildren.begin(); it != t.mChildren.end(); ++it)
+      list->mList.push_back(instantiate(*it, values));
+    return list;
+  }
+
+  if (t.mSlot >= 0 && values[t.mSlot])
+    return values[t.mSlot];
+
+  return t.mObject;
 }
 
-void XYSlice::pushBackInto(List& list) {
-  for (int i = mBegin; i != mEnd; ++i)
-    list.push_back(mOriginal->at(i));
+void XYPattern::push(XY* xy, Values const& values) const {
+  for (vector<Template>::const_iterator it = mBody.begin(); it != mBody.end(); ++it)
+    xy->mX.push_back(instantiate(*it, values));
 }
 
-XYObject* XYSlice::at(size_t n)
-{
-  assert(mBegin + n < mEnd);
-  return mOriginal->at(mBegin + n);
+XYCode* XYPattern::code(Values const& values) const {
+  assert(mCode);
+  XYCode* code = new XYCode(*mCode);
+  for (size_t i = 0; i < mBody.size(); ++i) {
+    Template const& t = mBody[i];
+    if (t.mSequence || (t.mSlot >= 0 && values[t.mSlot])) {
+      XYCode::Instruction& ins = code->mInstructions[i];
+      ins.mObject = instantiate(t, values);
+      ins.mOp = t.mSequence ? XYCode::OP_PUSH : XYCode::OP_EVAL;
+      ins.mPrimitive = 0;
+    }
+  }
+  return code;
 }
 
-void XYSlice::set_at(size_t n, XYObject* v)
-{
-  assert(mBegin + n < mEnd);
-  mOriginal->set_at(mBegin + n, v); 
+static void mark_template(XYPattern::Template const& t) {
+  t.mObject->mark();
+  for (vector<XYPattern::Template>::const_iterator it = t.mChildren.begin(); it != t.mChildren.end(); ++it)
+    mark_template(*it);
 }
 
-XYObject* XYSlice::head()
-{
-  assert(mBegin != mEnd);
-  return mOriginal->at(mBegin);
+void XYPattern::markChildren() {
+  for (vector<Template>::const_iterator it = mBody.begin(); it != mBody.end(); ++it)
+    mark_template(*it);
+  for (Nested::const_iterator it = mNested.begin(); it != mNested.end(); ++it)
+    (*it).first->mark();
+  if (mCode)
+    mCode->mark();
 }
 
-XYSequence* XYSlice::tail()
+// XYQueue
+XYQueue::const_iterator::const_iterator(Frames::const_iterator frame, Frames::const_iterator end) :
+  mFrame(frame),
+  mEnd(end),
+  mPC(frame == end ? 0 : (*frame).mPC)
 {
-  if (size() <= 1)
-    return new XYList();
+}
 
-  return new XYSlice(mOriginal, mBegin+1, mEnd);
+XYQueue::const_iterator::reference XYQueue::const_iterator::operator*() const {
+  Frame const& frame = *mFrame;
+  return frame.mCode ? frame.mCode->mInstructions[mPC].mObject : frame.mObject;
 }
 
-XYSequence* XYSlice::join(XYSequence* rhs)
-{
-  if (dynamic_cast<XYJoin*>(rhs)) {
-    // Modify the existing join
-    XYJoin* join_rhs = dynamic_cast<XYJoin*>(rhs);
-    join_rhs->mSequences.push_front(this);
-    return join_rhs;
+XYQueue::const_iterator& XYQueue::const_iterator::operator++() {
+  Frame const& frame = *mFrame;
+  if (!frame.mCode || ++mPC == frame.mCode->mInstructions.size()) {
+    ++mFrame;
+    mPC = mFrame == mEnd ? 0 : (*mFrame).mPC;
   }
-
-  return new XYJoin(this, rhs);
+  return *this;
 }
 
-// XYJoin
-XYJoin::XYJoin(XYSequence* first, XYSequence* second)
-{ 
-  mSequences.push_back(first);
-  mSequences.push_back(second);
+XYQueue::const_iterator XYQueue::const_iterator::operator++(int) {
+  const_iterator result(*this);
+  ++(*this);
+  return result;
 }
 
-void XYJoin::markChildren() {
-  for (iterator it = mSequences.begin(); it != mSequences.end(); ++it)
-    (*it)->mark();
+bool XYQueue::const_iterator::operator==(const_iterator const& rhs) const {
+  return mFrame == rhs.mFrame && mPC == rhs.mPC;
 }
 
-void XYJoin::print(ostringstream& stream, CircularSet& seen, bool parse) const {
-  if (seen.find(this) != seen.end()) {
-    stream << "(circular)";
-  }
-  else {
-    seen.insert(this);
-    stream << "[ ";
-    for(const_iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
-      for (int i=0; i < (*it)->size(); ++i) {
-	(*it)->at(i)->print(stream, seen, parse);
-	stream << " ";
-      }
-    }
-    stream << "]";
-  }
+bool XYQueue::const_iterator::operator!=(const_iterator const& rhs) const {
+  return !(*this == rhs);
 }
 
-size_t XYJoin::size()
-{
-  size_t s = 0;
-  for(iterator it = mSequences.begin(); it != mSequences.end(); ++it) 
-    s += (*it)->size();
+XYQueue::XYQueue() : mSize(0) { }
 
-  return s;
+XYQueue::const_iterator XYQueue::begin() const {
+  return const_iterator(mFrames.begin(), mFrames.end());
 }
 
-XYObject* XYJoin::at(size_t n)
-{
-  assert(n < size());
-  size_t s = 0;
-  for(iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
-    size_t b = s;
-    s += (*it)->size();
-    if (n < s)
-      return (*it)->at(n-b);
-  }
-
-  assert(1 == 0);
+XYQueue::const_iterator XYQueue::end() const {
+  return const_iterator(mFrames.end(), mFrames.end());
 }
 
-void XYJoin::set_at(size_t n, XYObject* v)
-{
-  assert(n < size());
-  size_t s = 0;
-  for(iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
-    size_t b = s;
-    s += (*it)->size();
-    if (n < s)
-      return (*it)->set_at(n-b, v);
-  }
-
-  assert(1 == 0);
+XYObject* XYQueue::operator[](size_t n) const {
+  assert(n < mSize);
+  const_iterator it = begin();
+  while (n--)
+    ++it;
+  return *it;
 }
 
-void XYJoin::pushBackInto(List& list)
-{  
-  for(iterator it = mSequences.begin(); it != mSequences.end(); ++it) {
-    (*it)->pushBackInto(list);
-  }
+XYObject* XYQueue::front() const {
+  assert(mSize > 0);
+  return *begin();
 }
 
-XYObject* XYJoin::head()
-{
-  return at(0);
+void XYQueue::pop_front() {
+  assert(mSize > 0);
+  Frame& frame = mFrames.front();
+  if (!frame.mCode || ++frame.mPC == frame.mCode->mInstructions.size())
+    mFrames.pop_front();
+  --mSize;
 }
 
-XYSequence* XYJoin::tail()
-{
-  if (size() <= 1)
-    return new XYList();
+void XYQueue::push_front(XYObject* o) {
+  Frame frame = { 0, 0, o };
+  mFrames.push_front(frame);
+  ++mSize;
+}
 
-  return new XYSlice(dynamic_cast<XYSequence*>(this), 1, size());
+void XYQueue::push_back(XYObject* o) {
+  Frame frame = { 0, 0, o };
+  mFrames.push_back(frame);
+  ++mSize;
 }
 
-XYSequence* XYJoin::join(XYSequence* rhs)
-{
-  if (dynamic_cast<XYJoin*>(rhs)) {
-    // Modify ourselves
-    XYJoin* join_rhs(dynamic_cast<XYJoin*>(rhs));
-    mSequences.insert(mSequences.end(), 
-		      mSequences.begin(), mSequences.end());
-    return this;
-  }
+void XYQueue::push_front(XYCode* code, size_t pc) {
+  if (pc >= code->mInstructions.size())
+    return;
 
-  // rhs is not a join
-  mSequences.push_back(rhs);
-  return this;
+  Frame frame = { code, pc, 0 };
+  mFrames.push_front(frame);
+  mSize += code->mInstructions.size() - pc;
 }
 
-// XYPrimitive
-XYPrimitive::XYPrimitive(string n, void (*func)(XY*)) : mName(n), mFunc(func) { }
+bool XYQueue::pop_code(XYCode*& code, size_t& pc) {
+  assert(mSize > 0);
+  Frame& frame = mFrames.front();
+  if (!frame.mCode)
+    return false;
 
-void XYPrimitive::print(ostringstream& stream, CircularSet&, bool) const {
-  stream << mName;
+  code = frame.mCode;
+  pc = frame.mPC;
+  mSize -= code->mInstructions.size() - pc;
+  mFrames.pop_front();
+  return true;
 }
 
-void XYPrimitive::eval1(XY* xy) {
-  mFunc(xy);
+void XYQueue::clear() {
+  mFrames.clear();
+  mSize = 0;
 }
 
-int XYPrimitive::compare(XYObject* rhs) {
-  XYPrimitive* o = dynamic_cast<XYPrimitive*>(rhs);
-  if (!o)
-    return toString(true).compare(rhs->toString(true));
-
-  return mName.compare(o->mName);
+void XYQueue::markChildren() {
+  for (Frames::iterator it = mFrames.begin(); it != mFrames.end(); ++it) {
+    if ((*it).mCode)
+      (*it).mCode->mark();
+    else
+      (*it).mObject->mark();
+  }
 }
  
 // Primitive Implementations
@@ -1153,7 +4279,7 @@ static void primitive_set(XY* xy) {
   XYObject* value = xy->mX.back();
   xy->mX.pop_back();
 
-  xy->mEnv[name->mValue] = value;
+  xy->mEnv.set(name->mId, value);
 }
 
 // get [X^name Y] [X^value Y]
@@ -1170,17 +4296,16 @@ static void primitive_get(XY* xy) {
   xy_assert(name, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYEnv::iterator it = xy->mEnv.find(name->mValue);
-  if (it == xy->mEnv.end()) {
+  XYObject* value = xy->mEnv.lookup(name->mId);
+  if (!value) {
     // Not in environment, look up object
     xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
     XYObject* object = xy->mX.back();
     xy_assert(object, XYError::TYPE);
     xy->mX.pop_back();
 
-    set<XYObject*> circular;
     XYObject* context = 0;
-    XYSlot* slot = object->lookup(name->mValue, circular, &context);
+    XYSlot* slot = name->mSlotCache.lookup(object, name->mId, &context);
     xy_assert(slot, XYError::SLOT_NOT_FOUND);
     xy_assert(slot->mMethod, XYError::INVALID_SLOT_TYPE);
     xy_assert(context, XYError::INVALID_SLOT_TYPE);
@@ -1189,9 +4314,6 @@ static void primitive_get(XY* xy) {
     xy->mX.push_back(slot->mMethod);
   }
   else {
-    xy_assert(it != xy->mEnv.end(), XYError::SYMBOL_NOT_FOUND);
-
-    XYObject* value = (*it).second;
     xy->mX.push_back(value);
   }
 }
@@ -1223,28 +4345,29 @@ static void primitive_unquote(XY* xy) {
   XYSequence* list = dynamic_cast<XYSequence*>(o);
 
   if (list) {
-    XYStack temp;
-    list->pushBackInto(temp);
-
-    xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());
+    xy->call(list);
   }
   else {
     XYSymbol* symbol = dynamic_cast<XYSymbol*>(o);
     if (symbol) {
       // If it's a symbol, get the value of the symbol and apply
       // unquote to that.
-      XYEnv::iterator it = xy->mEnv.find(symbol->mValue);
-      if (it != xy->mEnv.end()) {
-	xy->mX.push_back((*it).second);
+      XYObject* value = xy->mEnv.lookup(symbol->mId);
+      XYPrimitive* primitive = dynamic_cast<XYPrimitive*>(value);
+      if (primitive) {
+	// Native words bound in the environment are called directly
+	primitive->mFunc(xy);
+      }
+      else if (value) {
+	xy->mX.push_back(value);
 	primitive_unquote(xy);
       }
       else {
 	// If the symbol doesn't exist in the environment, look
 	// it up in the current frame.
 	assert(xy->mFrame);
-	set<XYObject*> circular;
 	XYObject* context = 0;
-	XYSlot* slot = xy->mFrame->lookup(symbol->mValue, circular, &context);
+	XYSlot* slot = symbol->mSlotCache.lookup(xy->mFrame, symbol->mId, &context);
 	if (slot) {
 	  xy_assert(slot->mMethod, XYError::INVALID_SLOT_TYPE);
 	  xy_assert(context, XYError::INVALID_SLOT_TYPE);
@@ -1273,11 +4396,19 @@ static void primitive_unquote(XY* xy) {
 	}
       }
     }
-    else 
+    else {
+      xy->materialize();
       xy->mY.push_front(o);
+    }
   }
 }
 
+// Returns the compiled form of the pattern
+static XYPattern* compile_pattern(XY* xy, XYSequence* pattern) {
+  XYList* list = dynamic_cast<XYList*>(pattern);
+  return list ? list->compilePattern(xy) : new XYPattern(xy, pattern);
+}
+
 // ) [X^{pattern} Y] [X^result Y]
 static void primitive_pattern_ss(XY* xy) {
   xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
@@ -1285,26 +4416,15 @@ static void primitive_pattern_ss(XY* xy) {
   // Get the pattern from the stack
   XYSequence* pattern = dynamic_cast<XYSequence*>(xy->mX.back());
   xy_assert(pattern, XYError::TYPE);
+  xy_assert(pattern->size() != 0, XYError::TYPE);
   xy->mX.pop_back();
-  assert(pattern->size() != 0);
 
-  // Populate env with a mapping between the pattern variables to the
-  // values on the stack.
-  XYEnv env;
-  xy->getPatternValues(pattern->at(0), inserter(env, env.begin()));
-  // Process pattern body using these mappings.
-  if (pattern->size() > 1) {
-    int start = 0;
-    int end   = pattern->size();
-    XYList* list(new XYList());    
-    xy->replacePattern(env, new XYSlice(pattern, ++start, end), back_inserter(list->mList));
-    assert(list->size() > 0);
-
-    // Append to stack
-    list = dynamic_cast<XYList*>(list->mList[0]);
-    xy_assert(list, XYError::TYPE);
-    xy->mX.insert(xy->mX.end(), list->mList.begin(), list->mList.end());
-  }
+  // Bind the pattern variables to the values on the stack and
+  // append the pattern body using these values.
+  XYPattern* compiled = compile_pattern(xy, pattern);
+  XYPattern::Values values;
+  compiled->match(xy, values);
+  compiled->push(xy, values);
 }
 
 // ( [X^{pattern} Y] [X result^Y]
@@ -1314,26 +4434,16 @@ static void primitive_pattern_sq(XY* xy) {
   // Get the pattern from the stack
   XYSequence* pattern = dynamic_cast<XYSequence*>(xy->mX.back());
   xy_assert(pattern, XYError::TYPE);
+  xy_assert(pattern->size() != 0, XYError::TYPE);
   xy->mX.pop_back();
-  assert(pattern->size() != 0);
-
-  // Populate env with a mapping between the pattern variables to the
-  // values on the stack.
-  XYEnv env;
-  xy->getPatternValues(pattern->at(0), inserter(env, env.begin()));
-  // Process pattern body using these mappings.
-  if (pattern->size() > 1) {
-    int start = 0;
-    int end   = pattern->size();
-    XYList* list(new XYList());
-    xy->replacePattern(env, new XYSlice(pattern, ++start, end), back_inserter(list->mList));
-    assert(list->size() > 0);
 
-    // Prepend to queue
-    list = dynamic_cast<XYList*>(list->mList[0]);
-    xy_assert(list, XYError::TYPE);
-    xy->mY.insert(xy->mY.begin(), list->mList.begin(), list->mList.end());
-  }
+  // Bind the pattern variables to the values on the stack and
+  // prepend the pattern body using these values to the queue.
+  XYPattern* compiled = compile_pattern(xy, pattern);
+  XYPattern::Values values;
+  compiled->match(xy, values);
+  if (!compiled->mBody.empty())
+    xy->call(compiled->code(values));
 }
 
 // ` dip [X^b^{a0..an} Y] [X a0..an^b^Y]
@@ -1347,10 +4457,9 @@ static void primitive_dip(XY* xy) {
   assert(o);
   xy->mX.pop_back();
 
+  xy->materialize();
   xy->mY.push_front(o);
-  XYStack temp;
-  list->pushBackInto(temp);
-  xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());
+  xy->call(list);
 }
 
 // | reverse [X^{a0..an} Y] [X^{an..a0} Y]
@@ -1368,10 +4477,12 @@ static void primitive_reverse(XY* xy) {
 
 // \ quote [X^o Y] [X^{o} Y]
 static void primitive_quote(XY* xy) {
+  xy->materialize();
   assert(xy->mY.size() >= 1);
   XYObject* o = xy->mY.front();
   assert(o);
   xy->mY.pop_front();
+  queue_captured();
 
   XYList* list = new XYList();
   list->mList.push_back(o);
@@ -1392,28 +4503,27 @@ static void primitive_join(XY*xy) {
   XYSequence* list_lhs = dynamic_cast<XYSequence*>(lhs);
   XYSequence* list_rhs = dynamic_cast<XYSequence*>(rhs);
 
+  // The result is a new sequence. The arguments are not modified
+  // so they can be safely shared. Adding to the end or the start
+  // of a list, or concatenating a small list, is done with a
+  // persistent vector which copies at most a path in its tree.
   if (list_lhs && list_rhs) {
-    // Two lists are concatenated
-    xy->mX.push_back(list_lhs->join(list_rhs));
+    // Two lists are concatenated. Strings join with strings and
+    // long lists are joined lazily.
+    if (!dynamic_cast<XYString*>(lhs) &&
+	(list_lhs->size() <= XYVector::BRANCHES ||
+	 list_rhs->size() <= XYVector::BRANCHES))
+      xy->mX.push_back(XYVector::make(list_lhs)->join(list_rhs));
+    else
+      xy->mX.push_back(list_lhs->join(list_rhs));
   }
   else if(list_lhs) {
     // If rhs is not a list, it is added to the end of the list.
-    if (dynamic_cast<XYList*>(lhs)) {
-      // Optimisation for a list on the lhs. We modify the list.
-      dynamic_cast<XYList*>(list_lhs)->mList.push_back(rhs);
-    }
-    else {
-      XYList* list(new XYList());
-      list->mList.push_back(rhs);
-      xy->mX.push_back(list_lhs->join(list));
-    }
-    xy->mX.push_back(list_lhs);
+    xy->mX.push_back(XYVector::make(list_lhs)->push_back(rhs));
   }
   else if(list_rhs) {
     // If lhs is not a list, it is added to the front of the list
-    XYList* list(new XYList());
-    list->mList.push_back(lhs);
-    xy->mX.push_back(list->join(list_rhs));
+    xy->mX.push_back(XYVector::make(list_rhs)->push_front(lhs));
   }
   else {
     // If neither are lists, a list is made containing the two items
@@ -1434,15 +4544,15 @@ static void primitive_stack(XY* xy) {
   xy_assert(list, XYError::TYPE);
   xy->mX.pop_back();
 
+  xy->materialize();
   XYList* stack(new XYList(xy->mX.begin(), xy->mX.end()));
   XYList* queue(new XYList(xy->mY.begin(), xy->mY.end()));
+  queue_captured();
 
   xy->mX.push_back(stack);
   xy->mX.push_back(queue);
   xy->mY.push_front(new XYSymbol("$$"));
-  XYStack temp;
-  list->pushBackInto(temp);
-  xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end()); 
+  xy->call(list);
 }
 
 // $$ stackqueue - Helper word for '$'. Given a stack and queue on the
@@ -1461,10 +4571,10 @@ static void primitive_stackqueue(XY* xy) {
   XYStack stemp;
   stack->pushBackInto(stemp);
 
-  XYQueue qtemp;
-  for( int i=0; i < queue->size(); ++i)
-    qtemp.push_back(queue->at(i));
+  XYStack qtemp;
+  queue->pushBackInto(qtemp);
 
+  xy->materialize();
   xy->mX.assign(stemp.begin(), stemp.end());
   xy->mY.assign(qtemp.begin(), qtemp.end());
 }
@@ -1482,9 +4592,9 @@ static void primitive_equals(XY* xy) {
   xy->mX.pop_back();
 
   if (lhs->compare(rhs) == 0)
-    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(XYInteger::make(1));
   else
-    xy->mX.push_back(new XYInteger(0));
+    xy->mX.push_back(XYInteger::make(0));
 }
 
 // <  [X^a^b Y] [X^? Y] 
@@ -1500,9 +4610,9 @@ static void primitive_lessThan(XY* xy) {
   xy->mX.pop_back();
 
   if (lhs->compare(rhs) < 0)
-    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(XYInteger::make(1));
   else
-    xy->mX.push_back(new XYInteger(0));
+    xy->mX.push_back(XYInteger::make(0));
 }
 
 // >  [X^a^b Y] [X^? Y] 
@@ -1518,9 +4628,9 @@ static void primitive_greaterThan(XY* xy) {
   xy->mX.pop_back();
 
   if (lhs->compare(rhs) > 0)
-    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(XYInteger::make(1));
   else
-    xy->mX.push_back(new XYInteger(0));
+    xy->mX.push_back(XYInteger::make(0));
 }
 
 // <=  [X^a^b Y] [X^? Y] 
@@ -1536,9 +4646,9 @@ static void primitive_lessThanEqual(XY* xy) {
   xy->mX.pop_back();
 
   if (lhs->compare(rhs) <= 0)
-    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(XYInteger::make(1));
   else
-    xy->mX.push_back(new XYInteger(0));
+    xy->mX.push_back(XYInteger::make(0));
 }
 
 // >=  [X^a^b Y] [X^? Y] 
@@ -1554,9 +4664,9 @@ static void primitive_greaterThanEqual(XY* xy) {
   xy->mX.pop_back();
 
   if (lhs->compare(rhs) >= 0)
-    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(XYInteger::make(1));
   else
-    xy->mX.push_back(new XYInteger(0));
+    xy->mX.push_back(XYInteger::make(0));
 }
 
 
@@ -1570,14 +4680,14 @@ static void primitive_not(XY* xy) {
 
   XYNumber* n = dynamic_cast<XYNumber*>(o);
   if (n && n->is_zero()) {
-    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(XYInteger::make(1));
   }
   else {
     XYSequence* l = dynamic_cast<XYSequence*>(o);
     if(l && l->size() == 0)
-      xy->mX.push_back(new XYInteger(1));
+      xy->mX.push_back(XYInteger::make(1));
     else
-      xy->mX.push_back(new XYInteger(0));
+      xy->mX.push_back(XYInteger::make(0));
   }
 }
 
@@ -1600,12 +4710,13 @@ static void primitive_nth(XY* xy) {
   if (n) {
     // Index is a number, do a direct index into the list
     if (n->as_uint() >= list->size()) 
-      xy->mX.push_back(new XYInteger(list->size()));
+      xy->mX.push_back(XYInteger::make(list->size()));
     else
       xy->mX.push_back(list->at(n->as_uint()));    
   }
   else if (s) {
     // Index is a list. Use this as a path into the list.
+    xy->materialize();
     if (s->size() == 0) {
       // If the path is empty, return the entire list
       xy->mX.push_back(list);
@@ -1752,13 +4863,13 @@ static void primitive_count(XY* xy) {
 
   XYSequence* list(dynamic_cast<XYSequence*>(o));
   if (list)
-    xy->mX.push_back(new XYInteger(list->size()));
+    xy->mX.push_back(XYInteger::make(list->size()));
   else {
     XYString* s(dynamic_cast<XYString*>(o));
     if (s)
-      xy->mX.push_back(new XYInteger(s->mValue.size()));
+      xy->mX.push_back(XYInteger::make(s->size()));
     else
-      xy->mX.push_back(new XYInteger(1));
+      xy->mX.push_back(XYInteger::make(1));
   }
 }
 
@@ -1777,7 +4888,7 @@ static void primitive_split(XY* xy) {
   xy->mX.pop_back();
 
   vector<string> result;
-  split(result, str->mValue, is_any_of(seps->mValue));
+  split(result, str->value(), is_any_of(seps->value()));
  
   XYList* list(new XYList());
   for (vector<string>::iterator it = result.begin(); it != result.end(); ++it)
@@ -1785,6 +4896,22 @@ static void primitive_split(XY* xy) {
   xy->mX.push_back(list);
 }
 
+// Returns true if the sequence is a pipeline that has not been forced.
+// Takes and drops are added to these as stages rather than forcing
+// them to find their size.
+static bool is_lazy_pipeline(XYSequence* seq) {
+  XYPipeline* pipeline = dynamic_cast<XYPipeline*>(seq);
+  return pipeline && !pipeline->mElements;
+}
+
+// Returns a take or drop pipeline stage of 'n' elements
+static XYPipeline::Stage count_stage(XYPipeline::Stage::Kind kind, XYNumber* n) {
+  XYPipeline::Stage stage;
+  stage.mKind = kind;
+  stage.mCount = n->as_uint();
+  return stage;
+}
+
 // sdrop [X^seq^n Y] [X^{...} Y] 
 // drops n items from the beginning of the sequence
 static void primitive_sdrop(XY* xy) {
@@ -1800,14 +4927,14 @@ static void primitive_sdrop(XY* xy) {
   xy->mX.pop_back();
 
   if (str) {
-    if (n->as_uint() >= str->mValue.size())
-      xy->mX.push_back(new XYString(""));
-    else
-      xy->mX.push_back(new XYString(str->mValue.substr(n->as_uint())));
+    xy->mX.push_back(str->substr(min(static_cast<size_t>(n->as_uint()), str->size())));
+  }
+  else if (is_lazy_pipeline(seq)) {
+    xy->mX.push_back(XYPipeline::extend(seq, count_stage(XYPipeline::Stage::DROP, n)));
   }
   else {
-    // TODO
-    assert(1 == 0);
+    size_t size = seq->size();
+    xy->mX.push_back(seq->slice(min(static_cast<size_t>(n->as_uint()), size), size));
   }
 }
 
@@ -1826,11 +4953,13 @@ static void primitive_stake(XY* xy) {
   xy->mX.pop_back();
 
   if (str) {
-    xy->mX.push_back(new XYString(str->mValue.substr(0, n->as_uint())));
+    xy->mX.push_back(str->substr(0, n->as_uint()));
+  }
+  else if (is_lazy_pipeline(seq)) {
+    xy->mX.push_back(XYPipeline::extend(seq, count_stage(XYPipeline::Stage::TAKE, n)));
   }
   else {
-    // TODO
-    assert(1 == 0);
+    xy->mX.push_back(seq->slice(0, min(static_cast<size_t>(n->as_uint()), seq->size())));
   }
 }
 
@@ -1848,7 +4977,7 @@ static void primitive_tokenize(XY* xy) {
   xy->mX.pop_back();
 
   vector<string> tokens;
-  tokenize(s->mValue.begin(), s->mValue.end(), back_inserter(tokens));
+  tokenize(s->value().begin(), s->value().end(), back_inserter(tokens));
 
   XYList* result(new XYList());
   for(vector<string>::iterator it=tokens.begin(); it != tokens.end(); ++it)
@@ -1870,7 +4999,7 @@ static void primitive_parse(XY* xy) {
   for (int i=0; i < tokens->size(); ++i) {
     XYString* s = dynamic_cast<XYString*>(tokens->at(i));
     xy_assert(s, XYError::TYPE);
-    strings.push_back(s->mValue);
+    strings.push_back(s->value());
   }
 
   XYList* result(new XYList());
@@ -1897,7 +5026,7 @@ static void primitive_getline(XY* xy) {
 				"\n",
 				bind(getlineHandler, xy, boost::asio::placeholders::error));
 
-  throw XYError(xy, XYError::WAITING_FOR_ASYNC_EVENT);
+  xy->suspend();
 } 
 
 // millis [X Y] [X^m Y]
@@ -1912,62 +5041,443 @@ static void primitive_millis(XY* xy) {
 
   time_duration d(e - s);
 
-  xy->mX.push_back(new XYInteger(d.total_milliseconds()));
+  xy->mX.push_back(XYInteger::make(d.total_milliseconds()));
+}
+
+// set-quantum [X^steps^microseconds Y] [X Y]
+// Set the maximum number of steps and the maximum time the
+// interpreter runs before letting other interpreters run. Zero
+// means no bound.
+static void primitive_set_quantum(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYNumber* microseconds(dynamic_cast<XYNumber*>(xy->mX.back()));
+  xy_assert(microseconds, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYNumber* steps(dynamic_cast<XYNumber*>(xy->mX.back()));
+  xy_assert(steps, XYError::TYPE);
+  xy->mX.pop_back();
+
+  xy->mQuantumSteps = steps->as_uint();
+  xy->mQuantumMicroseconds = microseconds->as_uint();
+}
+
+// step-rate [X Y] [X^n Y]
+// The average number of steps per second this interpreter
+// has run.
+static void primitive_step_rate(XY* xy) {
+  unsigned long rate = 0;
+  if (xy->mStepTime != 0)
+    rate = static_cast<unsigned long>(xy->mSteps * 1000000.0 / xy->mStepTime);
+
+  xy->mX.push_back(XYInteger::make(static_cast<long>(rate)));
+}
+
+// enum [X^n Y] -> [X^{0..n} Y]
+static void primitive_enum(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYNumber* n = dynamic_cast<XYNumber*>(xy->mX.back());
+  xy_assert(n, XYError::TYPE);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(new XYRange(0, 1, n->as_uint()));
+}
+
+// clone [X^o Y] -> [X^o Y]
+static void primitive_clone(XY* xy) {
+  // TODO: Only works for sequences for now
+  // Implemented to work around an XYJoin limitation
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYSequence* o = dynamic_cast<XYSequence*>(xy->mX.back());
+  xy_assert(o, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYList* r(new XYList());
+  o->pushBackInto(r->mList);
+  xy->mX.push_back(r);
+}
+
+// to-string [X^o Y] -> [X^string Y]
+static void primitive_to_string(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYObject* o(xy->mX.back());
+  xy->mX.pop_back();
+
+  xy->mX.push_back(new XYString(o->toString(true)));
+}
+
+// to-symbol [X^o Y] -> [X^symbol Y]
+static void primitive_to_symbol(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYObject* o(xy->mX.back());
+  xy->mX.pop_back();
+
+  xy->mX.push_back(new XYSymbol(o->toString(false)));
+}
+
+// Native implementations of the looping words from the prelude. Each
+// call creates one XYLoop that holds the quotations and the progress
+// of the loop. The loop calls a quotation with the XYLoop itself
+// placed on the queue after it, so it is resumed when the quotation
+// completes. No code is generated on the queue for each iteration.
+class XYLoop : public XYObject
+{
+  public:
+    enum Kind {
+      WHILE,   // [c] [t] while
+      DO,      // n [f] do, also used by fold
+      EACH,    // seq [f] each
+      MAP,     // seq [q] map
+      FILTER,  // seq [p] filter
+      UNFOLD   // s [p] [q] [t] unfold
+    };
+
+  public:
+    Kind mKind;
+    std::string mName;
+
+    // The step to perform when next resumed. Zero when starting
+    // an iteration, otherwise a step specific to the kind of loop.
+    int mStep;
+
+    XYSequence* mFirst;
+    XYSequence* mSecond;
+    XYSequence* mThird;
+
+    // The sequence being iterated over and the index of the
+    // next element. For DO the number of calls remaining.
+    XYSequence* mSequence;
+    long mIndex;
+
+    // The value being unfolded, and the result being built. The
+    // result is copied along with the loop.
+    XYObject* mValue;
+    XYList* mResult;
+
+    // The capture version when the loop was created. If the queue has
+    // been captured since, the loop may be held by a continuation.
+    unsigned int mVersion;
+
+  public:
+    XYLoop(Kind kind, std::string name);
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+
+    // Run the next step of the loop. If the queue has been captured
+    // since the loop was created it may also be held by a
+    // continuation, so a copy of it is resumed instead.
+    virtual void eval1(XY* xy);
+
+    virtual int compare(XYObject* rhs);
+
+    // Run the next step of this loop, changing its state. Used to
+    // start a new loop that nothing else refers to.
+    void resume(XY* xy);
+
+  private:
+    // Call the quotation, resuming this loop when it completes
+    void call(XY* xy, XYSequence* quotation);
+
+    // Remove the top of the stack
+    XYObject* pop(XY* xy);
+};
+
+// Returns true if the object is considered true by 'if' and 'not'.
+// Zero numbers and empty sequences are false.
+static bool is_true(XYObject* o) {
+  XYNumber* n = dynamic_cast<XYNumber*>(o);
+  if (n)
+    return !n->is_zero();
+
+  XYSequence* s = dynamic_cast<XYSequence*>(o);
+  return !s || s->size() != 0;
+}
+
+XYLoop::XYLoop(Kind kind, std::string name) :
+  mKind(kind),
+  mName(name),
+  mStep(0),
+  mFirst(0),
+  mSecond(0),
+  mThird(0),
+  mSequence(0),
+  mIndex(0),
+  mValue(0),
+  mResult(0),
+  mVersion(capture_version()) { }
+
+void XYLoop::markChildren() {
+  XYObject::markChildren();
+  if (mFirst)
+    mFirst->mark();
+  if (mSecond)
+    mSecond->mark();
+  if (mThird)
+    mThird->mark();
+  if (mSequence)
+    mSequence->mark();
+  if (mValue)
+    mValue->mark();
+  if (mResult)
+    mResult->mark();
+}
+
+void XYLoop::print(ostringstream& stream, CircularSet&, bool) const {
+  stream << mName;
+}
+
+int XYLoop::compare(XYObject* rhs) {
+  if (this == rhs)
+    return 0;
+  return toString(true).compare(rhs->toString(true));
+}
+
+void XYLoop::call(XY* xy, XYSequence* quotation) {
+  xy->materialize();
+  xy->mY.push_front(this);
+  xy->call(quotation);
+}
+
+XYObject* XYLoop::pop(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYObject* o = xy->mX.back();
+  xy->mX.pop_back();
+  return o;
+}
+
+void XYLoop::eval1(XY* xy) {
+  if (mVersion == capture_version()) {
+    resume(xy);
+    return;
+  }
+
+  XYLoop* loop = new XYLoop(*this);
+  loop->mVersion = capture_version();
+  if (mResult)
+    loop->mResult = new XYList(mResult->mList.begin(), mResult->mList.end());
+  loop->resume(xy);
+}
+
+void XYLoop::resume(XY* xy) {
+  switch (mKind) {
+  case WHILE:
+    // mFirst is the condition, called on a copy of the top of the
+    // stack, and mSecond is the body.
+    if (mStep == 0) {
+      xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+      xy->mX.push_back(xy->mX.back());
+      mStep = 1;
+      call(xy, mFirst);
+    }
+    else if (is_true(pop(xy))) {
+      mStep = 0;
+      call(xy, mSecond);
+    }
+    break;
+
+  case DO:
+    if (mIndex > 0) {
+      --mIndex;
+      call(xy, mFirst);
+    }
+    break;
+
+  case EACH:
+    if (mIndex < static_cast<long>(mSequence->size())) {
+      xy->mX.push_back(mSequence->at(mIndex++));
+      call(xy, mFirst);
+    }
+    break;
+
+  case MAP:
+  case FILTER:
+    // Collect the result of the previous call. For FILTER it
+    // decides if the element that was passed is kept.
+    if (mStep == 1) {
+      XYObject* o = pop(xy);
+      if (mKind == MAP)
+	mResult->mList.push_back(o);
+      else if (is_true(o))
+	mResult->mList.push_back(mSequence->at(mIndex - 1));
+    }
+
+    if (mIndex < static_cast<long>(mSequence->size())) {
+      xy->mX.push_back(mSequence->at(mIndex++));
+      mStep = 1;
+      call(xy, mFirst);
+    }
+    else
+      xy->mX.push_back(mResult);
+    break;
+
+  case UNFOLD:
+    // Call the predicate on a copy of the value, then the
+    // quotation producing the element, then the quotation
+    // producing the next value.
+    if (mStep == 0) {
+      xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+      mValue = xy->mX.back();
+      xy->mX.push_back(mValue);
+      mStep = 1;
+      call(xy, mFirst);
+    }
+    else if (mStep == 1) {
+      if (is_true(pop(xy))) {
+	pop(xy);
+	xy->mX.push_back(mResult);
+      }
+      else {
+	mStep = 2;
+	call(xy, mSecond);
+      }
+    }
+    else {
+      mResult->mList.push_back(pop(xy));
+      xy->mX.push_back(mValue);
+      mStep = 0;
+      call(xy, mThird);
+    }
+    break;
+  }
+}
+
+// while [X^a^cond^body Y] [X^a' Y]
+// Calls 'body' while 'cond', called on a copy of the top of the
+// stack, is true.
+// 1 [5 <] [1 +] while => 5
+static void primitive_while(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYSequence* body(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(body, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYSequence* cond(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(cond, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYLoop* loop = new XYLoop(XYLoop::WHILE, "while");
+  loop->mFirst = cond;
+  loop->mSecond = body;
+  loop->resume(xy);
+}
+
+// do [X^n^quot Y] [X Y]
+// Calls 'quot' n times.
+static void primitive_do(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(quot, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYNumber* n(dynamic_cast<XYNumber*>(xy->mX.back()));
+  xy_assert(n, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYLoop* loop = new XYLoop(XYLoop::DO, "do");
+  loop->mFirst = quot;
+  loop->mIndex = n->as_integer()->value().get_si();
+  loop->resume(xy);
+}
+
+// repeat [X^n^o Y] [X^{o1..on} Y]
+// Joins n copies of 'o' as if by ','.
+// 3 x repeat => [ x x x ]
+// 2 [1 2] repeat => [ 1 2 1 2 ]
+static void primitive_repeat(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* o(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYNumber* num(dynamic_cast<XYNumber*>(xy->mX.back()));
+  xy_assert(num, XYError::TYPE);
+  xy->mX.pop_back();
+
+  long n = num->as_integer()->value().get_si();
+  if (n == 1) {
+    xy->mX.push_back(o);
+    return;
+  }
+
+  XYSequence* seq(dynamic_cast<XYSequence*>(o));
+  if (seq && !dynamic_cast<XYList*>(o) && n > 1) {
+    XYSequence* result = seq;
+    for (long i = 1; i < n; ++i)
+      result = result->join(seq);
+    xy->mX.push_back(result);
+    return;
+  }
+
+  XYList* result(new XYList());
+  for (long i = 0; i < n; ++i) {
+    if (seq)
+      seq->pushBackInto(result->mList);
+    else
+      result->mList.push_back(o);
+  }
+  xy->mX.push_back(result);
 }
 
-// enum [X^n Y] -> [X^{0..n} Y]
-static void primitive_enum(XY* xy) {
-  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
-  XYNumber* n = dynamic_cast<XYNumber*>(xy->mX.back());
-  xy_assert(n, XYError::TYPE);
+// each [X^seq^quot Y] [X Y]
+// Calls 'quot' with each element of 'seq' pushed on the stack.
+static void primitive_each(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(quot, XYError::TYPE);
   xy->mX.pop_back();
 
-  int value = n->as_uint();
-  XYList* list = new XYList();
-  for(int i=0; i < value; ++i)
-    list->mList.push_back(new XYInteger(i));
-  xy->mX.push_back(list);
-}
-
-// clone [X^o Y] -> [X^o Y]
-static void primitive_clone(XY* xy) {
-  // TODO: Only works for sequences for now
-  // Implemented to work around an XYJoin limitation
-  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
-  XYSequence* o = dynamic_cast<XYSequence*>(xy->mX.back());
-  xy_assert(o, XYError::TYPE);
+  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(seq, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYList* r(new XYList());
-  o->pushBackInto(r->mList);
-  xy->mX.push_back(r);
+  XYLoop* loop = new XYLoop(XYLoop::EACH, "each");
+  loop->mFirst = quot;
+  loop->mSequence = seq;
+  loop->resume(xy);
 }
 
-// to-string [X^o Y] -> [X^string Y]
-static void primitive_to_string(XY* xy) {
-  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
-  XYObject* o(xy->mX.back());
+// Shared by map and filter
+static void map_or_filter(XY* xy, XYLoop::Kind kind, std::string name) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(quot, XYError::TYPE);
   xy->mX.pop_back();
 
-  xy->mX.push_back(new XYString(o->toString(true)));
+  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(seq, XYError::TYPE);
+  xy->mX.pop_back();
+
+  // Quotations that don't need the interpreter are run lazily, fused
+  // with any other stages of the sequence's pipeline.
+  XYPipeline::Stage stage;
+  stage.mKind = kind == XYLoop::MAP ? XYPipeline::Stage::MAP : XYPipeline::Stage::FILTER;
+  stage.mCount = 0;
+  if (XYPipeline::compileStage(xy, quot, stage)) {
+    xy->mX.push_back(XYPipeline::extend(seq, stage));
+    return;
+  }
+
+  XYLoop* loop = new XYLoop(kind, name);
+  loop->mFirst = quot;
+  loop->mSequence = seq;
+  loop->mResult = new XYList();
+  loop->resume(xy);
 }
 
-// to-symbol [X^o Y] -> [X^symbol Y]
-static void primitive_to_symbol(XY* xy) {
-  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
-  XYObject* o(xy->mX.back());
-  xy->mX.pop_back();
+// map [X^seq^quot Y] [X^{...} Y]
+// [1 2 3] [10 *] map => [ 10 20 30 ]
+static void primitive_map(XY* xy) {
+  map_or_filter(xy, XYLoop::MAP, "map");
+}
 
-  xy->mX.push_back(new XYSymbol(o->toString(false)));
+// filter [X^seq^pred Y] [X^{...} Y]
+// [1 2 3 4 5] [3 <] filter => [ 1 2 ]
+static void primitive_filter(XY* xy) {
+  map_or_filter(xy, XYLoop::FILTER, "filter");
 }
 
-// foldl [X^seq^seed^quot Y] -> [X^seq Y]
-// [1 2 3] 0 [+] foldl
-// [2 3] 0 1 + [+] foldl
-// [3] 1 2 + [+] foldl
-// [] 3 3 + [+] foldl
-// 6
-static void primitive_foldl(XY* xy) {
+// Shared by the folds. Pushes the seed and returns a loop that
+// calls 'quot' for the elements of the sequence.
+static XYLoop* fold_loop(XY* xy, XYLoop::Kind kind, std::string name) {
   xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
   XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
   xy_assert(quot, XYError::TYPE);
@@ -1979,65 +5489,187 @@ static void primitive_foldl(XY* xy) {
   XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
   xy_assert(seq, XYError::TYPE);
   xy->mX.pop_back();
-			     
-  if (seq->size() == 0) {
-    xy->mX.push_back(seed);
-  }
-  else {
-    XYObject* head(seq->head());
-    XYSequence* tail(seq->tail());
-  
-    XYStack temp;
-    temp.push_back(tail);
-    temp.push_back(seed);
-    temp.push_back(head);    
-    temp.push_back(quot);
-    temp.push_back(new XYPrimitive(".", primitive_unquote));
-    temp.push_back(quot);
-    temp.push_back(new XYPrimitive("foldl", primitive_foldl));
-    
-    xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
-  }
+
+  xy->mX.push_back(seed);
+
+  XYLoop* loop = new XYLoop(kind, name);
+  loop->mFirst = quot;
+  loop->mSequence = seq;
+  return loop;
+}
+
+// foldl [X^seq^seed^quot Y] -> [X^? Y]
+// Calls 'quot' with the accumulator and each element in turn.
+// The accumulator is kept on the stack.
+// [1 2 3] 0 [+] foldl
+// 0 1 + 2 + 3 +
+// 6
+static void primitive_foldl(XY* xy) {
+  // This is 'each' with the seed pushed first
+  XYLoop* loop = fold_loop(xy, XYLoop::EACH, "foldl");
+  loop->resume(xy);
 }
 
-// foldr [X^seq^seed^quot Y] -> [X^seq Y]
+// foldr [X^seq^seed^quot Y] -> [X^? Y]
+// Pushes the seed and all the elements and then calls 'quot'
+// once for each element.
 // [1 2 3] 0 [+] foldr
-// 0 [2 3] 1 [+] foldr +
-// 0 1 [3] 2 [+] foldr + +
-// 0 1 2 [] 3 [+] foldr + + +
 // 0 1 2 3  + + +
 // 6
+static void fold_right(XY* xy, std::string name) {
+  XYLoop* loop = fold_loop(xy, XYLoop::DO, name);
+  loop->mSequence->pushBackInto(xy->mX);
+  loop->mIndex = loop->mSequence->size();
+  loop->mSequence = 0;
+  loop->resume(xy);
+}
+
 static void primitive_foldr(XY* xy) {
-  xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
+  fold_right(xy, "foldr");
+}
+
+// Pops a sequence for the reductions below
+static XYSequence* pop_sequence(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(seq, XYError::TYPE);
+  xy->mX.pop_back();
+  return seq;
+}
+
+// sum [X^seq Y] -> [X^n Y]
+// Adds the elements of the sequence. The sum of an empty sequence
+// is 0.
+static void primitive_sum(XY* xy) {
+  XYSequence* seq = pop_sequence(xy);
+  xy->mX.push_back(reduce_sequence(REDUCE_SUM, seq, 0));
+}
+
+// product [X^seq Y] -> [X^n Y]
+// Multiplies the elements of the sequence. The product of an empty
+// sequence is 1.
+static void primitive_product(XY* xy) {
+  XYSequence* seq = pop_sequence(xy);
+  xy->mX.push_back(reduce_sequence(REDUCE_PRODUCT, seq, 0));
+}
+
+// min [X^seq Y] -> [X^n Y]
+// The smallest element of a non-empty sequence
+static void primitive_min(XY* xy) {
+  XYSequence* seq = pop_sequence(xy);
+  xy_assert(seq->size() > 0, XYError::RANGE);
+  xy->mX.push_back(reduce_sequence(REDUCE_MIN, seq, 0));
+}
+
+// max [X^seq Y] -> [X^n Y]
+// The largest element of a non-empty sequence
+static void primitive_max(XY* xy) {
+  XYSequence* seq = pop_sequence(xy);
+  xy_assert(seq->size() > 0, XYError::RANGE);
+  xy->mX.push_back(reduce_sequence(REDUCE_MAX, seq, 0));
+}
+
+// mean [X^seq Y] -> [X^n Y]
+// The sum of a non-empty sequence divided by its size
+static void primitive_mean(XY* xy) {
+  XYSequence* seq = pop_sequence(xy);
+  size_t n = seq->size();
+  xy_assert(n > 0, XYError::RANGE);
+  XYObject* sum = reduce_sequence(REDUCE_SUM, seq, 0);
+  XYObject* count = XYInteger::make(n);
+  xy->mX.push_back(sum->divide(count));
+}
+
+// dot [X^seq^seq Y] -> [X^n Y]
+// The sum of the products of the elements of two sequences of the
+// same size.
+static void primitive_dot(XY* xy) {
+  XYSequence* rhs = pop_sequence(xy);
+  XYSequence* lhs = pop_sequence(xy);
+  xy_assert(lhs->size() == rhs->size(), XYError::RANGE);
+  xy->mX.push_back(reduce_sequence(REDUCE_DOT, lhs, rhs));
+}
+
+// scan [X^seq Y] -> [X^seq Y]
+// The running sums of the elements of the sequence.
+// [1 2 3] scan
+// [1 3 6]
+static void primitive_scan(XY* xy) {
+  XYSequence* seq = pop_sequence(xy);
+  xy->mX.push_back(scan_sequence(seq));
+}
+
+// fold [X^seq^seed^quot Y] [X^? Y]
+// The same as foldr.
+// [1 2 3] 0 [+] fold => 0 1 2 3 + + +
+static void primitive_fold(XY* xy) {
+  fold_right(xy, "fold");
+}
+
+// unfold [X^seed^pred^quot^next Y] [X^{...} Y]
+// Builds a list of 'quot' applied to each value, starting with
+// 'seed' and calling 'next' to get the following value, until
+// 'pred' is true.
+// 1 [10 >] [] [1 +] unfold => [ 1 2 3 4 5 6 7 8 9 10 ]
+static void primitive_unfold(XY* xy) {
+  xy_assert(xy->mX.size() >= 4, XYError::STACK_UNDERFLOW);
+  XYSequence* next(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(next, XYError::TYPE);
+  xy->mX.pop_back();
+
   XYSequence* quot(dynamic_cast<XYSequence*>(xy->mX.back()));
   xy_assert(quot, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYObject* seed(xy->mX.back());
+  XYSequence* pred(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(pred, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYSequence* seq(dynamic_cast<XYSequence*>(xy->mX.back()));
-  xy_assert(seq, XYError::TYPE);
+  XYLoop* loop = new XYLoop(XYLoop::UNFOLD, "unfold");
+  loop->mFirst = pred;
+  loop->mSecond = quot;
+  loop->mThird = next;
+  loop->mResult = new XYList();
+  loop->resume(xy);
+}
+
+// cons [X^a^b Y] [X^{a b..} Y]
+// Adds 'a' to the start of the sequence 'b'. The same as '[a] b ,'.
+static void primitive_cons(XY* xy) {
+  xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
+  XYObject* b(xy->mX.back());
   xy->mX.pop_back();
-			     
-  if (seq->size() == 0) {
-    xy->mX.push_back(seed);
-  }
-  else {
-    XYObject* head(seq->head());
-    XYSequence* tail(seq->tail());
-    
-    XYStack temp;
-    temp.push_back(seed);
-    temp.push_back(tail);
-    temp.push_back(head);    
-    temp.push_back(quot);
-    temp.push_back(new XYPrimitive("foldr", primitive_foldr));
-    temp.push_back(quot);
-    temp.push_back(new XYPrimitive(".", primitive_unquote));
-    
-    xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
-  }
+
+  XYObject* a(xy->mX.back());
+  xy->mX.pop_back();
+
+  XYList* list(new XYList());
+  list->mList.push_back(a);
+  xy->mX.push_back(list);
+  xy->mX.push_back(b);
+  primitive_join(xy);
+}
+
+// clearstack [X Y] [ Y]
+static void primitive_clearstack(XY* xy) {
+  xy->mX.clear();
+}
+
+// queue [X^o Y] [X Y^o]
+// Moves the top of the stack to the end of the queue
+static void primitive_queue(XY* xy) {
+  xy_assert(xy->mX.size() >= 1, XYError::STACK_UNDERFLOW);
+  XYObject* o(xy->mX.back());
+  xy->mX.pop_back();
+
+  xy->materialize();
+  xy->mY.push_back(o);
+}
+
+// stack [X Y] [X^{X} Y]
+// Pushes a list containing the contents of the stack
+static void primitive_stack_list(XY* xy) {
+  xy->mX.push_back(new XYList(xy->mX.begin(), xy->mX.end()));
 }
 
 // if [X^bool^then^else Y] -> [X Y]
@@ -2060,14 +5692,10 @@ static void primitive_if(XY* xy) {
 
   if (num && num->is_zero() ||
       seq && seq->size() == 0) {
-    XYStack temp;
-    else_quot->pushBackInto(temp);
-    xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
+    xy->call(else_quot);
   }
   else {
-    XYStack temp;
-    then_quot->pushBackInto(temp);
-    xy->mY.insert(xy->mY.begin(), temp.begin(), temp.end());    
+    xy->call(then_quot);
   } 
 }
 
@@ -2081,13 +5709,12 @@ static void primitive_find(XY* xy) {
   xy_assert(seq, XYError::TYPE);
   xy->mX.pop_back();
 
-  int i=0;
-  for (i=0; i < seq->size(); ++i) {
-    if(seq->at(i)->compare(elt) == 0)
-      break;
-  }
+  size_t i = 0;
+  XYSpan span(seq);
+  for (XYObject* o = span.read(); o && o->compare(elt) != 0; o = span.read())
+    ++i;
 
-  xy->mX.push_back(new XYInteger(i));
+  xy->mX.push_back(XYInteger::make(i));
 }
 
 // gc gc [X Y] -> [X Y]
@@ -2123,11 +5750,17 @@ static void primitive_has_slot(XY* xy) {
   if (name)
     name3 = name->mValue;
   if (name2)
-    name3 = name2->mValue;
+    name3 = name2->value();
 
-  set<XYObject*> circular;
-  XYSlot* slot = object->lookup(name3, circular, 0);
-  xy->mX.push_back(new XYInteger(slot ? 1 : 0));
+  XYSlot* slot = object->lookup(name3, 0);
+  xy->mX.push_back(XYInteger::make(slot ? 1 : 0));
+}
+
+// Shared small integers are seen by every interpreter, so slots are
+// added to a copy of them instead.
+static XYObject* slot_owner(XYObject* object) {
+  XYInteger* n = dynamic_cast<XYInteger*>(object);
+  return n && n->mShared ? new XYInteger(*n) : object;
 }
 
 // add-slot add-slot [X^object^value^name Y] -> [X^object Y]
@@ -2143,7 +5776,7 @@ static void primitive_add_slot(XY* xy) {
   xy_assert(value, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYObject* object(xy->mX.back());
+  XYObject* object(slot_owner(xy->mX.back()));
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
 
@@ -2164,7 +5797,7 @@ static void primitive_add_ro_slot(XY* xy) {
   xy_assert(value, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYObject* object(xy->mX.back());
+  XYObject* object(slot_owner(xy->mX.back()));
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
 
@@ -2192,7 +5825,7 @@ static void primitive_add_method(XY* xy) {
   xy_assert(args, XYError::TYPE);
   xy->mX.pop_back();
 
-  XYObject* object(xy->mX.back());
+  XYObject* object(slot_owner(xy->mX.back()));
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
 
@@ -2222,8 +5855,7 @@ static void primitive_get_slot_value(XY* xy) {
   XYObject* value = object->getSlot(name->mValue)->mValue;
   xy_assert(value, XYError::INVALID_SLOT_TYPE);
 #endif
-  set<XYObject*> circular;
-  XYSlot* slot = object->lookup(name->mValue, circular, 0);  
+  XYSlot* slot = object->lookup(name->value(), 0);
   xy_assert(slot, XYError::INVALID_SLOT_TYPE);
   xy_assert(slot->mValue, XYError::INVALID_SLOT_TYPE);
   xy->mX.push_back(slot->mValue);
@@ -2246,19 +5878,62 @@ static void primitive_set_slot_value(XY* xy) {
   xy_assert(value, XYError::TYPE);
   xy->mX.pop_back();
 
-  set<XYObject*> circular;
-  XYSlot* slot = object->lookup(name->mValue, circular, 0);  
+  XYObject* context = 0;
+  XYSlot* slot = object->lookup(name->value(), &context);
   xy_assert(slot, XYError::INVALID_SLOT_TYPE);
   xy_assert(slot->mValue, XYError::INVALID_SLOT_TYPE);
   slot->mValue = value;
+
+  // Changing the value of a parent slot changes what is found
+  // by lookups through it.
+  if (context->isParent(slot))
+    invalidate_lookups();
   
   xy->mX.push_back(object);
 }
 
+// Returns the getter for the 'self' slot added to method frames.
+// It is shared by all frames.
+static XYList* self_getter() {
+  static XYList* getter = 0;
+  if (!getter) {
+    getter = new XYList();
+    getter->mList.push_back(new XYString("self"));
+    getter->mList.push_back(new XYSymbol("get-slot-value"));
+    GarbageCollector::GC.addRoot(getter);
+  }
+  return getter;
+}
+
+// Returns the index of the frame slot an argument can be stored
+// in directly, or -1 if the argument must be set by calling its
+// setter. That is the case unless the argument is a data slot of
+// the frame with the setter installed by add-method.
+static int argument_slot(XYObject* frame, XYSymbol* name) {
+  int index = frame->mShape->find(name->mId);
+  if (index < 0 || !frame->mSlots[index].mValue || frame->isParent(&frame->mSlots[index]))
+    return -1;
+
+  int setter = frame->mShape->find(intern_symbol(name->mValue + ":"));
+  if (setter < 0)
+    return -1;
+
+  XYList* list = dynamic_cast<XYList*>(frame->mSlots[setter].mMethod);
+  if (!list || list->mList.size() != 2)
+    return -1;
+  XYSymbol* primitive = dynamic_cast<XYSymbol*>(list->mList[1]);
+  if (!primitive || primitive->mValue != "set-slot-value")
+    return -1;
+
+  return index;
+}
+
 // call-method call-method [X^object^method Y] -> [X Y]
 // Calls the method by copying it, installing the copy as
 // the current frame, and running the code.
 static void primitive_call_method(XY* xy) {
+  static unsigned int const set_frame_id = intern_symbol("set-frame");
+
   xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
   
   XYObject* method(xy->mX.back());
@@ -2269,35 +5944,47 @@ static void primitive_call_method(XY* xy) {
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
   
-  XYObject* frame = method->copy();
-  frame->addSlot("self*", object);
-
   XYSequence* code = dynamic_cast<XYSequence*>(method->getSlot("code")->mValue);
   xy_assert(code, XYError::TYPE);
   XYSequence* args = dynamic_cast<XYSequence*>(method->getSlot("args")->mValue);
   xy_assert(args, XYError::TYPE);
 
-#if 0
-// DEBUG
-//xy->print();
-cout << "call-method " << xy->mX.size() << " " << xy->mY.size();
-  if (xy->mY.size() >= 2) {
-    XYSymbol* x = dynamic_cast<XYSymbol*>(xy->mY[1]);
-    if (x)
-      cout << " " << x->mValue;
+  // The frame is a copy of the method with a read only 'self' parent
+  // slot, as addSlot("self*", object) would add, without a 'self:'
+  // setter. The slot array is allocated once with room for it. The
+  // slot is added directly rather than with addSlot since nothing can
+  // have looked up through the new frame, so cached lookups stay valid.
+  static unsigned int const self_id = intern_symbol("self");
+  XYObject* frame = new XYObject();
+  frame->mSlots.reserve(method->mSlots.size() + 1);
+  frame->mSlots = method->mSlots;
+  frame->mShape = method->mShape->add(self_id, true);
+  frame->mSlots.push_back(XYSlot(self_getter(), object));
+
+  // Work out whether the arguments can be bound directly
+  int indexes[8];
+  size_t n = args->size();
+  bool direct = n <= sizeof(indexes) / sizeof(indexes[0]);
+  for (size_t i = 0; direct && i < n; ++i) {
+    XYSymbol* name = dynamic_cast<XYSymbol*>(args->at(i));
+    xy_assert(name, XYError::TYPE);
+    indexes[i] = argument_slot(frame, name);
+    direct = indexes[i] >= 0;
   }
-  cout << endl;
+  xy_assert(!direct || xy->mX.size() >= n, XYError::STACK_UNDERFLOW);
 
-#endif
+  xy->materialize();
 
   // Tail call optimisation. If the next items on the Y queue are
   // to restore the stack frame from the current method call, remove
   // them and use that frame value that was to be restored as the
   // original frame. This prevents a buildup of stack frame setters
   // when methods are tail called.
+  XYObject* setFrame = xy->mP.lookup(set_frame_id);
   if (xy->mY.size() >= 2) {
-    XYSymbol* ins = dynamic_cast<XYSymbol*>(xy->mY[1]);
-    if (ins && ins->mValue == "set-frame") {
+    XYObject* ins = xy->mY[1];
+    XYSymbol* symbol = dynamic_cast<XYSymbol*>(ins);
+    if (ins == setFrame || (symbol && symbol->mId == set_frame_id)) {
       // This call-method is occurring immediately before
       // a set-frame. Manually process the set-frame call
       // and remove from the Y queue.
@@ -2310,9 +5997,23 @@ cout << "call-method " << xy->mX.size() << " " << xy->mY.size();
 
   // Restore the original frame
   XYObject* oldFrame = xy->mFrame;
-  xy->mY.push_front(new XYSymbol("set-frame"));
+  xy->mY.push_front(setFrame ? setFrame : new XYSymbol("set-frame"));
   xy->mY.push_front(oldFrame);
 
+  if (direct) {
+    // Populate the frame's argument slots with items on the stack,
+    // set the current frame to be the one for this method call and
+    // run the method body.
+    for (size_t i = 0; i < n; ++i) {
+      frame->mSlots[indexes[n-i-1]].mValue = xy->mX.back();
+      xy->mX.pop_back();
+    }
+
+    xy->mFrame = frame;
+    xy->call(code);
+    return;
+  }
+
   // Run the method body
   xy->mY.push_front(new XYSymbol("."));
 
@@ -2320,24 +6021,14 @@ cout << "call-method " << xy->mX.size() << " " << xy->mY.size();
   // By doing the lookup at runtime we'll always get the latest
   // code if the method body changes.
   xy->mY.push_front(code);
-#if 0
-  xy->mY.push_front(new XYSymbol("."));
-  xy->mY.push_front(new XYSymbol("lookup"));
-  xy->mY.push_front(new XYSymbol("code"));
-  xy->mY.push_front(frame);
-#endif
+
   // Populate the frame's argument slots with items on the stack
+  // by calling their setters.
   xy->mY.push_front(new XYSymbol("set-method-args"));
   xy->mY.push_front(frame);
 
   // Get the list of arguments that this method takes.
   xy->mY.push_front(args);
-#if 0
-  xy->mY.push_front(new XYSymbol("."));
-  xy->mY.push_front(new XYSymbol("lookup"));
-  xy->mY.push_front(new XYSymbol("args"));
-  xy->mY.push_front(frame);
-#endif
 
   // Set the current frame to be the one for this method call
   xy->mY.push_front(new XYSymbol("set-frame"));
@@ -2360,6 +6051,7 @@ static void primitive_set_method_args(XY* xy) {
   xy->mX.pop_back();
 
   xy_assert(xy->mX.size() >= args->size(), XYError::STACK_UNDERFLOW);
+  xy->materialize();
   int n = args->size();
   for (int i=0; i < n; ++i) {
     XYSymbol* name = dynamic_cast<XYSymbol*>(args->at(n-i-1));
@@ -2392,9 +6084,8 @@ static void primitive_lookup(XY* xy) {
   xy_assert(object, XYError::TYPE);
   xy->mX.pop_back();
 
-  set<XYObject*> circular;
   XYObject* context = 0;
-  XYSlot* slot = object->lookup(name->mValue, circular, &context);
+  XYSlot* slot = object->lookup(name->mId, &context);
   xy_assert(slot, XYError::SLOT_NOT_FOUND);
   xy_assert(slot->mMethod, XYError::INVALID_SLOT_TYPE);
   xy_assert(context, XYError::INVALID_SLOT_TYPE);
@@ -2437,10 +6128,10 @@ static void primitive_match(XY* xy) {
   xy_assert(regexp, XYError::TYPE);
   xy->mX.pop_back();
   
-  sregex sre = sregex::compile(regexp->mValue);
+  sregex sre = sregex::compile(regexp->value());
   boost::xpressive::smatch what;
   XYList* result = new XYList();
-  if (regex_match(str->mValue, what, sre)) {
+  if (regex_match(str->value(), what, sre)) {
     for(boost::xpressive::smatch::iterator it = what.begin();
 	it != what.end();
 	++it)
@@ -2449,6 +6140,11 @@ static void primitive_match(XY* xy) {
   xy->mX.push_back(result);
 }
 
+// XYLimit
+unsigned int XYLimit::interval(XY*) {
+  return 1024;
+}
+
 // XYTimeLimit
 XYTimeLimit::XYTimeLimit(unsigned int milliseconds) :
   mMilliseconds(milliseconds) {
@@ -2466,6 +6162,52 @@ bool XYTimeLimit::check(XY* xy) {
   return (now - mStart >= mMilliseconds);
 }
 
+XYLimit* XYTimeLimit::copy() const {
+  return new XYTimeLimit(mMilliseconds);
+}
+
+// XYTickLimit
+XYTickLimit::XYTickLimit(unsigned long ticks) :
+  mTicks(ticks),
+  mStart(0) {
+}
+
+void XYTickLimit::start(XY* xy) {
+  mStart = xy->mSteps;
+}
+
+bool XYTickLimit::check(XY* xy) {
+  return xy->mSteps - mStart >= mTicks;
+}
+
+unsigned int XYTickLimit::interval(XY* xy) {
+  // Check again exactly when the budget runs out
+  unsigned long remaining = mTicks - (xy->mSteps - mStart);
+  return static_cast<unsigned int>(min(remaining, static_cast<unsigned long>(UINT_MAX)));
+}
+
+XYLimit* XYTickLimit::copy() const {
+  return new XYTickLimit(mTicks);
+}
+
+// XYCpuTimeLimit
+XYCpuTimeLimit::XYCpuTimeLimit(unsigned int milliseconds) :
+  mMilliseconds(milliseconds),
+  mStart(0) {
+}
+
+void XYCpuTimeLimit::start(XY* xy) {
+  mStart = xy->cpuTime();
+}
+
+bool XYCpuTimeLimit::check(XY* xy) {
+  return xy->cpuTime() - mStart >= mMilliseconds * 1000UL;
+}
+
+XYLimit* XYCpuTimeLimit::copy() const {
+  return new XYCpuTimeLimit(mMilliseconds);
+}
+
 // XYError
 XYError::XYError(XY* xy, code c) :
   mXY(xy),
@@ -2521,8 +6263,18 @@ XY::XY(boost::asio::io_service& service) :
   mService(service),
   mInputStream(service, ::dup(STDIN_FILENO)),
   mOutputStream(service, ::dup(STDOUT_FILENO)),
+  mCode(0),
+  mPC(0),
   mFrame(0),
-  mRepl(true) {
+  mRepl(true),
+  mSuspended(false),
+  mQuantumSteps(10000),
+  mQuantumMicroseconds(10000),
+  mSteps(0),
+  mStepTime(0),
+  mCpuTime(0),
+  mCpuStart(0),
+  mLimitCheck(0) {
   mP["+"]   = new XYPrimitive("+", primitive_addition);
   mP["-"]   = new XYPrimitive("-", primitive_subtraction);
   mP["*"]   = new XYPrimitive("*", primitive_multiplication);
@@ -2557,6 +6309,8 @@ XY::XY(boost::asio::io_service& service) :
   mP["parse"] = new XYPrimitive("parse", primitive_parse);
   mP["getline"] = new XYPrimitive("getline", primitive_getline);
   mP["millis"] = new XYPrimitive("millis", primitive_millis);
+  mP["set-quantum"] = new XYPrimitive("set-quantum", primitive_set_quantum);
+  mP["step-rate"] = new XYPrimitive("step-rate", primitive_step_rate);
   mP["enum"]   = new XYPrimitive("+", primitive_enum);
   mP["clone"]   = new XYPrimitive("clone", primitive_clone);
   mP["to-string"] = new XYPrimitive("to-string", primitive_to_string);
@@ -2566,6 +6320,13 @@ XY::XY(boost::asio::io_service& service) :
   mP["stake"] = new XYPrimitive("stake", primitive_stake);
   mP["foldl"] = new XYPrimitive("foldl", primitive_foldl);
   mP["foldr"] = new XYPrimitive("foldr", primitive_foldr);
+  mP["sum"] = new XYPrimitive("sum", primitive_sum);
+  mP["product"] = new XYPrimitive("product", primitive_product);
+  mP["min"] = new XYPrimitive("min", primitive_min);
+  mP["max"] = new XYPrimitive("max", primitive_max);
+  mP["mean"] = new XYPrimitive("mean", primitive_mean);
+  mP["dot"] = new XYPrimitive("dot", primitive_dot);
+  mP["scan"] = new XYPrimitive("scan", primitive_scan);
   mP["if"] = new XYPrimitive("if", primitive_if);
   mP["?"] = new XYPrimitive("?", primitive_find);
   mP["gc"] = new XYPrimitive("gc", primitive_gc);
@@ -2593,6 +6354,22 @@ XY::XY(boost::asio::io_service& service) :
 
   mEnv["object"] = mFrame;
   mEnv["primitives"] = primitives;
+
+  // Words that were defined in the prelude. These are called with
+  // '.' like any other word so they are bound in the environment
+  // rather than being primitives.
+  mEnv["while"] = new XYPrimitive("while", primitive_while);
+  mEnv["do"] = new XYPrimitive("do", primitive_do);
+  mEnv["repeat"] = new XYPrimitive("repeat", primitive_repeat);
+  mEnv["each"] = new XYPrimitive("each", primitive_each);
+  mEnv["map"] = new XYPrimitive("map", primitive_map);
+  mEnv["filter"] = new XYPrimitive("filter", primitive_filter);
+  mEnv["fold"] = new XYPrimitive("fold", primitive_fold);
+  mEnv["unfold"] = new XYPrimitive("unfold", primitive_unfold);
+  mEnv["cons"] = new XYPrimitive("cons", primitive_cons);
+  mEnv["clearstack"] = new XYPrimitive("clearstack", primitive_clearstack);
+  mEnv["queue"] = new XYPrimitive("queue", primitive_queue);
+  mEnv["stack"] = new XYPrimitive("stack", primitive_stack_list);
 }
 
 void XY::markChildren() {
@@ -2601,26 +6378,16 @@ void XY::markChildren() {
        ++it) {
     (*it)->mark();
   }
-  for (XYEnv::iterator it = mEnv.begin();
-       it != mEnv.end();
-       ++it) {
-    (*it).second->mark();
-  }
-  for (XYEnv::iterator it = mP.begin();
-       it != mP.end();
-       ++it) {
-    (*it).second->mark();
-  }
+  mEnv.markChildren();
+  mP.markChildren();
   for (XYStack::iterator it = mX.begin();
        it != mX.end();
        ++it) {
     (*it)->mark();
   }
-  for (XYQueue::iterator it = mY.begin();
-       it != mY.end();
-       ++it) {
-    (*it)->mark();
-  }
+  mY.markChildren();
+  if (mCode)
+    mCode->mark();
   for (XYLimits::iterator it = mLimits.begin();
        it != mLimits.end();
        ++it) {
@@ -2638,9 +6405,7 @@ void XY::stdioHandler(boost::system::error_code const& err) {
     parse(input, back_inserter(mY));
 
     // Start the limit counting here for stdio/repl based code
-    for(XYLimits::iterator it = mLimits.begin(); it != mLimits.end(); ++it) {
-      (*it)->start(this);
-    }
+    startLimits();
 
     mService.post(bind(&XY::evalHandler, this));
   }
@@ -2655,11 +6420,51 @@ void XY::stdioHandler(boost::system::error_code const& err) {
   }
 }
 
+// Returns the CPU time used by the current operating system
+// thread in microseconds.
+static unsigned long thread_cpu_time() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+// Add the wall clock and CPU time used since 'start' to the
+// interpreter's totals.
+static void end_timeslice(XY* xy, boost::posix_time::ptime const& start) {
+  using namespace boost::posix_time;
+  xy->mStepTime += (microsec_clock::universal_time() - start).total_microseconds();
+  xy->mCpuTime += thread_cpu_time() - xy->mCpuStart;
+  xy->mCpuStart = 0;
+}
+
 void XY::evalHandler() {
+  using namespace boost::posix_time;
+  ptime start(microsec_clock::universal_time());
+  mCpuStart = thread_cpu_time();
+
   try {
-    eval1();
-    if (mY.size() != 0)
-      checkLimits();
+    // Run for a quantum before posting back to the io service. The
+    // clock is only read between small batches of steps.
+    unsigned int steps = 0;
+    do {
+      unsigned int n = min(64U, stepsToLimitCheck());
+      if (mQuantumSteps != 0 && mQuantumSteps - steps < n)
+        n = mQuantumSteps - steps;
+      steps += run(n);
+      if (mY.size() != 0)
+        checkLimits();
+    } while (mY.size() != 0 &&
+             (mQuantumSteps == 0 || steps < mQuantumSteps) &&
+             !mSuspended &&
+             (mQuantumMicroseconds == 0 ||
+              (microsec_clock::universal_time() - start).total_microseconds() < mQuantumMicroseconds));
+    end_timeslice(this, start);
+
+    // A suspended interpreter is resumed by the handler for the
+    // event it is waiting on.
+    if (mSuspended)
+      return;
+
     if (mY.size() == 0 && mRepl) {
       print();
       boost::asio::streambuf buffer;
@@ -2685,6 +6490,7 @@ void XY::evalHandler() {
     }
   }
   catch(XYError& e) {
+    end_timeslice(this, start);
     if (e.mCode != XYError::WAITING_FOR_ASYNC_EVENT) {
       // When an error occurs, create a list to hold:
       // 1: The 'error' symbol
@@ -2701,6 +6507,7 @@ void XY::evalHandler() {
       XYList* stack(new XYList(mX.begin(), mX.end()));
       XYList* queue(new XYList(mY.begin(), mY.end()));
       XYList* error(new XYList());
+      queue_captured();
 
       mX.clear();
       mY.clear();
@@ -2719,9 +6526,7 @@ void XY::evalHandler() {
       }
 
       if (mRepl) {
-	for(XYLimits::iterator it = mLimits.begin(); it != mLimits.end(); ++it) {
-	  (*it)->start(this);
-	}
+	startLimits();
 
 	mService.post(bind(&XY::evalHandler, this));
       }
@@ -2731,16 +6536,50 @@ void XY::evalHandler() {
 
 void XY::yield() {
   mService.post(bind(&XY::evalHandler, this));
-  throw XYError(this, XYError::WAITING_FOR_ASYNC_EVENT);
+  suspend();
+}
+
+void XY::suspend() {
+  mSuspended = true;
+}
+
+void XY::startLimits() {
+  for(XYLimits::iterator it = mLimits.begin(); it != mLimits.end(); ++it) {
+    (*it)->start(this);
+  }
+  mLimitCheck = mSteps;
 }
 
 void XY::checkLimits() {
+  if (mLimits.size() == 0 || mSteps < mLimitCheck)
+    return;
+
+  unsigned int interval = UINT_MAX;
   for(XYLimits::iterator it = mLimits.begin(); it != mLimits.end(); ++it) {
     if ((*it)->check(this)) {
       // This limit was reached, stop executing and throw the error
       throw XYError(this, XYError::LIMIT_REACHED);
     }
+    interval = min(interval, (*it)->interval(this));
   }
+  mLimitCheck = mSteps + interval;
+}
+
+unsigned int XY::stepsToLimitCheck() const {
+  if (mLimits.size() == 0)
+    return UINT_MAX;
+
+  if (mSteps >= mLimitCheck)
+    return 1;
+
+  return static_cast<unsigned int>(min(mLimitCheck - mSteps, static_cast<unsigned long>(UINT_MAX)));
+}
+
+unsigned long XY::cpuTime() const {
+  if (mCpuStart == 0)
+    return mCpuTime;
+
+  return mCpuTime + (thread_cpu_time() - mCpuStart);
 }
 
 void XY::print() {
@@ -2756,112 +6595,165 @@ void XY::print() {
   boost::asio::write(mOutputStream, buffer);
 }
 
-void XY::eval1() {
-  if (mY.size() == 0)
-    return;
-
-  XYObject* o = mY.front();
-  assert(o);
+// The run loop dispatches directly from instruction to instruction
+// using computed gotos where the compiler supports them, otherwise
+// through a switch.
+#if defined(__GNUC__)
+#define XY_DISPATCH() goto *dispatch[mCode->mInstructions[mPC].mOp]
+#else
+#define XY_DISPATCH() goto dispatch_switch
+#endif
 
-  mY.pop_front();
+// Move to the next instruction. If the step count is exhausted or
+// the current code has finished, return to the top of the run loop.
+#define XY_NEXT() \
+  if (--steps == 0 || mSuspended || !mCode || mPC == mCode->mInstructions.size()) \
+    continue; \
+  XY_DISPATCH()
+
+unsigned int XY::run(unsigned int steps) {
+  unsigned int const requested = steps;
+#if defined(__GNUC__)
+  static void* const dispatch[] = {
+    &&op_push,
+    &&op_eval,
+    &&op_primitive,
+    &&op_symbol,
+    &&op_quote
+  };
+#endif
 
-  GarbageCollector::GC.addRoot(o);
-  o->eval1(this);
-  GarbageCollector::GC.removeRoot(o);
-}
+  mSuspended = false;
+  try {
+    while (steps > 0 && !mSuspended) {
+      if (!mCode || mPC == mCode->mInstructions.size()) {
+        // No code is running. Take the next item from the queue.
+        mCode = 0;
+        if (mY.size() == 0)
+          break;
+
+        if (mY.pop_code(mCode, mPC))
+          continue;
+
+        XYObject* o = mY.front();
+        assert(o);
+        mY.pop_front();
+
+        GarbageCollector::GC.addRoot(o);
+        o->eval1(this);
+        GarbageCollector::GC.removeRoot(o);
+        --steps;
+        continue;
+      }
 
-void XY::eval() {
-  for(XYLimits::iterator it = mLimits.begin(); it != mLimits.end(); ++it) {
-    (*it)->start(this);
-  }
+      XY_DISPATCH();
 
-  while (mY.size() > 0) {
-    eval1();
-    checkLimits();
-  }
-}
+#if !defined(__GNUC__)
+    dispatch_switch:
+      switch (mCode->mInstructions[mPC].mOp) {
+      case XYCode::OP_PUSH:      goto op_push;
+      case XYCode::OP_EVAL:      goto op_eval;
+      case XYCode::OP_PRIMITIVE: goto op_primitive;
+      case XYCode::OP_SYMBOL:    goto op_symbol;
+      case XYCode::OP_QUOTE:     goto op_quote;
+      }
+#endif
 
-template <class OutputIterator>
-void XY::match(OutputIterator out, 
-               XYObject* object,
-               XYObject* pattern,
-               XYSequence* sequence,
-               int i) {
-  XYSequence* object_list = dynamic_cast<XYSequence*>(object);
-  XYSequence* pattern_list = dynamic_cast<XYSequence*>(pattern);
-  XYSymbol* pattern_symbol = dynamic_cast<XYSymbol*>(pattern);
-  if (object_list && pattern_list) {
-    int pi = 0;
-    int oi = 0;
-    for(pi=0, oi=0; pi < pattern_list->size() && oi < object_list->size(); ++pi, ++oi) {
-      match(out, object_list->at(oi), pattern_list->at(pi), object_list, oi);
-    }
-    // If there are more pattern items than there are list items,
-    // set the pattern value to null.
-    while(pi < pattern_list->size()) {
-      XYSymbol* s = dynamic_cast<XYSymbol*>(pattern_list->at(pi));
-      if (s) {
-        *out++ = make_pair(s->mValue, new XYList());
+    op_push:
+      mX.push_back(mCode->mInstructions[mPC++].mObject);
+      XY_NEXT();
+
+    op_eval:
+      mCode->mInstructions[mPC++].mObject->eval1(this);
+      XY_NEXT();
+
+    op_primitive:
+      {
+        XYCode::Instruction& ins = mCode->mInstructions[mPC++];
+        XYPrimitive* primitive = ins.mPrimitive;
+        if (mP.lookup(static_cast<XYSymbol*>(ins.mObject)->mId) == primitive)
+          primitive->mFunc(this);
+        else
+          ins.mObject->eval1(this);
+      }
+      XY_NEXT();
+
+    op_symbol:
+      static_cast<XYSymbol*>(mCode->mInstructions[mPC++].mObject)->XYSymbol::eval1(this);
+      XY_NEXT();
+
+    op_quote:
+      {
+        XYCode::Instruction& ins = mCode->mInstructions[mPC];
+        if (mP.lookup(static_cast<XYSymbol*>(ins.mObject)->mId) == ins.mPrimitive) {
+          XYList* list = new XYList();
+          list->mList.push_back(mCode->mInstructions[mPC + 1].mObject);
+          mX.push_back(list);
+          mPC += 2;
+        }
+        else {
+          ++mPC;
+          ins.mObject->eval1(this);
+        }
       }
-      ++pi;
+      XY_NEXT();
     }
   }
-  else if(pattern_list && !object_list) {
-    // If the pattern is a list, but the object is not, 
-    // pretend the object is a one element list. This enables:
-    // 42 [ [[a A]] a A ] -> 42 []
-    XYList* list(new XYList());
-    list->mList.push_back(object);
-    match(out, list, pattern, sequence, i);
-  }
-  else if(pattern_symbol) {
-    string uppercase = pattern_symbol->mValue;
-    to_upper(uppercase);
-    if (uppercase == pattern_symbol->mValue) {
-      *out++ = make_pair(pattern_symbol->mValue, new XYSlice(sequence, i, sequence->size()));
-    }
-    else
-      *out++ = make_pair(pattern_symbol->mValue, object);
+  catch(...) {
+    mSteps += requested - steps;
+    materialize();
+    throw;
   }
+
+  mSteps += requested - steps;
+  materialize();
+  return requested - steps;
 }
 
-template <class OutputIterator>
-void XY::getPatternValues(XYObject* pattern, OutputIterator out) {
-  XYSequence* list = dynamic_cast<XYSequence*>(pattern);
-  if (list) {
-    assert(mX.size() >= list->size());
-    XYList* stack(new XYList(mX.end() - list->size(), mX.end()));
-    match(out, stack, pattern, stack, 0);
-    mX.resize(mX.size() - list->size());
-  }
-  else {
-    XYObject* o = mX.back();
-    mX.pop_back();
-    XYList* list(new XYList());
-    match(out, o, pattern, list, list->size());
-  }
+#undef XY_NEXT
+#undef XY_DISPATCH
+
+void XY::materialize() {
+  if (!mCode)
+    return;
+
+  mY.push_front(mCode, mPC);
+  mCode = 0;
+  mPC = 0;
 }
- 
-template <class OutputIterator>
-void XY::replacePattern(XYEnv const& env, XYObject* object, OutputIterator out) {
-  XYSequence* list   = dynamic_cast<XYSequence*>(object);
-  XYSymbol*   symbol = dynamic_cast<XYSymbol*>(object); 
-  if (list) {
-    // Recurse through the list replacing variables as needed
-    XYList* new_list(new XYList());
-    for(int i=0; i < list->size(); ++i)
-      replacePattern(env, list->at(i), back_inserter(new_list->mList));
-    *out++ = new_list;
-  }
-  else if (symbol) {
-    XYEnv::const_iterator it = env.find(symbol->mValue);
-    if (it != env.end())
-      *out++ = (*it).second;
-    else
-      *out++ = object;
+
+void XY::call(XYSequence* sequence) {
+  call(sequence->compile(this));
+}
+
+void XY::call(XYCode* code) {
+  materialize();
+
+  mCode = code;
+  mPC = 0;
+}
+
+void XY::eval1() {
+  run(1);
+}
+
+void XY::eval() {
+  using namespace boost::posix_time;
+  ptime start(microsec_clock::universal_time());
+
+  mCpuStart = thread_cpu_time();
+  startLimits();
+
+  while (mY.size() > 0) {
+    run(stepsToLimitCheck());
+
+    // There is no event loop to resume a suspended interpreter here
+    if (mSuspended)
+      throw XYError(this, XYError::WAITING_FOR_ASYNC_EVENT);
+    checkLimits();
   }
-  else
-    *out++ = object;
+
+  end_timeslice(this, start);
 }
 
 enum XYState {
@@ -2917,7 +6809,7 @@ boost::xpressive::sregex re_integer() {
 boost::xpressive::sregex re_float() {
   using namespace boost::xpressive;
   using boost::xpressive::optional;
-  return optional('-') >> +_d >> '.' >> *_d;
+  return optional('-') >> +_d >> '.' >> *_d >> optional('m');
 }
 
 // Return regex for tokenizing numbers
@@ -2950,7 +6842,7 @@ boost::xpressive::sregex re_symbol_end() {
 // Return regex for symbols
 boost::xpressive::sregex re_symbol() {
   using namespace boost::xpressive;
-  return !range('0', '9') >> +(re_non_special()) >> *(re_symbol_end());
+  return !boost::xpressive::range('0', '9') >> +(re_non_special()) >> *(re_symbol_end());
 }
 
 // Return regex for a character in a string
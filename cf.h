@@ -3,6 +3,8 @@
 #if !defined(cf_h)
 #define cf_h
 
+#include <cassert>
+#include <iterator>
 #include <string>
 #include <map>
 #include <set>
@@ -11,6 +13,7 @@
 #include <sstream>
 #include <boost/xpressive/xpressive.hpp>
 #include <boost/asio.hpp>
+#include <boost/unordered_map.hpp>
 #include <gmpxx.h>
 #include "gc/gc.h"
 
@@ -26,6 +29,17 @@ class XYPrimitive;
 class XYFloat;
 class XYInteger;
 class XYSequence;
+class XYCode;
+class XYPattern;
+
+// Symbol names are interned in a process wide table. Each distinct
+// name is given a small integer id that is shared by all interpreters.
+// This lets the environment and primitive tables be indexed directly
+// by symbol rather than by string comparisons.
+unsigned int intern_symbol(std::string const& name);
+
+// Returns the name of the symbol with the given interned id
+std::string const& symbol_name(unsigned int id);
 
 // Macros to declare double dispatched math operators
 #define DD(name) \
@@ -44,20 +58,60 @@ class XYSequence;
 // is used in the prototype lookup chain. A parent slot must be a data
 // slot.
 //
-// The value held in the XYObject Slots map. This holds data
-// for the given slot.
-class XYSlot : public GCObject
+// The names of an object's slots, and which are parents, are described
+// by a shape that is shared by all objects that had the same slots
+// added in the same order. Shapes are immutable. Adding or removing a
+// slot moves the object to a different shape. The slot values are
+// held in an array in the object, in the order given by the shape.
+class XYShape
+{
+ public:
+  // Interned slot name id to index in the slot array
+  typedef boost::unordered_map<unsigned int, size_t> Indexes;
+  Indexes mIndexes;
+
+  // Slot name ids and parent flags in slot array order
+  std::vector<unsigned int> mIds;
+  std::vector<bool> mIsParent;
+
+  // Indexes of the parent slots, ordered by slot name. This is the
+  // order parents are searched during lookup.
+  std::vector<size_t> mParents;
+
+  // Shapes already created by adding a slot to this shape
+  typedef std::map<std::pair<unsigned int, bool>, XYShape*> Transitions;
+  Transitions mTransitions;
+
+ public:
+  // The shape of an object with no slots. Shapes are never freed.
+  static XYShape* empty();
+
+  // Returns the index of the slot with the given id, or -1
+  int find(unsigned int id) const {
+    Indexes::const_iterator it = mIndexes.find(id);
+    return it == mIndexes.end() ? -1 : static_cast<int>((*it).second);
+  }
+
+  // Returns the shape with the slot added at the end
+  XYShape* add(unsigned int id, bool parent);
+
+  // Returns the shape with the slot at 'index' removed. Slots
+  // after it move down one index.
+  XYShape* remove(size_t index);
+};
+
+// The value held for each slot of an XYObject.
+class XYSlot
 {
  public:
   XYObject* mMethod;
   XYObject* mValue;
-  bool mParent;
 
  public:
-  XYSlot(XYObject* method, XYObject* value, bool parent);
+  XYSlot(XYObject* method, XYObject* value);
 
-  // GCObject method
-  virtual void markChildren();
+  // Mark the method and value for the garbage collector
+  void markChildren();
 };
 
 // Base class for all objects in the XY system. Anything
@@ -67,10 +121,22 @@ class XYSlot : public GCObject
 class XYObject : public GCObject
 {
  public:    
-  // Mapping of slot name to getter/setter.
-  typedef std::map<std::string, XYSlot*> Slots;
+  // The shape describing the slots and the slot values
+  // in shape order.
+  typedef std::vector<XYSlot> Slots;
+  XYShape* mShape;
   Slots mSlots;
 
+  // The lookup that last visited this object. Used to
+  // prevent infinite loops while searching parent objects.
+  unsigned long mLookupEpoch;
+
+ private:
+  // Search this object and its parents for the slot without
+  // using the method cache. Objects already visited in this
+  // lookup 'epoch' are skipped.
+  XYSlot* find(unsigned int id, unsigned long epoch, XYObject** context);
+
  public:
   XYObject();
 
@@ -82,19 +148,23 @@ class XYObject : public GCObject
 
   // Find the slot with the given name,
   // searching down the prototype chain as needed.
-  // 'circular' is used to prevent infinite loops
-  // while lookup up parent objects. The 'context'
-  // will hold a pointer to the object that where the
-  // slot was found. 'context' can be passed null in
-  // which case it is ignored.
-  XYSlot* lookup(std::string const& name, 
-		 std::set<XYObject*>& circular,
-		 XYObject** context);
+  // The 'context' will hold a pointer to the object
+  // that where the slot was found. 'context' can be
+  // passed null in which case it is ignored.
+  // Slot pointers are valid until a slot is added to or
+  // removed from the object holding the slot. Results
+  // are cached by the shape of the object and the name.
+  XYSlot* lookup(std::string const& name, XYObject** context);
+  XYSlot* lookup(unsigned int id, XYObject** context);
 
   // Get the slot object if there is one, without
   // following the prototype lookup chain.
   XYSlot* getSlot(std::string const& name);
 
+  // True if the slot, which must belong to this object,
+  // is a parent slot.
+  bool isParent(XYSlot const* slot) const;
+
   // Adds a slot
   void addSlot(std::string const& name, 
 	       XYObject* method,
@@ -173,17 +243,34 @@ class XYNumber : public XYObject
     virtual XYNumber* floor() = 0;
 };
 
-// Floating point numbers
+// Floating point numbers. These are held as a native double
+// unless arbitrary precision was asked for with an 'm' suffix on
+// the literal (eg. 1.5m), in which case mBig is used. Arithmetic
+// involving an arbitrary precision float has an arbitrary
+// precision result.
 class XYFloat : public XYNumber
 {
+  private:
+    XYFloat& operator=(XYFloat const&);
+
   public:
-    mpf_class mValue;
+    double mDouble;
+    mpf_class* mBig;
 
   public:
     XYFloat(long v = 0);
     XYFloat(double v = 0.0);
     XYFloat(std::string v);
     XYFloat(mpf_class const& v);
+    XYFloat(XYFloat const& rhs);
+    virtual ~XYFloat();
+
+    // Returns the value as an arbitrary precision float
+    mpf_class value() const;
+
+    // Returns the value as a native double
+    double as_double() const;
+
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual int compare(XYObject* rhs);
     DD(add);
@@ -198,16 +285,34 @@ class XYFloat : public XYNumber
     virtual XYNumber* floor();
 };
 
-// Integer numbers
+// Integer numbers. Values that fit in a machine word are held
+// natively in mSmall. Larger values, and results of arithmetic that
+// would overflow, are held in the arbitrary precision mBig. A value
+// that fits in mSmall is never held in mBig.
 class XYInteger : public XYNumber
 {
   public:
-    mpz_class mValue;
+    long mSmall;
+    mpz_class* mBig;
+
+    // True for the objects shared by 'make', which must not be
+    // given slots.
+    bool mShared;
 
   public:
     XYInteger(long v = 0);
     XYInteger(std::string v);
     XYInteger(mpz_class const& v);
+    XYInteger(XYInteger const& rhs);
+    virtual ~XYInteger();
+
+    // Returns an integer with the given value. Objects for small
+    // values are shared rather than allocated each time.
+    static XYInteger* make(long v);
+
+    // Returns the value as an arbitrary precision integer
+    mpz_class value() const;
+
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual int compare(XYObject* rhs);
     DD(add);
@@ -220,6 +325,51 @@ class XYInteger : public XYNumber
     virtual XYInteger* as_integer();
     virtual XYFloat* as_float();
     virtual XYNumber* floor();
+
+  private:
+    XYInteger& operator=(XYInteger const&);
+};
+
+// Slot lookups are cached. The lookup version is incremented whenever
+// a change is made to objects that could alter the result of a slot
+// lookup, invalidating all cached results.
+unsigned int lookup_version();
+void invalidate_lookups();
+
+// The sequence version is incremented whenever an element of a
+// sequence is set in place, so that things compiled from sequences
+// only need to check them again after a change.
+unsigned int sequence_version();
+void sequence_changed();
+
+// The capture version is incremented whenever objects on a queue are
+// copied or moved somewhere they can be run from again, as '$' does.
+// Objects that change as they run, like loops, are copied before
+// running again once the version has changed.
+unsigned int capture_version();
+void queue_captured();
+
+// Caches the result of looking up a slot name on an object. The
+// cached object and context are marked by the owner of the cache
+// so they cannot be collected and their addresses reused while
+// cached. The slot is held by the context.
+class XYLookupCache
+{
+  public:
+    unsigned int mVersion;
+    XYObject* mObject;
+    XYSlot* mSlot;
+    XYObject* mContext;
+
+  public:
+    XYLookupCache();
+
+    // Same as XYObject::lookup but returns the cached result if
+    // 'object' was the last object looked up and no slots have
+    // changed since.
+    XYSlot* lookup(XYObject* object, unsigned int id, XYObject** context);
+
+    void markChildren();
 };
 
 // A symbol is an unquoted string.
@@ -228,8 +378,18 @@ class XYSymbol : public XYObject
   public:
     std::string mValue;
 
+    // The interned id of mValue
+    unsigned int mId;
+
+    // Inline caches for this symbol occurrence. One for lookups
+    // in the 'primitives' object, the other for lookups in frames
+    // and objects when unquoted or sent with ';'.
+    XYLookupCache mPrimitivesCache;
+    XYLookupCache mSlotCache;
+
   public:
     XYSymbol(std::string v);
+    virtual void markChildren();
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual void eval1(XY* xy);
     virtual int compare(XYObject* rhs);
@@ -238,10 +398,24 @@ class XYSymbol : public XYObject
 // A shuffle symbol describes pattern to rearrange the stack.
 class XYShuffle : public XYObject
 {
+  public:
+    // Shuffles that have a specialised implementation
+    enum Kind {
+      GENERAL,  // Any other pattern
+      DROP,     // The rhs is a prefix of the lhs, eg. a- or ab-a
+      DUP,      // a-aa
+      SWAP      // ab-ba
+    };
+
   public:
     std::string mBefore;
     std::string mAfter;
 
+    // For each element of mAfter, the index into mBefore of the
+    // stack element it is copied from. Computed when constructed.
+    std::vector<size_t> mIndices;
+    Kind mKind;
+
   public:
     XYShuffle(std::string v);
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
@@ -285,16 +459,117 @@ class XYSequence : public XYObject
 
     // Concatenate two sequences
     virtual XYSequence* join(XYSequence* rhs) = 0;
+
+    // Size of the buffer passed to 'span'
+    static size_t const SPAN_BUFFER_SIZE = 64;
+
+    // Returns the number of consecutive elements starting at index
+    // 'n' that can be read from 'begin'. This is at least one for
+    // a valid index. A sequence that does not hold its elements in
+    // an array can copy up to SPAN_BUFFER_SIZE of them into 'buffer'
+    // and set 'begin' to point to it. The elements are valid until
+    // the sequence is changed. Use XYSpan rather than calling this
+    // directly.
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer) = 0;
+
+    // Returns the compiled code for running the sequence as a
+    // program. Sequences that can keep the code override this to
+    // avoid compiling it on each call.
+    virtual XYCode* compile(XY* xy);
+
+    // Returns the elements from 'begin' up to 'end'. This is an
+    // XYSlice unless the sequence has a cheaper form.
+    virtual XYSequence* slice(size_t begin, size_t end);
 };
 
-// A string
-class XYString : public XYSequence
+// Iterates over the elements of a sequence a span of consecutive
+// elements at a time. This avoids a virtual call for each element
+// of sequences like slices and joins.
+//
+//   XYSpan span(sequence);
+//   while (span.next())
+//     for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it)
+//       ...
+//
+// 'read' can be used instead to get one element at a time.
+class XYSpan
+{
+  public:
+    // The current span
+    XYObject* const* mBegin;
+    XYObject* const* mEnd;
+
+  private:
+    XYSequence* mSequence;
+
+    // Index of the element after the current span, and of the
+    // end of the range being iterated.
+    size_t mNext;
+    size_t mLast;
+
+    XYObject* mBuffer[XYSequence::SPAN_BUFFER_SIZE];
+
+  public:
+    // Iterate over all the sequence, or elements [begin, end)
+    XYSpan(XYSequence* sequence);
+    XYSpan(XYSequence* sequence, size_t begin, size_t end);
+
+    // Move to the next span. Returns false if there are no more
+    // elements.
+    bool next();
+
+    // Returns the next element, moving to the next span if needed.
+    // Returns null if there are no more elements.
+    XYObject* read() {
+      if (mBegin == mEnd && !next())
+        return 0;
+      return *mBegin++;
+    }
+};
+
+// The characters of one or more strings. Characters are only ever
+// appended, except by a string that owns the buffer, so the strings
+// viewing part of it are not affected as it grows.
+class XYStringBuffer : public GCObject
 {
   public:
     std::string mValue;
 
+  public:
+    XYStringBuffer(std::string const& v);
+};
+
+// A string. The characters are a view of 'mLength' characters
+// starting at 'mOffset' in a buffer that can be shared with other
+// strings, so tail and substrings don't copy. Joining a string that
+// ends at the end of its buffer appends to the buffer, so building a
+// string by repeated joins takes linear time. The characters are
+// copied to a buffer of their own when one is set or when a
+// contiguous std::string is needed.
+class XYString : public XYSequence
+{
+  public:
+    XYStringBuffer* mBuffer;
+    size_t mOffset;
+    size_t mLength;
+
+    // True if no other string views the buffer, so characters can
+    // be set in place.
+    bool mOwned;
+
   public:
     XYString(std::string v);
+    XYString(XYStringBuffer* buffer, size_t offset, size_t length);
+
+    // Returns the characters, moving them to a buffer of their own
+    // if the string is a view of part of a buffer.
+    std::string const& value();
+
+    // Returns a string viewing up to 'length' characters from
+    // 'offset', which must not be past the end.
+    XYString* substr(size_t offset, size_t length = std::string::npos);
+
+    virtual void markChildren();
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual int compare(XYObject* rhs);
     virtual size_t size();
@@ -304,6 +579,7 @@ class XYString : public XYSequence
     virtual XYObject* head();
     virtual XYSequence* tail();
     virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
 };
 
 // A list of objects. Can include other nested
@@ -314,6 +590,16 @@ class XYList : public XYSequence
   public:
     List mList;
 
+    // The compiled form of the list, created the first time the
+    // list is run as a program. Null if it has not been compiled
+    // or the list has since been modified.
+    XYCode* mCode;
+
+    // The compiled form of the list when used as a pattern by
+    // '(' or ')'. Null if it has not been used as a pattern or
+    // the list has since been modified.
+    XYPattern* mPattern;
+
   public:
     XYList();
     template <class InputIterator> XYList(InputIterator first, InputIterator last);
@@ -327,6 +613,15 @@ class XYList : public XYSequence
     virtual XYObject* head();
     virtual XYSequence* tail();
     virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
+
+    // Return the compiled code for this list, compiling it if
+    // needed.
+    virtual XYCode* compile(XY* xy);
+
+    // Return the compiled pattern for this list, compiling it
+    // if needed.
+    XYPattern* compilePattern(XY* xy);
 };
 
 // A slice is a virtual subsequence of an existing list.
@@ -356,25 +651,347 @@ class XYSlice : public XYSequence
     virtual XYObject* head();
     virtual XYSequence* tail();
     virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
 };
 
 // A join is a virtual sequence composed of two other
 // sequences. It's primary use is to allow lazy
-// appending of two sequences.
+// appending of two sequences. Joins are not modified once
+// created. Joining a join copies its list of sequences rather
+// than nesting it, and a join of too many sequences is
+// flattened into a list.
 class XYJoin : public XYSequence
 {
   public:
     // The original sequences we join.
-    typedef std::deque<XYSequence*> Vector;
+    typedef std::vector<XYSequence*> Vector;
     typedef Vector::iterator iterator;
     typedef Vector::const_iterator const_iterator;
 
     Vector mSequences;
 
+    // The index one past the last element of each of the
+    // sequences. Used to find an element by binary search. The
+    // joined sequences must not change size.
+    std::vector<size_t> mEnds;
+
+    // Joins of more sequences than this are flattened
+    static size_t const MAX_SEQUENCES = 32;
+
   public:
-    XYJoin() { }
     XYJoin(XYSequence* first, XYSequence* second); 
 
+    // Returns the lazy join of the two sequences, or a list
+    // of their elements if the join would have too many sequences.
+    static XYSequence* make(XYSequence* first, XYSequence* second);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
+
+  private:
+    // Add the sequence, or the sequences of a join, to the end
+    void append(XYSequence* sequence);
+
+    // Index into mSequences of the sequence holding element 'n'
+    size_t find(size_t n) const;
+};
+
+// A persistent vector. The elements are held in the leaves of a tree
+// of 32 way nodes. Nodes are never modified once shared so vectors
+// can share them. Adding to either end, setting an element and taking
+// the tail copy only the nodes on the path to the changed element,
+// O(log32 n). Element 'i' of the vector is at index 'mOrigin + i' in
+// the tree. There is room to prepend while 'mOrigin' is non-zero.
+class XYVector : public XYSequence
+{
+  public:
+    // Reference counted tree node, defined in cf.cpp
+    struct Node;
+
+    // Number of children or elements in each node
+    static size_t const BRANCHES = 32;
+    static unsigned int const BITS = 5;
+
+    Node* mRoot;
+
+    // Number of bits to shift an index by to get the child of
+    // the root. Zero if the root is a leaf.
+    unsigned int mShift;
+
+    size_t mOrigin;
+    size_t mSize;
+
+    // The compiled form of the vector, created the first time it
+    // is run as a program.
+    XYCode* mCode;
+
+  public:
+    XYVector();
+    XYVector(XYVector const& rhs);
+    virtual ~XYVector();
+
+    // Returns a vector with the elements of the sequence. If it is
+    // already a vector it is returned rather than copied.
+    static XYVector* make(XYSequence* sequence);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
+
+    // Return new vectors with the object added to the end or the
+    // start. This vector is unchanged.
+    XYVector* push_back(XYObject* o) const;
+    XYVector* push_front(XYObject* o) const;
+
+    // Return the compiled code for this vector, compiling it if
+    // needed.
+    virtual XYCode* compile(XY* xy);
+
+  private:
+    // Number of elements the tree can hold with the current shift
+    size_t capacity() const;
+
+    // Add a level to the tree with the existing root as the given
+    // child of the new root.
+    void grow(size_t child);
+
+    // Store the object at tree index 'n', copying shared nodes
+    void store(size_t n, XYObject* o);
+
+    // Add the object to the end or start of this vector
+    void append(XYObject* o);
+    void prepend(XYObject* o);
+
+    XYVector& operator=(XYVector const&);
+};
+
+// Base class for sequences of numbers held unboxed in an array.
+// Elements are boxed when read with 'at' or a span. Arithmetic on
+// packed vectors works on the arrays directly. Storing an element
+// that the array cannot hold moves all the elements into the list
+// 'mBoxed', after which the vector behaves as that list.
+class XYPackedVector : public XYSequence
+{
+  public:
+    // Elements once boxed, or null while packed
+    XYList* mBoxed;
+
+    // The compiled form of the vector, created the first time it
+    // is run as a program.
+    XYCode* mCode;
+
+    // List literals with at least this many elements, all of them
+    // native integers or all native floats, are parsed as packed
+    // vectors.
+    static size_t const LITERAL_SIZE = 16;
+
+  public:
+    XYPackedVector();
+
+    // Returns a packed vector holding the elements of the list if
+    // it is a numeric literal that should be packed, otherwise the
+    // list.
+    static XYSequence* pack(XYList* list);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
+    virtual XYCode* compile(XY* xy);
+
+  protected:
+    // Number of elements in the array
+    virtual size_t count() const = 0;
+
+    // Returns element 'n' of the array as an object
+    virtual XYObject* box(size_t n) const = 0;
+
+    // Store the object as element 'n' of the array. Returns false
+    // if the array cannot hold it.
+    virtual bool store(size_t n, XYObject* v) = 0;
+
+    // Free the array once the elements are boxed
+    virtual void clear() = 0;
+};
+
+// A packed vector of native integers
+class XYIntVector : public XYPackedVector
+{
+  public:
+    std::vector<long> mValues;
+
+  public:
+    XYIntVector(size_t size = 0);
+
+  protected:
+    virtual size_t count() const;
+    virtual XYObject* box(size_t n) const;
+    virtual bool store(size_t n, XYObject* v);
+    virtual void clear();
+};
+
+// A packed vector of native floats
+class XYFloatVector : public XYPackedVector
+{
+  public:
+    std::vector<double> mValues;
+
+  public:
+    XYFloatVector(size_t size = 0);
+
+  protected:
+    virtual size_t count() const;
+    virtual XYObject* box(size_t n) const;
+    virtual bool store(size_t n, XYObject* v);
+    virtual void clear();
+};
+
+// An arithmetic progression of integers, 'mSize' elements starting
+// at 'mStart' and increasing by 'mStep'. Elements are computed when
+// read, so size, indexing, tail and slicing take constant time. The
+// elements are only stored, in 'mElements', when one is set, after
+// which the range behaves as that sequence. Like slices of other
+// sequences, the tail or a slice of a range shares its elements:
+// setting an element in either is seen by the other.
+class XYRange : public XYSequence
+{
+  public:
+    long mStart;
+    long mStep;
+    size_t mSize;
+
+    // The stored elements, or null if they are computed. Use
+    // 'elements()' to also see those stored by the parent.
+    XYSequence* mElements;
+
+    // For a range that is the tail or a slice of another range, the
+    // original range and the index of our first element in it.
+    // Elements are stored in the parent and we are a slice of them.
+    XYRange* mParent;
+    size_t mOffset;
+
+    // The compiled form of the range, created the first time it
+    // is run as a program.
+    XYCode* mCode;
+
+  public:
+    XYRange(long start, long step, size_t size);
+
+    // Returns a new packed vector holding the elements
+    XYIntVector* expand() const;
+
+    // Returns the stored elements, or null if they are computed
+    XYSequence* elements();
+
+    // Returns the range of elements from 'begin' up to 'end',
+    // sharing them with this one.
+    XYRange* subrange(size_t begin, size_t end);
+
+    virtual void markChildren();
+    virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
+    virtual size_t size();
+    virtual void pushBackInto(List& list);
+    virtual XYObject* at(size_t n);
+    virtual void set_at(size_t n, XYObject* v);
+    virtual XYObject* head();
+    virtual XYSequence* tail();
+    virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
+    virtual XYCode* compile(XY* xy);
+    virtual XYSequence* slice(size_t begin, size_t end);
+};
+
+// A lazy pipeline of map, filter, take and drop stages over a source
+// sequence. When the source is a range or packed vector, which is
+// copied so that later changes to it are not seen, nothing is
+// computed until the pipeline is used as a sequence. Then all the
+// stages run in a single pass over the source and the results are
+// stored in 'mElements'. Pipelines over other sequences are run when
+// created. Only quotations that can run without the interpreter,
+// built from numbers, shuffles and arithmetic or comparison
+// primitives, can be a map or filter stage.
+class XYPipeline : public XYSequence
+{
+  public:
+    // A step of a map or filter quotation
+    struct Operation {
+      enum Kind {
+        PUSH,          // Push mObject onto the stack
+        SHUFFLE,       // Apply the XYShuffle in mObject
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE,
+        POWER,
+        EQUAL,
+        LESS,
+        LESS_EQUAL,
+        GREATER,
+        GREATER_EQUAL,
+        NOT
+      };
+
+      Kind mKind;
+      XYObject* mObject;
+    };
+
+    struct Stage {
+      enum Kind {
+        MAP,     // Replace the element with the result of mOperations
+        FILTER,  // Keep the element if mOperations gives a true value
+        TAKE,    // Keep the first mCount elements and stop
+        DROP     // Skip the first mCount elements
+      };
+
+      Kind mKind;
+      std::vector<Operation> mOperations;
+      size_t mCount;
+    };
+
+    typedef std::vector<Stage> Stages;
+
+    XYSequence* mSource;
+    Stages mStages;
+
+    // The results, or null if the pipeline has not been forced
+    XYSequence* mElements;
+
+  public:
+    XYPipeline(XYSequence* source);
+
+    // Compile 'quotation' into the operations of 'stage' using the
+    // primitives in 'xy'. Returns false if the quotation needs the
+    // interpreter to run.
+    static bool compileStage(XY* xy, XYSequence* quotation, Stage& stage);
+
+    // Returns a new pipeline with 'stage' after the stages of
+    // 'source', if it is an unforced pipeline, or over 'source'.
+    static XYPipeline* extend(XYSequence* source, Stage const& stage);
+
+    // Run the stages if needed and return the results
+    XYSequence* force();
+
     virtual void markChildren();
     virtual void print(std::ostringstream& stream, CircularSet& seen, bool parse) const;
     virtual size_t size();
@@ -384,6 +1001,9 @@ class XYJoin : public XYSequence
     virtual XYObject* head();
     virtual XYSequence* tail();
     virtual XYSequence* join(XYSequence* rhs);
+    virtual size_t span(size_t n, XYObject* const*& begin, XYObject** buffer);
+    virtual XYCode* compile(XY* xy);
+    virtual XYSequence* slice(size_t begin, size_t end);
 };
 
 // A primitive is the implementation of a core function.
@@ -402,6 +1022,132 @@ class XYPrimitive : public XYObject
     virtual int compare(XYObject* rhs);
 };
 
+// A quotation compiled for faster execution. Each object in the
+// quotation is compiled to exactly one instruction which records the
+// original object. This allows the unexecuted remainder of the code
+// to be placed back on the queue at any point, for primitives like
+// '$' that need to see the queue as a list of objects.
+class XYCode : public GCObject
+{
+  public:
+    enum Op {
+      OP_PUSH,       // Push the object onto the stack
+      OP_EVAL,       // Call the object's eval1 method
+      OP_PRIMITIVE,  // Symbol naming a primitive. Call it directly.
+      OP_SYMBOL,     // Symbol that is not a primitive
+      OP_QUOTE       // Quote primitive. Push the next object in a list.
+    };
+
+    struct Instruction {
+      Op mOp;
+
+      // The object this instruction was compiled from
+      XYObject* mObject;
+
+      // For OP_PRIMITIVE and OP_QUOTE, the primitive the symbol
+      // referred to when compiled. If the interpreter running the
+      // code has a different primitive for the symbol the instruction
+      // is run as an OP_SYMBOL.
+      XYPrimitive* mPrimitive;
+    };
+
+    typedef std::vector<Instruction> Instructions;
+    Instructions mInstructions;
+
+  public:
+    // Compile the sequence using the primitives available in 'xy'
+    XYCode(XY* xy, XYSequence* sequence);
+
+    virtual void markChildren();
+};
+
+// A compiled pattern for the '(' and ')' primitives. The first
+// element of the pattern is matched against values on the stack,
+// binding each pattern variable to a numbered slot. The rest of the
+// pattern is the body, which is copied with the variables replaced
+// by the values in their slots. Variables that are all uppercase
+// bind to the remainder of the sequence they are matched against.
+class XYPattern : public GCObject
+{
+  public:
+    // Matches part of the pattern against a value
+    struct Matcher {
+      enum Kind {
+        IGNORE,  // Not a variable, matches anything
+        BIND,    // Bind the value to mSlot
+        REST,    // Bind the rest of the sequence to mSlot
+        LIST     // Match mChildren against the elements of a sequence
+      };
+
+      Kind mKind;
+      size_t mSlot;
+      std::vector<Matcher> mChildren;
+    };
+
+    // An element of the body. Sequences are copied each time the
+    // body is used and any variables in them replaced.
+    struct Template {
+      XYObject* mObject;
+      int mSlot;
+      bool mSequence;
+      std::vector<Template> mChildren;
+    };
+
+    typedef std::vector<XYObject*> Values;
+
+    // Number of elements of the pattern this was compiled from
+    size_t mSize;
+
+    Matcher mMatcher;
+
+    // The symbol id of the variable in each slot
+    std::vector<unsigned int> mIds;
+
+    std::vector<Template> mBody;
+
+    // The body compiled for running with '('. Instructions for
+    // variables and sequences are replaced each time it is run.
+    XYCode* mCode;
+
+    // Each sequence nested in the pattern, with the elements it had
+    // when compiled.
+    typedef std::vector<std::pair<XYSequence*, Values> > Nested;
+    Nested mNested;
+
+    // The sequence version when the nested sequences were last
+    // found to be unchanged.
+    unsigned int mVersion;
+
+  public:
+    XYPattern(XY* xy, XYSequence* pattern);
+
+    // Returns true if a sequence nested in the pattern has been
+    // changed in place since it was compiled. The nested sequences
+    // are only compared again after some sequence has been changed.
+    bool stale();
+
+    // Remove the values matched by the pattern from the stack,
+    // storing them in the pattern slots. Unbound slots are null.
+    void match(XY* xy, Values& values) const;
+
+    // Append the body to the stack using the given slot values
+    void push(XY* xy, Values const& values) const;
+
+    // Return code to run the body using the given slot values
+    XYCode* code(Values const& values) const;
+
+    virtual void markChildren();
+
+  private:
+    void compile(XYObject* pattern, Matcher& matcher);
+    void compile(XYObject* object, Template& t);
+
+    // Remember the elements of a nested sequence for 'stale'
+    void record(XYSequence* sequence);
+    void match(Matcher const& matcher, XYObject* object, XYSequence* sequence, size_t i, Values& values) const;
+    XYObject* instantiate(Template const& t, Values const& values) const;
+};
+
 // Base class to to provide limits to the executing
 // XY program. Limit examples might be a requirement to run
 // within a certain number of ticks, time period or
@@ -415,6 +1161,15 @@ class XYLimit : public GCObject {
   // Check if the limit has been reached. Return's true if
   // so.
   virtual bool check(XY* xy) = 0;
+
+  // The number of steps that can be run before the limit needs
+  // to be checked again. Limits that read a clock are only
+  // checked every so often to keep checking cheap.
+  virtual unsigned int interval(XY* xy);
+
+  // Return a new limit with the same budget. Limits record when
+  // they were started so each interpreter needs its own.
+  virtual XYLimit* copy() const = 0;
 };
 
 // Limit a call of eval to run within a
@@ -428,6 +1183,37 @@ class XYTimeLimit : public XYLimit {
   XYTimeLimit(unsigned int milliseconds);
   virtual void start(XY* xy);
   virtual bool check(XY* xy);
+  virtual XYLimit* copy() const;
+};
+
+// Limit a call of eval to run a certain number of steps.
+class XYTickLimit : public XYLimit {
+ public:
+  unsigned long mTicks;
+  unsigned long mStart;
+
+ public:
+  XYTickLimit(unsigned long ticks);
+  virtual void start(XY* xy);
+  virtual bool check(XY* xy);
+  virtual unsigned int interval(XY* xy);
+  virtual XYLimit* copy() const;
+};
+
+// Limit a call of eval to use a certain number of milliseconds
+// of CPU time. Only time spent running the interpreter the limit
+// is checked on is counted, not that of other interpreters
+// sharing the same operating system thread.
+class XYCpuTimeLimit : public XYLimit {
+ public:
+  unsigned int mMilliseconds;
+  unsigned long mStart;
+
+ public:
+  XYCpuTimeLimit(unsigned int milliseconds);
+  virtual void start(XY* xy);
+  virtual bool check(XY* xy);
+  virtual XYLimit* copy() const;
 };
 
 // An object that gets thrown when an error occurs
@@ -463,10 +1249,153 @@ class XYError {
   std::string message();
 };
 
-// The environment maps names to objects
-typedef std::map<std::string, XYObject*> XYEnv;
+// The environment maps names to objects. It is a flat table indexed
+// by the interned id of the symbol name. Unbound symbols have a null
+// entry.
+class XYEnv {
+  public:
+    typedef std::vector<XYObject*> Table;
+    Table mTable;
+
+  public:
+    // Return the object bound to the symbol id, or null if
+    // it is not bound.
+    XYObject* lookup(unsigned int id) const {
+      return id < mTable.size() ? mTable[id] : 0;
+    }
+    XYObject* lookup(std::string const& name) const;
+
+    // Bind the symbol id to the given object
+    void set(unsigned int id, XYObject* value) {
+      if (id >= mTable.size())
+        mTable.resize(id + 1, 0);
+      mTable[id] = value;
+    }
+
+    // Map style access by name, interning the name if needed
+    XYObject*& operator[](std::string const& name);
+
+    // Number of bound symbols
+    size_t size() const;
+
+    // Remove all bindings
+    void clear();
+
+    // Mark all bound objects for the garbage collector
+    void markChildren();
+};
+
 typedef std::vector<XYObject*> XYStack;
-typedef std::deque<XYObject*> XYQueue;
+
+// The queue of objects waiting to be evaluated. Rather than copying
+// the contents of each quotation that is called onto the queue, the
+// queue holds a stack of frames. A frame is either a single object
+// or a compiled quotation with the index of the next instruction to
+// run. Calling a quotation is then O(1). The queue can still be used
+// like a sequence of objects, the frames are expanded when iterated.
+class XYQueue {
+  public:
+    struct Frame {
+      // Compiled code for the frame, or null if it is a single object
+      XYCode* mCode;
+
+      // Index of the next instruction in mCode
+      size_t mPC;
+
+      // The object if this frame is not compiled code
+      XYObject* mObject;
+    };
+
+    typedef std::deque<Frame> Frames;
+
+    // Iterates over each object in the queue in order
+    class const_iterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef XYObject* value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef XYObject* const* pointer;
+        typedef XYObject* const& reference;
+
+      private:
+        Frames::const_iterator mFrame;
+        Frames::const_iterator mEnd;
+        size_t mPC;
+
+      public:
+        const_iterator(Frames::const_iterator frame, Frames::const_iterator end);
+        reference operator*() const;
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        bool operator==(const_iterator const& rhs) const;
+        bool operator!=(const_iterator const& rhs) const;
+    };
+
+    typedef const_iterator iterator;
+    typedef XYObject* value_type;
+    typedef XYObject* const& const_reference;
+
+  private:
+    Frames mFrames;
+
+    // Total number of objects in all frames
+    size_t mSize;
+
+  public:
+    XYQueue();
+
+    size_t size() const { return mSize; }
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // Returns the object at index 'n'. This walks the frames so
+    // should only be used for small 'n'.
+    XYObject* operator[](size_t n) const;
+
+    // The first object in the queue
+    XYObject* front() const;
+
+    void pop_front();
+    void push_front(XYObject* o);
+    void push_back(XYObject* o);
+
+    // Push the code, starting at instruction 'pc', onto the front
+    // of the queue.
+    void push_front(XYCode* code, size_t pc);
+
+    // If the first frame is compiled code, remove it and store it
+    // in 'code' and 'pc'. Returns false if the first frame is a
+    // single object.
+    bool pop_code(XYCode*& code, size_t& pc);
+
+    // Insert a range of objects. 'position' must be begin().
+    template <class InputIterator>
+    void insert(const_iterator position, InputIterator first, InputIterator last);
+
+    template <class InputIterator>
+    void assign(InputIterator first, InputIterator last);
+
+    void clear();
+
+    // Mark all objects in the queue for the garbage collector
+    void markChildren();
+};
+
+template <class InputIterator>
+void XYQueue::insert(const_iterator position, InputIterator first, InputIterator last) {
+  assert(position == begin());
+  std::vector<XYObject*> temp(first, last);
+  for (std::vector<XYObject*>::reverse_iterator it = temp.rbegin(); it != temp.rend(); ++it)
+    push_front(*it);
+}
+
+template <class InputIterator>
+void XYQueue::assign(InputIterator first, InputIterator last) {
+  clear();
+  for (; first != last; ++first)
+    push_back(*first);
+}
+
 typedef std::vector<XYLimit*> XYLimits;
 typedef std::vector<XY*> XYWaitingList;
 
@@ -511,6 +1440,13 @@ class XY : public GCObject {
     // The Queue
     XYQueue mY;
 
+    // The compiled code being run and the index of the next
+    // instruction in it. The instructions not yet run logically
+    // precede the items in mY. This is only set while 'run'
+    // is executing, see 'materialize'.
+    XYCode* mCode;
+    size_t mPC;
+
     // The limits that restrict the operation of this
     // interpreter.
     XYLimits mLimits;
@@ -521,6 +1457,31 @@ class XY : public GCObject {
     // True if we are a 'repl' based interpreter
     bool mRepl;
 
+    // Set when a primitive has suspended the interpreter to wait
+    // for an asynchronous event. See 'suspend'.
+    bool mSuspended;
+
+    // The maximum number of steps, and the maximum time in
+    // microseconds, that evalHandler runs before posting itself back
+    // to the io service so other interpreters get a turn. Zero means
+    // no bound.
+    unsigned int mQuantumSteps;
+    unsigned int mQuantumMicroseconds;
+
+    // Total number of steps run, and the time in microseconds spent
+    // running them, used to report the step rate.
+    unsigned long mSteps;
+    unsigned long mStepTime;
+
+    // CPU time in microseconds used by this interpreter, and the
+    // thread CPU clock when the current timeslice started. mCpuStart
+    // is zero when the interpreter is not running.
+    unsigned long mCpuTime;
+    unsigned long mCpuStart;
+
+    // The value of mSteps at which the limits are next checked
+    unsigned long mLimitCheck;
+
   public:
     // Constructor installs any primitives into the
     // environment.
@@ -539,41 +1500,49 @@ class XY : public GCObject {
     // post back to the eval handler.
     void yield();
 
+    // Called by a primitive that must wait for an asynchronous event.
+    // The interpreter stops once the primitive returns and is resumed
+    // when the event handler posts evalHandler again.
+    void suspend();
+
+    // Start counting towards the limits.
+    void startLimits();
+
     // Check limits. Throw the limit object if it has
-    // been exceeded.
+    // been exceeded. The limits are only consulted once the
+    // number of steps given by their 'interval' have run.
     void checkLimits();
 
+    // The number of steps that can run before limits must
+    // be checked.
+    unsigned int stepsToLimitCheck() const;
+
+    // The CPU time in microseconds used by this interpreter,
+    // including the current timeslice.
+    unsigned long cpuTime() const;
+
     // Print a representation of the state of the
     // interpter.
     void print();
 
+    // Run up to 'steps' evaluation steps. Returns the number of
+    // steps run.
+    unsigned int run(unsigned int steps);
+
+    // Push the unexecuted remainder of the running code back onto
+    // the front of the queue as a frame. Primitives that read or
+    // modify the queue must call this first.
+    void materialize();
+
+    // Run the sequence before the remaining items in the queue.
+    void call(XYSequence* sequence);
+    void call(XYCode* code);
+
     // Remove one item from the queue and evaluate it.
     virtual void eval1();
 
     // Evaluate all items in the queue.
     virtual void eval();
-
-    // Perform a recursive match of pattern values to items
-    // in the given stack.
-    template <class OutputIterator>
-    void match(OutputIterator out, 
-               XYObject* object,
-               XYObject* pattern,
-               XYSequence* sequence,
-               int i);
-
-    // Given a pattern list of symbols (which can contain
-    // nested lists of symbols), store in the environment
-    // a mapping of symbol name to value from the stack.
-    // This operation destructures within lists on the stack.
-    template <class OutputIterator>
-    void getPatternValues(XYObject* symbols, OutputIterator out);
-
-    // Given a mapping of names to values in 'env', replaces symbols in 'object'
-    // that have the name with the given value. Store the newly created list
-    // in 'out'.
-    template <class OutputIterator>
-    void replacePattern(XYEnv const& env, XYObject* object, OutputIterator out);
 };
 
 // Return regex for tokenizing
@@ -633,7 +1602,7 @@ InputIterator parse(InputIterator first, InputIterator last, OutputIterator out)
     else if(token == "[") {
       XYList* list = new XYList();
       first = parse(first, last, back_inserter(list->mList));
-      *out++ = list;
+      *out++ = XYPackedVector::pack(list);
     }
     else if( token == "]") {
       return first;
@@ -83,17 +83,20 @@ void XYSocket::connect(string const& host, std::string const& port) {
 void XYSocket::writeln(XYString* str) {
   boost::asio::streambuf request;
   std::ostream request_stream(&request);
-  request_stream << str->mValue << "\r\n";
+  request_stream << str->value() << "\r\n";
   boost::asio::write(mSocket, request);
 }
 
 void XYSocket::writeln(XYSequence* seq) {
   boost::asio::streambuf request;
   std::ostream request_stream(&request);
-  for(int i=0; i < seq->size(); ++i) {
-    XYInteger* n(dynamic_cast<XYInteger*>(seq->at(i)));
-    assert(n);
-    request_stream << (char)(n->as_uint());
+  XYSpan span(seq);
+  while (span.next()) {
+    for (XYObject* const* it = span.mBegin; it != span.mEnd; ++it) {
+      XYInteger* n(dynamic_cast<XYInteger*>(*it));
+      assert(n);
+      request_stream << (char)(n->as_uint());
+    }
   }
   request_stream << "\r\n";
   boost::asio::write(mSocket, request);
@@ -272,7 +275,7 @@ static void primitive_socket(XY* xy) {
   xy->mX.pop_back();
 
   XYSocket* socket(new XYSocket(xy->mService));
-  socket->connect(host->mValue, port->toString(false));
+  socket->connect(host->value(), port->toString(false));
   xy->mX.push_back(socket);
 }
 
@@ -312,7 +315,7 @@ static void primitive_socket_readln(XY* xy) {
   xy->mX.pop_back();
 
   socket->readln(xy);
-  throw XYError(xy, XYError::WAITING_FOR_ASYNC_EVENT);
+  xy->suspend();
 }
 
 // socket-readn [X^n^socket Y] -> [X^string Y]
@@ -327,7 +330,7 @@ static void primitive_socket_readn(XY* xy) {
   xy->mX.pop_back();
 
   socket->readn(xy, n->as_uint());
-  throw XYError(xy, XYError::WAITING_FOR_ASYNC_EVENT);
+  xy->suspend();
 }
 
 // line-channel [X^socket Y] -> [X^channel Y]
@@ -349,8 +352,10 @@ static void primitive_line_channel_get(XY* xy) {
 
   if (channel->mLines.size() == 0) {
     channel->mWaiting.push_back(xy);
+    xy->materialize();
     xy->mY.push_front(new XYPrimitive("line-channel-get", primitive_line_channel_get));
-    throw XYError(xy, XYError::WAITING_FOR_ASYNC_EVENT);
+    xy->suspend();
+    return;
   }
     
   xy->mX.pop_back();
@@ -371,8 +376,10 @@ static void primitive_line_channel_getall(XY* xy) {
 
   if (channel->mLines.size() == 0) {
     channel->mWaiting.push_back(xy);
+    xy->materialize();
     xy->mY.push_front(new XYPrimitive("line-channel-getall", primitive_line_channel_getall));
-    throw XYError(xy, XYError::WAITING_FOR_ASYNC_EVENT);
+    xy->suspend();
+    return;
   }
 
   xy->mX.pop_back();
@@ -395,7 +402,7 @@ static void primitive_line_channel_count(XY* xy) {
   xy_assert(channel, XYError::TYPE);
   xy->mX.pop_back();
 
-  xy->mX.push_back(new XYInteger(channel->mLines.size()));
+  xy->mX.push_back(XYInteger::make(channel->mLines.size()));
 }
 
 void install_socket_primitives(XY* xy) {
@@ -20,6 +20,47 @@ using namespace std;
 using namespace boost;
 using namespace boost::lambda;
 
+// Returns the value bound to the named variable of a compiled pattern
+static XYObject* pattern_value(XYPattern* pattern, XYPattern::Values const& values, string name) {
+  for (size_t i = 0; i < pattern->mIds.size(); ++i) {
+    if (symbol_name(pattern->mIds[i]) == name)
+      return values[i];
+  }
+  return 0;
+}
+
+// Evaluates the program in a new interpreter and returns the stack
+static string eval_stack(boost::asio::io_service& io, string const& program) {
+  XY* xy(new XY(io));
+  parse(program, back_inserter(xy->mY));
+  xy->eval();
+  XYList* stack(new XYList(xy->mX.begin(), xy->mX.end()));
+  return stack->toString(true);
+}
+
+// Returns true if a value in a slot added to the object is still
+// there after a collection
+static bool slot_survives_collection(XYObject* o) {
+  o->addSlot("foo", new XYList(), new XYString("bar"), false);
+  GarbageCollector::GC.addRoot(o);
+  GarbageCollector::GC.collect();
+  bool result = o->getSlot("foo")->mValue->toString(false) == "bar";
+  GarbageCollector::GC.removeRoot(o);
+  return result;
+}
+
+// Returns true if iterating over elements [begin, end) of the
+// sequence with XYSpan gives the same elements as 'at'
+static bool span_matches(XYSequence* seq, size_t begin, size_t end) {
+  XYSpan span(seq, begin, end);
+  size_t i = begin;
+  for (XYObject* o = span.read(); o; o = span.read(), ++i) {
+    if (i >= end || o->compare(seq->at(i)) != 0)
+      return false;
+  }
+  return i == end;
+}
+
 void testParse(boost::asio::io_service& io) 
 {
   {
@@ -32,10 +73,10 @@ void testParse(boost::asio::io_service& io)
     XYInteger* n3(dynamic_cast<XYInteger*>(x[2]));
     XYInteger* n4(dynamic_cast<XYInteger*>(x[3]));
 
-    BOOST_CHECK(n1 && n1->mValue == 1);
-    BOOST_CHECK(n2 && n2->mValue == 20);
-    BOOST_CHECK(n3 && n3->mValue == 300);
-    BOOST_CHECK(n4 && n4->mValue == -400);
+    BOOST_CHECK(n1 && n1->value() == 1);
+    BOOST_CHECK(n2 && n2->value() == 20);
+    BOOST_CHECK(n3 && n3->value() == 300);
+    BOOST_CHECK(n4 && n4->value() == -400);
   }
 
   {
@@ -105,7 +146,61 @@ void testParse(boost::asio::io_service& io)
     }
     XYInteger* n1(dynamic_cast<XYInteger*>(xy->mX[0]));
 
-    BOOST_CHECK(n1 && n1->mValue == 3);
+    BOOST_CHECK(n1 && n1->value() == 3);
+  }
+
+  {
+    // Integer overflow promotes to arbitrary precision
+    XY* xy(new XY(io));
+    parse("9223372036854775807 1 + -9223372036854775808 1 - 4294967296 4294967296 * 2 64 ^ 9223372036854775808 1 -", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 5);
+    BOOST_CHECK(xy->mX[0]->toString(true) == "9223372036854775808");
+    BOOST_CHECK(xy->mX[1]->toString(true) == "-9223372036854775809");
+    BOOST_CHECK(xy->mX[2]->toString(true) == "18446744073709551616");
+    BOOST_CHECK(xy->mX[3]->toString(true) == "18446744073709551616");
+
+    XYInteger* n(dynamic_cast<XYInteger*>(xy->mX[4]));
+    BOOST_CHECK(n && !n->mBig && n->mSmall == 9223372036854775807L);
+  }
+
+  {
+    // Floats are native doubles unless arbitrary precision is asked for
+    XY* xy(new XY(io));
+    parse("1.5 2.5 * 1.5m 2 * 1 4 %", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 3);
+    XYFloat* f1(dynamic_cast<XYFloat*>(xy->mX[0]));
+    XYFloat* f2(dynamic_cast<XYFloat*>(xy->mX[1]));
+    XYFloat* f3(dynamic_cast<XYFloat*>(xy->mX[2]));
+    BOOST_CHECK(f1 && !f1->mBig && f1->mDouble == 3.75);
+    BOOST_CHECK(f2 && f2->mBig && *f2->mBig == 3);
+    BOOST_CHECK(f3 && !f3->mBig && f3->mDouble == 0.25);
+  }
+
+  {
+    // Small integer results are shared
+    XY* xy(new XY(io));
+    parse("2 3 + 1 4 + 1000 1000 + 1000 1000 +", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 4);
+    BOOST_CHECK(xy->mX[0] == xy->mX[1]);
+    BOOST_CHECK(xy->mX[2] != xy->mX[3]);
+    BOOST_CHECK(xy->mX[2]->toString(true) == "2000");
+
+    // Slots are added to a copy of a shared integer
+    BOOST_CHECK(eval_stack(io, "3 2 - 42 foo add-slot foo;.") == "[ 42 ]");
+    BOOST_CHECK(XYInteger::make(1)->mSlots.empty());
+    XY* other(new XY(io));
+    parse("5 4 - foo;.", back_inserter(other->mY));
+    bool missing = false;
+    try {
+      other->eval();
+    }
+    catch (XYError&) {
+      missing = true;
+    }
+    BOOST_CHECK(missing);
   }
 
   {
@@ -118,9 +213,9 @@ void testParse(boost::asio::io_service& io)
       xy->eval1();
     }
 
-    XYEnv::iterator it = xy->mEnv.find("add5");
-    BOOST_CHECK(it != xy->mEnv.end());
-    XYList* o1(dynamic_cast<XYList*>((*it).second));
+    XYObject* add5 = xy->mEnv.lookup("add5");
+    BOOST_CHECK(add5);
+    XYList* o1(dynamic_cast<XYList*>(add5));
     BOOST_CHECK(o1 && o1->mList.size() == 2);
 
     parse("2 add5.", back_inserter(xy->mY));
@@ -130,7 +225,144 @@ void testParse(boost::asio::io_service& io)
     
     BOOST_CHECK(xy->mX.size() == 1);
     XYInteger* o2(dynamic_cast<XYInteger*>(xy->mX.back()));
-    BOOST_CHECK(o2 && o2->mValue == 7);
+    BOOST_CHECK(o2 && o2->value() == 7);
+  }
+
+  {
+    // Cached slot lookups see slots added after the first lookup
+    XY* xy(new XY(io));
+    parse("[baz.] q set q. object. 4 baz add-slot a- q.", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ baz 4 ]");
+  }
+
+  {
+    // Method calls bind arguments, tail call and restore the frame
+    XY* xy(new XY(io));
+    XYObject* frame = xy->mFrame;
+    parse("object. copy [a b] [ a. b. - ] sub add-method 10 3 abc-bca sub;. "
+          "object. copy [n] [ n. 0 = [ n. ] [ n. 1 - self. down;. ] if ] down add-method 1000 ab-ba down;.",
+          back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ 7 0 ]");
+    BOOST_CHECK(xy->mFrame == frame);
+  }
+
+  {
+    // As with addSlot("self*", object), the frame's 'self' parent
+    // slot is read only and has no 'self:' setter.
+    XY* xy(new XY(io));
+    parse("object. copy [] [ self. ] me add-method me;.", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 1 && xy->mX.back()->getSlot("me"));
+
+    BOOST_CHECK(eval_stack(io, "object. copy [] [ 1 self:. ] reset add-method reset;.") == "[ 1 self: ]");
+  }
+
+  {
+    // Calling a method does not invalidate cached lookups
+    XY* xy(new XY(io));
+    parse("object. copy [] [ self. ] id add-method a-aa id;. ab-b", back_inserter(xy->mY));
+    xy->eval();
+    unsigned int version = lookup_version();
+    parse("id;. id;. id;.", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 1);
+    BOOST_CHECK(lookup_version() == version);
+  }
+
+  {
+    // Compiled quotations. The remainder of a running quotation
+    // must be visible to primitives that access the queue.
+    XY* xy(new XY(io));
+    parse("[1 2 [a- []]$ 3 4]. 5", back_inserter(xy->mY));
+    xy->eval();
+
+    BOOST_CHECK(xy->mY.size() == 0);
+    BOOST_CHECK(xy->mX.size() == 2);
+    BOOST_CHECK(xy->mX.back()->toString(true) == "2");
+
+    parse("[3 +] add3 set add3. '4 [6] `", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 4);
+    BOOST_CHECK(xy->mX[1]->toString(true) == "5");
+    BOOST_CHECK(xy->mX[2]->toString(true) == "6");
+    BOOST_CHECK(xy->mX[3]->toString(true) == "[ 4 ]");
+  }
+
+  {
+    // Queue frames
+    XY* xy(new XY(io));
+    XYList* list(new XYList());
+    parse("1 2 3", back_inserter(list->mList));
+    XYQueue y;
+    y.push_back(new XYInteger(4));
+    y.push_front(list->compile(xy), 1);
+    y.push_front(new XYInteger(0));
+    BOOST_CHECK(y.size() == 4);
+    BOOST_CHECK(y[2]->toString(true) == "3");
+
+    XYList* all(new XYList(y.begin(), y.end()));
+    BOOST_CHECK(all->toString(true) == "[ 0 2 3 4 ]");
+
+    y.pop_front();
+    y.pop_front();
+    BOOST_CHECK(y.size() == 2);
+    BOOST_CHECK(y.front()->toString(true) == "3");
+  }
+
+  {
+    // Tick limit
+    XY* xy(new XY(io));
+    xy->mLimits.push_back(new XYTickLimit(3));
+    parse("1 2 3 4 5", back_inserter(xy->mY));
+    bool limited = false;
+    try {
+      xy->eval();
+    }
+    catch(XYError& e) {
+      limited = e.mCode == XYError::LIMIT_REACHED;
+    }
+    BOOST_CHECK(limited);
+    BOOST_CHECK(xy->mX.size() == 3);
+    BOOST_CHECK(xy->mY.size() == 2);
+  }
+
+  {
+    // CPU time limit
+    XY* xy(new XY(io));
+    xy->mLimits.push_back(new XYCpuTimeLimit(10));
+    parse("0 1000000000 [1 +] do.", back_inserter(xy->mY));
+    bool limited = false;
+    try {
+      xy->eval();
+    }
+    catch(XYError& e) {
+      limited = e.mCode == XYError::LIMIT_REACHED;
+    }
+    BOOST_CHECK(limited);
+    BOOST_CHECK(xy->cpuTime() < 1000000);
+  }
+
+  {
+    // Limits are copied rather than shared between interpreters
+    XY* parent(new XY(io));
+    XY* child(new XY(io));
+    XYTickLimit* limit(new XYTickLimit(10));
+    limit->start(parent);
+    parent->mSteps = 5;
+    XYTickLimit* copy(dynamic_cast<XYTickLimit*>(limit->copy()));
+    BOOST_CHECK(copy && copy != limit && copy->mTicks == 10);
+    copy->start(child);
+    BOOST_CHECK(limit->mStart == 0);
+    BOOST_CHECK(!limit->check(parent));
+    BOOST_CHECK(limit->interval(parent) == 5);
+
+    XYCpuTimeLimit* cpu(new XYCpuTimeLimit(20));
+    XYCpuTimeLimit* cpu_copy(dynamic_cast<XYCpuTimeLimit*>(cpu->copy()));
+    BOOST_CHECK(cpu_copy && cpu_copy != cpu && cpu_copy->mMilliseconds == 20);
   }
 
   {
@@ -143,12 +375,13 @@ void testParse(boost::asio::io_service& io)
     BOOST_CHECK(pattern && pattern->mList.size() == 4);
     xy->mX.pop_back();
 
-    XYEnv env;
-    xy->getPatternValues(*(pattern->mList.begin()), inserter(env, env.begin()));
-    BOOST_CHECK(env.size() == 3);
-    BOOST_CHECK(env["a"]->toString(true) == "1");
-    BOOST_CHECK(env["b"]->toString(true) == "2");
-    BOOST_CHECK(env["c"]->toString(true) == "3");
+    XYPattern* compiled(new XYPattern(xy, pattern));
+    XYPattern::Values values;
+    compiled->match(xy, values);
+    BOOST_CHECK(compiled->mIds.size() == 3);
+    BOOST_CHECK(pattern_value(compiled, values, "a")->toString(true) == "1");
+    BOOST_CHECK(pattern_value(compiled, values, "b")->toString(true) == "2");
+    BOOST_CHECK(pattern_value(compiled, values, "c")->toString(true) == "3");
   }
 
   {
@@ -161,12 +394,13 @@ void testParse(boost::asio::io_service& io)
     BOOST_CHECK(pattern && pattern->mList.size() == 4);
     xy->mX.pop_back();
 
-    XYEnv env;
-    xy->getPatternValues(*(pattern->mList.begin()), inserter(env, env.begin()));
-    BOOST_CHECK(env.size() == 3);
-    BOOST_CHECK(env["a"]->toString(true) == "1");
-    BOOST_CHECK(env["b"]->toString(true) == "2");
-    BOOST_CHECK(env["c"]->toString(true) == "3");
+    XYPattern* compiled(new XYPattern(xy, pattern));
+    XYPattern::Values values;
+    compiled->match(xy, values);
+    BOOST_CHECK(compiled->mIds.size() == 3);
+    BOOST_CHECK(pattern_value(compiled, values, "a")->toString(true) == "1");
+    BOOST_CHECK(pattern_value(compiled, values, "b")->toString(true) == "2");
+    BOOST_CHECK(pattern_value(compiled, values, "c")->toString(true) == "3");
   }
   {
     // Pattern deconstruction 2
@@ -178,28 +412,29 @@ void testParse(boost::asio::io_service& io)
     BOOST_CHECK(pattern && pattern->mList.size() == 2);
     xy->mX.pop_back();
 
-    XYEnv env;
-    xy->getPatternValues(*(pattern->mList.begin()), inserter(env, env.begin()));
-    BOOST_CHECK(env.size() == 1);
-    BOOST_CHECK(env["a"]->toString(true) == "foo");
+    XYPattern* compiled(new XYPattern(xy, pattern));
+    XYPattern::Values values;
+    compiled->match(xy, values);
+    BOOST_CHECK(compiled->mIds.size() == 1);
+    BOOST_CHECK(pattern_value(compiled, values, "a")->toString(true) == "foo");
   }
   {
     // Pattern replace 1
-    XYEnv env;
-    env["a"] = new XYInteger(1);
-    env["b"] = new XYInteger(2);
+    XY* xy(new XY(io));
+    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(new XYInteger(2));
 
     XYList* list(new XYList());
+    parse("[a b]", back_inserter(list->mList));
     list->mList.push_back(new XYInteger(42));
     list->mList.push_back(new XYSymbol("b"));
     list->mList.push_back(new XYSymbol("a"));
 
-    XYList* out(new XYList());
-    XY* xy(new XY(io));
-    xy->replacePattern(env, list, back_inserter(out->mList));
-    BOOST_CHECK(out->mList.size() > 0);
-    XYList* result(dynamic_cast<XYList*>(out->mList[0]));
-    BOOST_CHECK(result);
+    XYPattern* compiled(new XYPattern(xy, list));
+    XYPattern::Values values;
+    compiled->match(xy, values);
+    compiled->push(xy, values);
+    XYList* result(new XYList(xy->mX.begin(), xy->mX.end()));
     BOOST_CHECK(result->mList.size() == 3);
     BOOST_CHECK(result->mList[0]->toString(true) == "42");
     BOOST_CHECK(result->mList[1]->toString(true) == "2");
@@ -207,21 +442,52 @@ void testParse(boost::asio::io_service& io)
   }
   {
     // Pattern replace 2
-    XYEnv env;
-    env["a"] = new XYInteger(1);
-    env["b"] = new XYInteger(2);
+    XY* xy(new XY(io));
+    xy->mX.push_back(new XYInteger(1));
+    xy->mX.push_back(new XYInteger(2));
 
     XYList* list(new XYList());
-    parse("[a [ b a ] a c]", back_inserter(list->mList));
+    parse("[a b] [a [ b a ] a c]", back_inserter(list->mList));
 
-    XYList* out(new XYList());
-    XY* xy(new XY(io));
-    xy->replacePattern(env, list, back_inserter(out->mList));
-    BOOST_CHECK(out->mList.size() > 0);
-    XYList* result(dynamic_cast<XYList*>(out->mList[0]));
-    BOOST_CHECK(result);
+    XYPattern* compiled(new XYPattern(xy, list));
+    XYPattern::Values values;
+    compiled->match(xy, values);
+    compiled->push(xy, values);
+    XYList* result(new XYList(xy->mX.begin(), xy->mX.end()));
     BOOST_CHECK(result->mList.size() == 1);
     BOOST_CHECK(result->toString(true) == "[ [ 1 [ 2 1 ] 1 c ] ]");
+
+    // The body is copied each time it is used
+    xy->mX.clear();
+    xy->mX.push_back(new XYInteger(3));
+    xy->mX.push_back(new XYInteger(4));
+    compiled->match(xy, values);
+    compiled->push(xy, values);
+    BOOST_CHECK(xy->mX.size() == 1);
+    BOOST_CHECK(xy->mX[0] != result->mList[0]);
+    BOOST_CHECK(xy->mX[0]->toString(true) == "[ 3 [ 4 3 ] 3 c ]");
+  }
+  {
+    // Changes to nested lists of a pattern are seen by later uses
+    BOOST_CHECK(eval_stack(io, "[[a] [a 1]] p set 5 p; ) 99 1 1 p; @ ! 6 p; )") == "[ [ 5 1 ] [ 6 99 ] ]");
+    BOOST_CHECK(eval_stack(io, "[[[a] b] b] p set [5] 6 p; ( [b] 1 0 p; @ ! [5] [6] p; (") == "[ 6 6 ]");
+
+    // The compiled pattern is reused until a nested sequence changes,
+    // including nested packed vectors whose elements are boxed when read.
+    XY* xy(new XY(io));
+    XYList* pattern(new XYList());
+    parse("[a] a [1.5 2.5 3.5 4.5 5.5 6.5 7.5 8.5 9.5 10.5 11.5 12.5 13.5 14.5 15.5 16.5 17.5]",
+          back_inserter(pattern->mList));
+    XYSequence* floats(dynamic_cast<XYSequence*>(pattern->mList[2]));
+    BOOST_CHECK(dynamic_cast<XYPackedVector*>(floats));
+    XYPattern* compiled(pattern->compilePattern(xy));
+    BOOST_CHECK(pattern->compilePattern(xy) == compiled);
+    XYList* other(new XYList());
+    other->mList.push_back(new XYInteger(1));
+    other->set_at(0, new XYInteger(2));
+    BOOST_CHECK(pattern->compilePattern(xy) == compiled);
+    floats->set_at(0, new XYFloat(0.5));
+    BOOST_CHECK(pattern->compilePattern(xy) != compiled);
   }
   {
     // Pattern 1 - Stack to Stack
@@ -348,6 +614,28 @@ void testParse(boost::asio::io_service& io)
 
     BOOST_CHECK(n1->toString(true) == "[ 1 2 foo-bar ]");
   }
+  {
+    // Shuffle pattern test 6
+    XY* xy(new XY(io));
+    parse("1 2 3 ab-ba abc-cab 4 abcd-db", back_inserter(xy->mY));
+    xy->eval();
+    XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
+    BOOST_CHECK(n1->toString(true) == "[ 4 1 ]");
+  }
+  {
+    // Shuffle pattern underflow
+    XY* xy(new XY(io));
+    parse("1 2 abc-cba", back_inserter(xy->mY));
+    bool underflow = false;
+    try {
+      xy->eval();
+    }
+    catch (XYError& e) {
+      underflow = e.mCode == XYError::STACK_UNDERFLOW;
+    }
+    BOOST_CHECK(underflow);
+    BOOST_CHECK(xy->mX.size() == 2);
+  }
   {
     // Dip test 1
     XY* xy(new XY(io));
@@ -388,6 +676,381 @@ void testParse(boost::asio::io_service& io)
     XYList* n1(new XYList(xy->mX.begin(), xy->mX.end()));
     BOOST_CHECK(n1->toString(true) == "[ 3 0 1 3 0 ]");
   }
+  {
+    // The native loops and combinators give the same results as
+    // their original prelude definitions, defined here as p-<name>.
+    string prelude =
+      "[a-] drop set [ab-ba] swap set [a-aa] dup set "
+      "[ puncons ] uncons set [ [[a b] [a]b,] (] cons set "
+      "[''`] unit set [unit.cons.] pair set [[dup.]`] dupd set "
+      "[pair.[dupd.]`[.not]`@.] cond set "
+      "[unit.cons.dup.[uncons.uncons.drop.]`[p-while.],,[]cond.] p-while set "
+      "[ [[s p] s [] [dup.p.[swap.cons.][drop.]if] foldl|] ( ] p-filter set "
+      "[ [[s q] s [] [q.swap.cons.] foldl|] ( ] p-map set "
+      "[ [ [n o] o n 1 - [ 0 = ] [drop.] [ o p-repeat. , ] cond. ] ( ] p-repeat set "
+      "[ [ [s p q t] s p [ drop. [] ] [ q. s t. p q t p-unfold. cons. ] cond. ] (] p-unfold set "
+      "[[[drop.[]]`]$] p-clearstack set "
+      "[[[|uncons.|swap.]`swap.unit.,]$] p-queue set "
+      "[[[dup.unit.,]`]$] p-stack set ";
+    char const* programs[] = {
+      "1 [5 <] [1 +] while.",
+      "10 1 [5 <] [1 +] while.",
+      "3 x repeat.",
+      "1 x repeat.",
+      "2 [1 2] repeat.",
+      "2 \"ab\" repeat.",
+      "[1 2 3] [10 *] map.",
+      "[] [10 *] map.",
+      "\"abc\" [1 +] map.",
+      "[1 2 3 4 5] [3 <] filter.",
+      "[] [3 <] filter.",
+      "1 [10 >] [] [1 +] unfold.",
+      "1 [5 >] [10 *] [1 +] unfold.",
+      "11 [10 >] [] [1 +] unfold.",
+      "1 2 3 clearstack. 4",
+      "1 2 3 stack.",
+      "1 2 [3 4] queue. 5 6"
+    };
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i) {
+      string native(programs[i]);
+      string original(programs[i]);
+      size_t word = original.rfind(' ', original.find('.')) + 1;
+      original.insert(word, "p-");
+      BOOST_CHECK(eval_stack(io, prelude + native) == eval_stack(io, prelude + original));
+    }
+
+    // The prelude versions of these did not work.
+    BOOST_CHECK(eval_stack(io, "3 [7] do. 0 [8] do.") == "[ 7 7 7 ]");
+    BOOST_CHECK(eval_stack(io, "0 [1 2 3] [+] each.") == "[ 6 ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] 0 [+] fold. [] 5 [+] fold.") == "[ 6 5 ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] 0 [-] fold.") == "[ -2 ]");
+  }
+  {
+    // Resuming a continuation captured inside a loop doesn't change
+    // results the loop has already returned.
+    char const* programs[] = {
+      "[1 2 3] [ [ a-aa k set ] $ 10 * ] map. r set",
+      "[1 2 3] [ [ a-aa k set ] $ 1 > ] filter. r set"
+    };
+    char const* results[] = { "[ 10 20 30 ]", "[ 2 3 ]" };
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i) {
+      XY* xy(new XY(io));
+      parse(programs[i], back_inserter(xy->mY));
+      xy->eval();
+      parse("r;", back_inserter(xy->mY));
+      xy->eval();
+      XYObject* r(xy->mX.back());
+      BOOST_CHECK(r->toString(true) == results[i]);
+      parse("[5] k; $$", back_inserter(xy->mY));
+      xy->eval();
+      BOOST_CHECK(r->toString(true) == results[i]);
+    }
+  }
+  {
+    // foldl and foldr keep the accumulator on the stack and
+    // resume a single loop object for each element.
+    BOOST_CHECK(eval_stack(io, "[1 2 3] 0 [-] foldl [1 2 3] 0 [-] foldr") == "[ -6 -2 ]");
+    BOOST_CHECK(eval_stack(io, "[] 7 [+] foldl [] 8 [+] foldr \"abc\" 0 [+] foldl") == "[ 7 8 294 ]");
+    BOOST_CHECK(eval_stack(io, "100000 enum 0 [+] foldl 100000 enum 0 [+] foldr") == "[ 4999950000 4999950000 ]");
+
+    // The loop is only copied when the queue holding it is captured,
+    // so a continuation resumes from where it was captured.
+    XY* xy(new XY(io));
+    parse("0 3 [ 1 + a-aa 1 = [ [ a-aa k set ] $ ] [] if ] do. r set", back_inserter(xy->mY));
+    xy->eval();
+    parse("r;", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.back()->toString(true) == "3");
+    parse("[10] k; $$", back_inserter(xy->mY));
+    xy->eval();
+    parse("r;", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.back()->toString(true) == "12");
+  }
+  {
+    // Persistent vectors. Older versions are unchanged by adding
+    // to either end or by setting an element of a copy.
+    XYVector* empty(new XYVector());
+    XYVector* v(empty);
+    vector<XYVector*> versions;
+    for (int i = 0; i < 2000; ++i) {
+      versions.push_back(v);
+      v = (i % 2 == 0) ? v->push_back(XYInteger::make(i)) : v->push_front(XYInteger::make(i));
+    }
+    BOOST_CHECK(empty->size() == 0);
+    BOOST_CHECK(v->size() == 2000);
+    BOOST_CHECK(v->head()->toString(true) == "1999");
+    BOOST_CHECK(v->at(1999)->toString(true) == "1998");
+    BOOST_CHECK(v->at(1000)->toString(true) == "0");
+    BOOST_CHECK(versions[3]->toString(true) == "[ 1 0 2 ]");
+
+    XYSequence::List elements;
+    v->pushBackInto(elements);
+    bool ordered = elements.size() == 2000;
+    for (size_t i = 0; ordered && i < elements.size(); ++i)
+      ordered = elements[i] == v->at(i);
+    BOOST_CHECK(ordered);
+
+    XYSequence* t(v->tail());
+    BOOST_CHECK(t->size() == 1999);
+    BOOST_CHECK(t->head()->toString(true) == "1997");
+
+    XYVector* copy(versions[3]->push_back(XYInteger::make(5)));
+    copy->set_at(0, new XYSymbol("x"));
+    BOOST_CHECK(copy->toString(true) == "[ x 0 2 5 ]");
+    BOOST_CHECK(versions[3]->toString(true) == "[ 1 0 2 ]");
+    BOOST_CHECK(XYVector::make(versions[3]) == versions[3]);
+  }
+  {
+    // Joins find elements by binary search on the sequence ends,
+    // are not changed by further joins, and are flattened into a
+    // list when they have too many sequences.
+    vector<XYList*> lists;
+    for (int i = 0; i < 40; ++i) {
+      XYList* list(new XYList());
+      for (int j = 0; j < 50; ++j)
+	list->mList.push_back(XYInteger::make(i * 50 + j));
+      lists.push_back(list);
+    }
+
+    XYSequence* joined(lists[0]);
+    XYSequence* eight(0);
+    for (int i = 1; i < 40; ++i) {
+      joined = joined->join(lists[i]);
+      if (i == 7)
+	eight = joined;
+    }
+    BOOST_CHECK(dynamic_cast<XYJoin*>(eight));
+    BOOST_CHECK(eight->size() == 400);
+    BOOST_CHECK(dynamic_cast<XYJoin*>(eight)->mSequences.size() == 8);
+    BOOST_CHECK(joined->size() == 2000);
+    BOOST_CHECK(dynamic_cast<XYJoin*>(joined)->mSequences.size() <= XYJoin::MAX_SEQUENCES);
+
+    bool indexed = true;
+    for (int i = 0; indexed && i < 2000; ++i)
+      indexed = joined->at(i)->toString(true) == lexical_cast<string>(i);
+    BOOST_CHECK(indexed);
+    BOOST_CHECK(eight->at(399)->toString(true) == "399");
+
+    XYSequence* rest(joined->tail()->tail());
+    BOOST_CHECK(rest->size() == 1998);
+    BOOST_CHECK(rest->head()->toString(true) == "2");
+
+    eight->set_at(50, new XYSymbol("x"));
+    BOOST_CHECK(lists[1]->at(0)->toString(true) == "x");
+    BOOST_CHECK(joined->at(50)->toString(true) == "50");
+  }
+  {
+    // ',' and cons return new sequences and leave their
+    // arguments unchanged.
+    BOOST_CHECK(eval_stack(io, "[1 2] a-aa 3 ,") == "[ [ 1 2 ] [ 1 2 3 ] ]");
+    BOOST_CHECK(eval_stack(io, "[3] [4] , a-aa [0] ab-ba ,") == "[ [ 3 4 ] [ 0 3 4 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2] a-aa 0 ab-ba cons.") == "[ [ 1 2 ] [ 0 1 2 ] ]");
+    BOOST_CHECK(eval_stack(io, "[2 3] puncons 4 , \"ab\" 1 ,") == "[ 2 [ 3 4 ] [ 97 98 1 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2] [a-aa] , 3 ab-ba .") == "[ 3 1 2 2 ]");
+
+    // The tail of a vector is a slice of it, as for other sequences,
+    // and adding to it shares the vector's tree.
+    BOOST_CHECK(eval_stack(io, "[1] 2 , a-aa puncons ab-b 99 0 abc-bca !") == "[ [ 1 99 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] a-aa puncons ab-b 99 0 abc-bca !") == "[ [ 1 99 3 ] ]");
+    XYVector* v(XYVector::make(new XYList()));
+    for (int i = 0; i < 100; ++i)
+      v = v->push_back(XYInteger::make(i));
+    XYSequence* rest(v->tail());
+    XYVector* shared(XYVector::make(rest));
+    BOOST_CHECK(dynamic_cast<XYSlice*>(rest));
+    BOOST_CHECK(shared->mRoot == v->mRoot && shared->size() == 99);
+    BOOST_CHECK(shared->push_back(new XYSymbol("x"))->at(99)->toString(true) == "x");
+    BOOST_CHECK(XYVector::make(new XYSlice(v, 0, 50))->push_back(new XYSymbol("y"))->at(50)->toString(true) == "y");
+    BOOST_CHECK(v->at(50)->toString(true) == "50" && rest->at(98)->toString(true) == "99");
+  }
+  {
+    // Span iteration gives the same elements as indexing for
+    // each kind of sequence, including ranges that cross the
+    // boundaries between spans.
+    XYList* list(new XYList());
+    for (int i = 0; i < 300; ++i)
+      list->mList.push_back(XYInteger::make(i));
+    XYSequence* slice(new XYSlice(list, 10, 250));
+    XYSequence* joined(list->join(slice)->join(new XYString("abc")));
+    XYSequence* vector(XYVector::make(list));
+    XYSequence* str(new XYString(string(150, 'x')));
+
+    BOOST_CHECK(dynamic_cast<XYJoin*>(joined));
+    BOOST_CHECK(span_matches(list, 0, 300));
+    BOOST_CHECK(span_matches(slice, 0, 240));
+    BOOST_CHECK(span_matches(slice, 5, 7));
+    BOOST_CHECK(span_matches(joined, 0, 543));
+    BOOST_CHECK(span_matches(joined, 290, 541));
+    BOOST_CHECK(span_matches(vector, 0, 300));
+    BOOST_CHECK(span_matches(vector, 31, 97));
+    BOOST_CHECK(span_matches(str, 0, 150));
+    BOOST_CHECK(span_matches(str, 60, 70));
+
+    BOOST_CHECK(joined->compare(joined) == 0);
+    BOOST_CHECK(slice->compare(list) > 0);
+    BOOST_CHECK(eval_stack(io, "[1 2] [3 4] , 10 +") == "[ [ 11 12 13 14 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2] [3 4] , 3 ?") == "[ 2 ]");
+    BOOST_CHECK(eval_stack(io, "[1 2] [3 4] , 5 ?") == "[ 4 ]");
+  }
+  {
+    // Long numeric literals and arithmetic on them or on ranges
+    // give packed vectors. Results match boxed arithmetic, falling
+    // back to it on overflow and when an element is not a native
+    // number.
+    XY* xy(new XY(io));
+    parse("20 enum 0 + [1.5 2 2.5 3 3.5 4 4.5 5 5.5 6 6.5 7 7.5 8 8.5 9]", back_inserter(xy->mY));
+    xy->eval();
+    BOOST_CHECK(xy->mX.size() == 2);
+    BOOST_CHECK(dynamic_cast<XYIntVector*>(xy->mX[0]));
+    BOOST_CHECK(!dynamic_cast<XYFloatVector*>(xy->mX[1]));
+    BOOST_CHECK(dynamic_cast<XYList*>(xy->mX[1]));
+
+    BOOST_CHECK(eval_stack(io, "4 enum") == "[ [ 0 1 2 3 ] ]");
+    BOOST_CHECK(eval_stack(io, "4 enum a-aa 1 + *") == "[ [ 0 2 6 12 ] ]");
+    BOOST_CHECK(eval_stack(io, "4 enum 1.5 -") == "[ [ -1.5 -0.5 0.5 1.5 ] ]");
+    BOOST_CHECK(eval_stack(io, "4 enum 2 %") == "[ [ 0 0.5 1 1.5 ] ]");
+    BOOST_CHECK(eval_stack(io, "4 enum -3 ^") == "[ [ 0 1 8 27 ] ]");
+    BOOST_CHECK(eval_stack(io, "2 4 enum ^") == "[ [ 1 2 4 8 ] ]");
+    BOOST_CHECK(eval_stack(io, "9 enum 2 + [2 3 4 5 6 7 8 9 10] =") == "[ 1 ]");
+    BOOST_CHECK(eval_stack(io, "3 enum 9223372036854775806 +") ==
+                "[ [ 9223372036854775806 9223372036854775807 9223372036854775808 ] ]");
+
+    XYObject* sum(xy->mX[0]->add(xy->mX[0]));
+    BOOST_CHECK(dynamic_cast<XYIntVector*>(sum));
+    BOOST_CHECK(sum->toString(true) == xy->mX[0]->multiply(XYInteger::make(2))->toString(true));
+    BOOST_CHECK(dynamic_cast<XYFloatVector*>(sum->multiply(new XYFloat(0.5))));
+
+    XYSequence* packed(dynamic_cast<XYSequence*>(xy->mX[0]));
+    packed->set_at(1, new XYSymbol("x"));
+    BOOST_CHECK(dynamic_cast<XYPackedVector*>(packed)->mBoxed);
+    BOOST_CHECK(packed->size() == 20);
+    BOOST_CHECK(packed->at(1)->toString(true) == "x");
+    BOOST_CHECK(packed->at(19)->toString(true) == "19");
+  }
+  {
+    // 'enum' gives a range that computes its elements, until
+    // one is set.
+    XY* xy(new XY(io));
+    parse("1000000000 enum", back_inserter(xy->mY));
+    xy->eval();
+    XYRange* range(dynamic_cast<XYRange*>(xy->mX.back()));
+    BOOST_CHECK(range && range->size() == 1000000000);
+    BOOST_CHECK(range->at(999999999)->toString(true) == "999999999");
+
+    XYRange* rest(dynamic_cast<XYRange*>(range->tail()->tail()));
+    BOOST_CHECK(rest && rest->size() == 999999998 && rest->head()->toString(true) == "2");
+    XYRange* part(dynamic_cast<XYRange*>(rest->slice(10, 15)));
+    BOOST_CHECK(part && part->toString(true) == "[ 12 13 14 15 16 ]");
+    BOOST_CHECK(span_matches(part, 0, 5));
+    BOOST_CHECK(!range->mElements);
+
+    // The tail and slices of a range share its elements, as slices
+    // of other sequences do.
+    range = new XYRange(0, 1, 20);
+    rest = dynamic_cast<XYRange*>(range->tail()->tail());
+    part = dynamic_cast<XYRange*>(rest->slice(10, 15));
+    BOOST_CHECK(rest && part);
+    part->set_at(0, new XYSymbol("x"));
+    BOOST_CHECK(range->mElements);
+    BOOST_CHECK(part->toString(true) == "[ x 13 14 15 16 ]");
+    BOOST_CHECK(rest->at(10)->toString(true) == "x");
+    BOOST_CHECK(range->at(12)->toString(true) == "x");
+    range->set_at(13, new XYSymbol("y"));
+    BOOST_CHECK(part->toString(true) == "[ x y 14 15 16 ]");
+    rest->set_at(1, new XYSymbol("z"));
+    BOOST_CHECK(range->at(3)->toString(true) == "z");
+    BOOST_CHECK(eval_stack(io, "10 enum r set r; 3 sdrop 4 stake s set 99 0 s; ! 3 r; @") == "[ 99 ]");
+
+    BOOST_CHECK(eval_stack(io, "5 enum puncons") == "[ 0 [ 1 2 3 4 ] ]");
+    BOOST_CHECK(eval_stack(io, "10 enum 3 sdrop 4 stake") == "[ [ 3 4 5 6 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] 1 sdrop [1 2 3] 5 stake") == "[ [ 2 3 ] [ 1 2 3 ] ]");
+    BOOST_CHECK(eval_stack(io, "5 enum [[[h T]] T] )") == "[ [ 1 2 3 4 ] ]");
+    BOOST_CHECK(eval_stack(io, "5 enum 2 * sum 5 enum [0 1 2 3 4] =") == "[ 20 1 ]");
+  }
+  {
+    // Reductions and scans give the same results for packed
+    // vectors and boxed sequences, and fall back to boxed
+    // arithmetic on overflow.
+    BOOST_CHECK(eval_stack(io, "100 enum sum 100 enum [] , sum") == "[ 4950 4950 ]");
+    BOOST_CHECK(eval_stack(io, "[] sum [] product") == "[ 0 1 ]");
+    BOOST_CHECK(eval_stack(io, "10 enum 1 + product") == "[ 3628800 ]");
+    BOOST_CHECK(eval_stack(io, "25 enum 1 + product") == "[ 15511210043330985984000000 ]");
+    BOOST_CHECK(eval_stack(io, "37 enum 17 - a-aa * min 37 enum 17 - max") == "[ 0 19 ]");
+    BOOST_CHECK(eval_stack(io, "[3 1.5 2] min [3 1.5 2] max") == "[ 1.5 3 ]");
+    BOOST_CHECK(eval_stack(io, "21 enum mean [1 2 3 4] mean") == "[ 10 2.5 ]");
+    BOOST_CHECK(eval_stack(io, "10 enum a-aa dot 10 enum 0.5 * a-aa dot") == "[ 285 71.25 ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] [4 5 6] dot") == "[ 32 ]");
+    BOOST_CHECK(eval_stack(io, "5 enum scan [1 2.5 3] scan") == "[ [ 0 1 3 6 10 ] [ 1 3.5 6.5 ] ]");
+    BOOST_CHECK(eval_stack(io, "2 enum 9223372036854775807 + a-aa sum ab-ba scan") ==
+                "[ 18446744073709551615 [ 9223372036854775807 18446744073709551615 ] ]");
+
+    XY* xy(new XY(io));
+    parse("[] min", back_inserter(xy->mY));
+    bool range = false;
+    try {
+      xy->eval();
+    }
+    catch (XYError& e) {
+      range = e.mCode == XYError::RANGE;
+    }
+    BOOST_CHECK(range);
+  }
+  {
+    // map and filter with quotations that don't need the
+    // interpreter build a pipeline that runs when it is used,
+    // in one pass that stops at the end of a take.
+    XY* xy(new XY(io));
+    parse("1000000000 enum [3 *] map. [2 % 1 +] map. [a-aa 10 > ab-ba 20 < *] filter. 2 sdrop 3 stake",
+          back_inserter(xy->mY));
+    xy->eval();
+    XYPipeline* pipeline(dynamic_cast<XYPipeline*>(xy->mX.back()));
+    BOOST_CHECK(pipeline && pipeline->mStages.size() == 5 && !pipeline->mElements);
+    BOOST_CHECK(dynamic_cast<XYRange*>(pipeline->mSource));
+    BOOST_CHECK(pipeline->toString(true) == "[ 14.5 16 17.5 ]");
+    BOOST_CHECK(pipeline->mElements);
+
+    BOOST_CHECK(eval_stack(io, "20 enum [a-aa *] map. [50 >=] filter. 20 enum [] , [a-aa *] map. [50 >=] filter. =") == "[ 1 ]");
+    BOOST_CHECK(eval_stack(io, "20 enum 0.5 * [2 - not] map. sum") == "[ 1 ]");
+    BOOST_CHECK(eval_stack(io, "[1 x 3] [1 =] map.") == "[ [ 1 0 0 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] [2 ^] map. [1 2 3] [[1 2] count +] map.") == "[ [ 1 4 9 ] [ 3 4 5 ] ]");
+    BOOST_CHECK(eval_stack(io, "20 enum [9223372036854775800 +] map. 3 stake") ==
+                "[ [ 9223372036854775800 9223372036854775801 9223372036854775802 ] ]");
+    BOOST_CHECK(eval_stack(io, "10 enum [9223372036854775800 +] map. max") == "[ 9223372036854775809 ]");
+    BOOST_CHECK(eval_stack(io, "30 enum [2 *] map. 0 stake 30 enum [2 *] map. 40 sdrop") == "[ [ ] [ ] ]");
+
+    // Changes to the source after map or filter don't change the
+    // result, whether or not the quotation needs the interpreter.
+    BOOST_CHECK(eval_stack(io, "[1 2 3] a-aa [10 *] map. ab-ba 99 0 abc-bca !") == "[ [ 10 20 30 ] ]");
+    BOOST_CHECK(eval_stack(io, "[1 2 3] a-aa [[1 2] count *] map. ab-ba 99 0 abc-bca !") == "[ [ 2 4 6 ] ]");
+    BOOST_CHECK(eval_stack(io, "20 enum a-aa [10 *] map. ab-ba 99 0 abc-bca ! 3 stake") == "[ [ 0 10 20 ] ]");
+    BOOST_CHECK(eval_stack(io, "20 enum 1 + a-aa [3 >] filter. ab-ba 0 0 abc-bca ! 3 stake") == "[ [ 4 5 6 ] ]");
+  }
+  {
+    // Strings are views of shared buffers. Tails and joins onto the
+    // end of a buffer don't copy, and setting a character copies
+    // the string first so other views are unchanged.
+    XYString* hello(new XYString("hello"));
+    XYString* rest(dynamic_cast<XYString*>(hello->tail()->tail()));
+    BOOST_CHECK(rest && rest->mBuffer == hello->mBuffer && rest->toString(false) == "llo");
+
+    XYString* world(dynamic_cast<XYString*>(hello->join(new XYString(" world"))));
+    BOOST_CHECK(world && world->mBuffer == hello->mBuffer);
+    XYString* there(dynamic_cast<XYString*>(hello->join(new XYString(" there"))));
+    BOOST_CHECK(there && there->mBuffer != hello->mBuffer);
+    BOOST_CHECK(hello->toString(false) == "hello" && hello->size() == 5);
+    BOOST_CHECK(world->toString(true) == "\"hello world\"" && there->toString(false) == "hello there");
+    BOOST_CHECK(rest->compare(new XYString("llo")) == 0 && world->compare(hello) > 0);
+
+    rest->set_at(0, XYInteger::make('L'));
+    BOOST_CHECK(rest->toString(false) == "Llo" && world->toString(false) == "hello world");
+    BOOST_CHECK(hello->substr(1, 3)->value() == "ell");
+
+    BOOST_CHECK(eval_stack(io, "\"\" 1000 [\"ab\" ,] do. count") == "[ 2000 ]");
+    BOOST_CHECK(eval_stack(io, "\"abcdef\" 2 sdrop 3 stake \"abc\" 10 stake \"abc\" 10 sdrop") ==
+                "[ \"cde\" \"abc\" \"\" ]");
+    BOOST_CHECK(eval_stack(io, "\"abc\" a-aa \"d\" , ab-ba \"e\" , \"de\" \"ab\" ab-ba , =") == "[ \"abcd\" 0 ]");
+  }
 
 }
 
@@ -414,18 +1077,85 @@ void testObjects(boost::asio::io_service& io)
 
     cout << o1 ->toString(true) << endl;
     cout << o2 ->toString(true) << endl;
-    set<XYObject*> circular1;
     XYObject* context1 = 0;
-    BOOST_CHECK(o1->lookup("b", circular1, &context1) == o2->getSlot("b"));
+    BOOST_CHECK(o1->lookup("b", &context1) == o2->getSlot("b"));
     BOOST_CHECK(context1 == o2);
 
-    set<XYObject*> circular2;
     XYObject* context2 = 0;
-    BOOST_CHECK(o1->lookup("a", circular2, &context2) == o1->getSlot("a"));
+    BOOST_CHECK(o1->lookup("a", &context2) == o1->getSlot("a"));
     BOOST_CHECK(context2 == o1);
 
-    set<XYObject*> circular3;
-    BOOST_CHECK(o1->lookup("c", circular3, 0) == 0);
+    BOOST_CHECK(o1->lookup("c", 0) == 0);
+  }
+  {
+    // Objects with the same slots share a shape
+    XYObject* m = new XYList();
+    XYObject* o1 = new XYObject();
+    XYObject* o2 = new XYObject();
+    o1->addSlot("a", m, new XYString("1"), false);
+    o1->addSlot("b", m, new XYString("2"), false);
+    o2->addSlot("a", m, new XYString("3"), false);
+    o2->addSlot("b", m, new XYString("4"), false);
+    BOOST_CHECK(o1->mShape == o2->mShape);
+
+    XYObject* o3 = o1->copy();
+    BOOST_CHECK(o3->mShape == o1->mShape);
+    BOOST_CHECK(o3->getSlot("b")->mValue == o1->getSlot("b")->mValue);
+
+    o1->removeSlot("a");
+    BOOST_CHECK(o1->mShape != o2->mShape);
+    BOOST_CHECK(o1->mSlots.size() == 1);
+    BOOST_CHECK(o1->getSlot("b")->mValue->toString(false) == "2");
+    BOOST_CHECK(o1->toString(false) == "(| b=2 |)");
+  }
+  {
+    // Cached lookups through objects with the same shape but
+    // different parents, and through circular parents.
+    XYObject* m = new XYList();
+    XYObject* p1 = new XYObject();
+    XYObject* p2 = new XYObject();
+    p1->addSlot("x", m, new XYString("1"), false);
+    p2->addSlot("x", m, new XYString("2"), false);
+    XYObject* o1 = new XYObject();
+    XYObject* o2 = new XYObject();
+    o1->addSlot("parent", m, p1, true);
+    o2->addSlot("parent", m, p2, true);
+    BOOST_CHECK(o1->mShape == o2->mShape);
+
+    XYObject* context = 0;
+    BOOST_CHECK(o1->lookup("x", &context) == p1->getSlot("x") && context == p1);
+    BOOST_CHECK(o2->lookup("x", &context) == p2->getSlot("x") && context == p2);
+    BOOST_CHECK(o1->lookup("x", &context) == p1->getSlot("x") && context == p1);
+
+    p1->addSlot("parent", m, o1, true);
+    BOOST_CHECK(o1->lookup("y", 0) == 0);
+    BOOST_CHECK(o1->lookup("y", 0) == 0);
+  }
+  {
+    // Slots on strings survive a collection
+    XYString* s(new XYString("abc"));
+    s->addSlot("foo", new XYList(), new XYString("bar"), false);
+    GarbageCollector::GC.addRoot(s);
+    GarbageCollector::GC.collect();
+    BOOST_CHECK(s->getSlot("foo")->mValue->toString(false) == "bar");
+    GarbageCollector::GC.removeRoot(s);
+  }
+  {
+    // Slots on vectors survive a collection
+    XYVector* v(XYVector::make(new XYList()));
+    BOOST_CHECK(slot_survives_collection(v->push_back(XYInteger::make(1))));
+  }
+  {
+    // Slots on packed vectors survive a collection
+    BOOST_CHECK(slot_survives_collection(new XYIntVector(3)));
+  }
+  {
+    // Slots on ranges survive a collection
+    BOOST_CHECK(slot_survives_collection(new XYRange(0, 1, 10)));
+  }
+  {
+    // Slots on pipelines survive a collection
+    BOOST_CHECK(slot_survives_collection(new XYPipeline(new XYRange(0, 1, 10))));
   }
 }
 
@@ -39,9 +39,7 @@ void XYThread::markChildren() {
 
 void XYThread::spawn() {
   mXY->mRepl = false;
-  for(XYLimits::iterator it = mXY->mLimits.begin(); it != mXY->mLimits.end(); ++it) {
-    (*it)->start(mXY);
-  }
+  mXY->startLimits();
 
   mXY->mService.post(bind(&XY::evalHandler, mXY));
 }
@@ -62,6 +60,13 @@ int XYThread::compare(XYObject* rhs) {
 }
 
 
+// Give 'child' a copy of each of the limits of 'xy'
+static void copy_limits(XY* xy, XY* child) {
+  for(XYLimits::iterator it = xy->mLimits.begin(); it != xy->mLimits.end(); ++it) {
+    child->mLimits.push_back((*it)->copy());
+  }
+}
+
 // make-thread [X^stack^queue Y] -> [X^thread Y]
 static void primitive_make_thread(XY* xy) {
   xy_assert(xy->mX.size() >= 2, XYError::STACK_UNDERFLOW);
@@ -82,13 +87,36 @@ static void primitive_make_thread(XY* xy) {
 
   child->mEnv = xy->mEnv;
   child->mP = xy->mP;
-  child->mLimits = xy->mLimits;
+  copy_limits(xy, child);
+  child->mQuantumSteps = xy->mQuantumSteps;
+  child->mQuantumMicroseconds = xy->mQuantumMicroseconds;
 
   XYThread* thread(new XYThread(child, xy));
 
   xy->mX.push_back(thread);
 }
 
+// Create a thread running 'queue' with the given 'stack' and
+// the additional limit.
+static XYThread* make_limited_thread(XY* xy, XYSequence* stack, XYSequence* queue, XYLimit* limit) {
+  XY* child(new XY(xy->mService));
+  stack->pushBackInto(child->mX);
+
+  XYSequence::List temp;
+  queue->pushBackInto(temp);
+  child->mY.insert(child->mY.begin(), temp.begin(), temp.end());
+
+  child->mEnv = xy->mEnv;
+  child->mP = xy->mP;
+  copy_limits(xy, child);
+  child->mQuantumSteps = xy->mQuantumSteps;
+  child->mQuantumMicroseconds = xy->mQuantumMicroseconds;
+
+  child->mLimits.push_back(limit);
+
+  return new XYThread(child, xy);
+}
+
 // make-limited-thread [X^stack^queue^ms Y] -> [X^thread Y]
 // If the thread takes longer to execute than the given milliseconds
 // then it is aborted.
@@ -106,22 +134,47 @@ static void primitive_make_limited_thread(XY* xy) {
   xy_assert(stack, XYError::TYPE);
   xy->mX.pop_back();
 
-  XY* child(new XY(xy->mService));
-  stack->pushBackInto(child->mX);
+  xy->mX.push_back(make_limited_thread(xy, stack, queue, new XYTimeLimit(ms->as_uint())));
+}
 
-  XYSequence::List temp;
-  queue->pushBackInto(temp);
-  child->mY.insert(child->mY.begin(), temp.begin(), temp.end());
+// make-tick-limited-thread [X^stack^queue^ticks Y] -> [X^thread Y]
+// If the thread runs more than the given number of steps
+// then it is aborted.
+static void primitive_make_tick_limited_thread(XY* xy) {
+  xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
+  XYNumber* ticks(dynamic_cast<XYNumber*>(xy->mX.back()));
+  xy_assert(ticks, XYError::TYPE);
+  xy->mX.pop_back();
 
-  child->mEnv = xy->mEnv;
-  child->mP = xy->mP;
-  child->mLimits = xy->mLimits;
+  XYSequence* queue(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(queue, XYError::TYPE);
+  xy->mX.pop_back();
 
-  child->mLimits.push_back(new XYTimeLimit(ms->as_uint()));
+  XYSequence* stack(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(stack, XYError::TYPE);
+  xy->mX.pop_back();
 
-  XYThread* thread(new XYThread(child, xy));
+  xy->mX.push_back(make_limited_thread(xy, stack, queue, new XYTickLimit(ticks->as_uint())));
+}
 
-  xy->mX.push_back(thread);
+// make-cpu-limited-thread [X^stack^queue^ms Y] -> [X^thread Y]
+// If the thread uses more than the given milliseconds of CPU
+// time then it is aborted.
+static void primitive_make_cpu_limited_thread(XY* xy) {
+  xy_assert(xy->mX.size() >= 3, XYError::STACK_UNDERFLOW);
+  XYNumber* ms(dynamic_cast<XYNumber*>(xy->mX.back()));
+  xy_assert(ms, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYSequence* queue(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(queue, XYError::TYPE);
+  xy->mX.pop_back();
+
+  XYSequence* stack(dynamic_cast<XYSequence*>(xy->mX.back()));
+  xy_assert(stack, XYError::TYPE);
+  xy->mX.pop_back();
+
+  xy->mX.push_back(make_limited_thread(xy, stack, queue, new XYCpuTimeLimit(ms->as_uint())));
 }
 
 // spawn [X^thread Y] -> [X^thread Y]
@@ -161,6 +214,7 @@ static void primitive_thread_stacks(XY* xy) {
 
   XYList* stack(new XYList(thread->mXY->mX.begin(), thread->mXY->mX.end()));
   XYList* queue(new XYList(thread->mXY->mY.begin(), thread->mXY->mY.end()));
+  queue_captured();
 
   xy->mX.push_back(stack);
   xy->mX.push_back(queue);
@@ -175,9 +229,11 @@ static void primitive_thread_join(XY* xy) {
   xy_assert(thread, XYError::TYPE);
 
   if (thread->mXY->mY.size() != 0) {
+    xy->materialize();
     xy->mY.push_front(new XYPrimitive("thread-join", primitive_thread_join));
     thread->mXY->mWaiting.push_back(xy);
-    throw XYError(xy, XYError::WAITING_FOR_ASYNC_EVENT);
+    xy->suspend();
+    return;
   }
 
   xy->mX.pop_back();
@@ -189,6 +245,8 @@ static void primitive_thread_join(XY* xy) {
 
 void install_thread_primitives(XY* xy) {
   xy->mP["make-limited-thread"] = new XYPrimitive("make-limited-thread", primitive_make_limited_thread);
+  xy->mP["make-tick-limited-thread"] = new XYPrimitive("make-tick-limited-thread", primitive_make_tick_limited_thread);
+  xy->mP["make-cpu-limited-thread"] = new XYPrimitive("make-cpu-limited-thread", primitive_make_cpu_limited_thread);
   xy->mP["make-thread"] = new XYPrimitive("make-thread", primitive_make_thread);
   xy->mP["thread-stacks"] = new XYPrimitive("thread-stacks", primitive_thread_stacks);
   xy->mP["thread-join"] = new XYPrimitive("thread-join", primitive_thread_join);